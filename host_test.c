@@ -0,0 +1,201 @@
+/******************************************************************************
+** Lispy is a simple interpreter for a Scheme/Python-like language
+** Copyright (C) 2010, 2011 Jack Trades (jacktradespublic@gmail.com)
+**
+** This file is part of Lispy
+**
+** Lispy is free software: you can redistribute it and/or
+** modify it under the terms of the GNU Affero General Public
+** License version 3 as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU Affero General Public License version 3 for more details.
+**
+** You should have received a copy of the GNU Affero General Public
+** License version 3 along with this program. If not, see
+** <http://www.gnu.org/licenses/>.
+**
+*******************************************************************************
+**
+** Tests of the interface in lispy.h, run with `make check`.  Each failed
+** check is printed, and the exit status is the number of them.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lispy.h"
+
+int failures = 0;
+
+#define check(condition) \
+  if (!(condition)) { \
+    printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #condition); \
+    failures++; \
+  }
+
+
+// Host Procedures
+//___________________________________//
+
+lispy_value *host_add(lispy_value *arguments) {
+  long int sum = 0;
+
+  for (; !lispy_is_empty_list(arguments); arguments = lispy_cdr(arguments)) {
+    if (!lispy_is_fixnum(lispy_car(arguments))) {
+      lispy_raise("host-add: expected fixnums");
+    }
+    sum += lispy_to_long(lispy_car(arguments));
+  }
+  return lispy_fixnum(sum);
+}
+
+char handler_message[1024];
+
+void count_errors(lispy_interpreter *interp, const char *message,
+                  void *data) {
+  *(int *) data += 1;
+  snprintf(handler_message, sizeof(handler_message), "%s", message);
+}
+
+
+// Output
+//___________________________________//
+
+// What evaluating source in interp writes to standard output
+char *eval_output(lispy_interpreter *interp, const char *source) {
+  static char output[1024];
+  FILE *capture = tmpfile();
+  long int length;
+  int saved;
+
+  fflush(stdout);
+  saved = dup(1);
+  dup2(fileno(capture), 1);
+  lispy_eval_string(interp, source);
+  fflush(stdout);
+  dup2(saved, 1);
+  close(saved);
+  rewind(capture);
+  length = fread(output, 1, sizeof(output) - 1, capture);
+  output[length] = '\0';
+  fclose(capture);
+  return output;
+}
+
+
+// Tests
+//___________________________________//
+
+void test_eval(lispy_interpreter *a) {
+  lispy_value *value;
+
+  value = lispy_eval_string(a, "(define (inc n) (+ n 1)) (inc 41)");
+  check(value != NULL && lispy_is_fixnum(value) && lispy_to_long(value) == 42);
+  value = lispy_eval_string(a, "(list 1 \"two\" 3.5)");
+  check(value != NULL && lispy_is_pair(value));
+  check(strcmp(lispy_write_string(value), "(1 \"two\" 3.5)") == 0);
+  check(lispy_to_double(lispy_car(lispy_cdr(lispy_cdr(value)))) == 3.5);
+  check(strcmp(lispy_to_string(lispy_car(lispy_cdr(value))), "two") == 0);
+  value = lispy_eval_string(a, "(touch (future (inc 1)))");
+  check(value != NULL && lispy_to_long(value) == 2);
+}
+
+void test_primitives(lispy_interpreter *a) {
+  lispy_value *value;
+
+  lispy_define_primitive(a, "host-add", host_add);
+  value = lispy_eval_string(a, "(host-add 1 2 (inc 2))");
+  check(value != NULL && lispy_to_long(value) == 6);
+  lispy_define(a, "host-list", lispy_cons(lispy_symbol("x"),
+                                          lispy_empty_list()));
+  value = lispy_eval_string(a, "(first host-list)");
+  check(value != NULL && lispy_is_symbol(value));
+  check(strcmp(lispy_to_string(value), "x") == 0);
+}
+
+void test_errors(lispy_interpreter *a) {
+  int count = 0;
+
+  lispy_set_error_handler(a, count_errors, &count);
+  check(lispy_eval_string(a, "(host-add 1 \"2\")") == NULL);
+  check(count == 1);
+  check(strcmp(lispy_error_message(a), "host-add: expected fixnums") == 0);
+  check(strcmp(handler_message, "host-add: expected fixnums") == 0);
+  check(lispy_eval_string(a, "(undefined-procedure 1)") == NULL);
+  check(count == 2);
+
+  // The interpreter still works after an error, and its output is not left
+  // going to a string port
+  check(lispy_eval_string(a, "(with-output-to-string"
+                             "  (lambda () (display \"lost\") (first 1)))")
+        == NULL);
+  check(count == 3);
+  check(strcmp(eval_output(a, "(display \"shown\")"), "shown") == 0);
+  check(lispy_to_long(lispy_eval_string(a, "(inc 1)")) == 2);
+  lispy_set_error_handler(a, NULL, NULL);
+}
+
+void test_isolation(lispy_interpreter *a, lispy_interpreter *b) {
+  int count = 0;
+  lispy_value *value;
+
+  lispy_set_error_handler(b, count_errors, &count);
+  check(lispy_eval_string(b, "(inc 1)") == NULL);
+  check(count == 1);
+  check(lispy_eval_string(b, "(host-add 1)") == NULL);
+  check(count == 2);
+  lispy_eval_string(a, "(define shared 'a)");
+  lispy_eval_string(b, "(define shared 'b)");
+  value = lispy_eval_string(a, "shared");
+  check(value != NULL && strcmp(lispy_to_string(value), "a") == 0);
+  value = lispy_eval_string(b, "shared");
+  check(value != NULL && strcmp(lispy_to_string(value), "b") == 0);
+
+  // An error in one interpreter leaves the other alone
+  check(lispy_eval_string(a, "(host-add 'a)") == NULL);
+  check(lispy_eval_string(b, "(first 1)") == NULL);
+  check(count == 3);
+  check(strcmp(lispy_error_message(a), "host-add: expected fixnums") == 0);
+  check(strcmp(eval_output(a, "(display shared)"), "a") == 0);
+}
+
+// What an interpreter left buffered in a file port is written when it is freed
+void test_output_files(lispy_interpreter *c) {
+  char contents[64] = "";
+  FILE *file;
+
+  lispy_eval_string(c, "(define out (open-output-file \"host_test.tmp\"))"
+                       "(write \"hello\" out)");
+  lispy_free(c);
+  file = fopen("host_test.tmp", "r");
+  check(file != NULL);
+  if (file != NULL) {
+    check(fgets(contents, sizeof(contents), file) != NULL);
+    check(strcmp(contents, "\"hello\"") == 0);
+    fclose(file);
+  }
+  remove("host_test.tmp");
+}
+
+
+int main(void) {
+  lispy_interpreter *a = lispy_new();
+  lispy_interpreter *b = lispy_new();
+
+  test_eval(a);
+  test_primitives(a);
+  test_errors(a);
+  test_isolation(a, b);
+  test_output_files(lispy_new());
+  lispy_free(a);
+  lispy_free(b);
+  if (failures == 0) {
+    printf("Host Test Completed Successfully\n");
+  }
+  return failures;
+}
@@ -26,7 +26,9 @@
 ** 
 ******************************************************************************/
 
+#define GC_THREADS
 #include <gc/gc.h>
+#include <gc/gc_mark.h>
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -34,11 +36,46 @@
 #include <ctype.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <math.h>
- 
-// Report Error and restart REPL
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <stdarg.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#include "lispy.h"
+
+// SIMD kernels are selected at compile time.  SSE2 is the baseline on x86-64,
+// build with -mavx2 for the 32 byte paths.  Anything else (or a build with
+// -DLISPY_NO_SIMD) uses the plain C versions.
+#if defined(__AVX2__) && !defined(LISPY_NO_SIMD)
+#include <immintrin.h>
+#define LISPY_AVX2
+#define LISPY_SSE2
+#elif defined(__SSE2__) && !defined(LISPY_NO_SIMD)
+#include <emmintrin.h>
+#define LISPY_SSE2
+#endif
+
+// Report Error and restart REPL, or jump back to recover_point when it is set
 void REPL(void);
-#define error(args...) fprintf(stderr, args); printf("\n"); REPL()
+void raise_error(const char *format, ...);
+void flush_output(void);
+#define error(args...) raise_error(args)
+
+// Errors jump back to recover_point instead of starting a REPL in pfor
+// chunks, futures, tasks and calls through lispy.h, with the message left in
+// error_message
+#define ERROR_MESSAGE_SIZE 1024
+__thread jmp_buf *recover_point;
+__thread char error_message[ERROR_MESSAGE_SIZE];
 
 
 /** ***************************************************************************
@@ -59,41 +96,136 @@ typedef enum {
   FIXNUM, FLONUM,
 
   // Sequences
-//  10     11     12
-  STRING, PAIR, VECTOR
+//  10     11     12          13                14            15
+  STRING, PAIR, VECTOR, NUMERIC_VECTOR, PERSISTENT_VECTOR, RANGE,
+
+  // Associations
+//    16            17
+  HASH_TABLE, PERSISTENT_MAP,
+
+  // I/O
+//  18
+  PORT,
+
+  // Concurrency
+//   19     20     21
+  FUTURE, TASK, CHANNEL
 
 } object_type;
 
+typedef enum {
+  CLOSED_PORT, INPUT_PORT, OUTPUT_PORT, STRING_PORT
+} port_kind;
+
+typedef enum {
+  F64_VECTOR, S64_VECTOR, U8_VECTOR
+} numeric_vector_kind;
+
+typedef enum {
+  IS_TABLE, EQUAL_TABLE
+} hash_table_kind;
+
+typedef enum {
+  FUTURE_PENDING, FUTURE_RUNNING, FUTURE_DONE, FUTURE_FAILED
+} future_state;
+
+// Size of the userspace buffer behind every file output port
+#define PORT_BUFFER_SIZE 65536
+
+// Strings shorter than this are stored inside their object
+#define STRING_INLINE_SIZE 16
 
-typedef struct object {
+typedef struct lispy_object {
   object_type type;
   union {
     long int fixnum;
     double   flonum;
     char     boolean;
-    char     character;
-    char     *string;
+    int      character;
     char     *symbol;
+    struct {                                  // STRING
+      char *chars;
+      long int length;                        // in bytes
+      long int count;                         // in characters, -1 if unknown
+      union {
+        struct {
+          long int capacity;
+          long int *offsets;                  // see string_offset
+        } heap;
+        char small[STRING_INLINE_SIZE];
+      } storage;
+    } string;
     struct {                                  // PAIR
-      struct object *car;
-      struct object *cdr;
+      struct lispy_object *car;
+      struct lispy_object *cdr;
     } pair;
     struct {                                  // VECTOR
       long int length;
-      struct object **vec;
+      long int capacity;                      // 0 for views
+      long int viewed;                        // views may see slots below
+      struct lispy_object **vec;
     } vector;
+    struct {                                  // NUMERIC_VECTOR
+      long int length;
+      union {
+        double *f64;
+        long int *s64;
+        unsigned char *u8;
+      } elements;
+      char kind;
+    } numeric_vector;
+    struct {                                  // RANGE
+      long int start;
+      long int stop;
+      long int step;
+    } range;
+    struct {                                  // HASH_TABLE
+      struct hash_slots *slots;               // see HASH TABLEs
+    } hash_table;
+    struct {                                  // PERSISTENT_VECTOR
+      struct pv_tree *tree;                   // see PERSISTENT VECTORs
+      long int start;
+      long int length;
+    } persistent_vector;
+    struct {                                  // PERSISTENT_MAP
+      struct hamt_node *root;                 // see PERSISTENT MAPs
+      long int count;
+      void *edit;                             // non-NULL while transient
+    } persistent_map;
     struct {                                  // PRIMITIVE_PROCEDURE
-      struct object *(*fn) (struct object *arguments);
+      struct lispy_object *(*fn) (struct lispy_object *arguments);
     } primitive_procedure;
     struct {                                  // COMPOUND_PROCEDURE
-      struct object *parameters;
-      struct object *body;
-      struct object *env;
-      struct object *docstring;
+      struct lispy_object *parameters;
+      struct lispy_object *body;
+      struct lispy_object *env;
+      struct lispy_object *docstring;
     } compound_procedure;
     struct {                                  // MACRO
-      struct object *transformer;
+      struct lispy_object *transformer;
     } macro;
+    struct {                                  // PORT
+      FILE *stream;
+      char *buffer;
+      long int length;
+      long int capacity;
+      char kind;
+    } port;
+    struct {                                  // FUTURE
+      struct lispy_object *exp;
+      struct lispy_object *env;
+      struct lispy_object *value;
+      struct lispy_interpreter *interpreter;  // that made the future
+      int state;                              // a future_state
+    } future;
+    struct {                                  // TASK
+      struct green_queue *waiters;            // see Tasks
+      struct lispy_object *value;
+      int state;                              // a future_state
+    } task;
+    struct {                                  // CHANNEL
+      struct channel_queue *queue;            // see make_channel
+    } channel;
   } data;
 } object;
 
@@ -128,12 +260,54 @@ object *test_symbol;
 object *else_symbol;
 object *rest_symbol;
 object *for_symbol;
+object *pfor_symbol;
+object *future_symbol;
+object *pmap_symbol;
+object *workers_keyword;
 object *from_symbol;
 object *list_symbol;
 object *vector_symbol;
+object *f64vector_symbol;
+object *s64vector_symbol;
+object *u8vector_symbol;
+object *hash_table_symbol;
 object *string_symbol;
 
-object *the_global_environment;
+
+// Interpreters
+//___________________________________//
+// The objects above never change once made, and the symbol table is locked,
+// so every interpreter in the process shares them.  What a program can
+// change lives in its interpreter.  Each thread runs the interpreter that
+// its current_interpreter points to, so interpreters on different threads
+// run independently of each other.
+
+typedef struct lispy_interpreter {
+  object *global_environment;
+  object *stdout_port;
+  object *output_port;                    // where display and write go
+  lispy_error_handler error_handler;      // see lispy.h
+  void *error_data;
+  char error_message[ERROR_MESSAGE_SIZE]; // of the last failed lispy_eval
+  long int generation;                    // bumped by in-place changes
+  object *changes;                        // global definitions, see pmap
+  struct green_scheduler *scheduler;      // of its tasks, see Tasks
+  object *output_files;                   // open file ports, see Ports
+  struct lispy_interpreter *next;         // in the list of interpreters
+} interpreter;
+
+__thread interpreter *current_interpreter;
+
+// Called whenever a mutating procedure changes what a program can see, since
+// pmap's workers only have a copy of it.  Global definitions and set! are
+// sent to the workers instead, see log_global_change.  Threads running pfor
+// bodies may get here at once, and any change of the count will do.
+void interpreter_changed(void) {
+  // Interpreters are being made while there is no current one
+  if (current_interpreter != NULL) {
+    __atomic_add_fetch(&current_interpreter->generation, 1, __ATOMIC_RELAXED);
+  }
+}
 
 
 // Function Prototypes
@@ -143,14 +317,26 @@ object *cons(object *car, object *cdr);
 object *car(object *pair);
 object *cdr(object *pair);
 
-void write(object *obj);
+void write_object(object *port, object *obj);
+void port_putc(object *port, char c);
+void port_puts(object *port, char *str);
+void port_flush(object *port);
+void display(object *port, object *obj);
+object *h_string_append(object *strings);
+object *h_string_builder(object *obj);
 object *h_vector(object *exp, object *env);
 object *h_length(object *obj);
 object *h_list(object *exp, object *env);
 object *h_string(object *exp, object *env);
 object *h_for(object *exp, object *env);
+object *h_future(object *exp, object *env);
+object *h_pmap(object *exp, object *env);
+object *h_sequence_list(object *seq);
 
 object *h_emptyp(object *obj);
+object *h_equalp(object *obj_1, object *obj_2);
+object *h_isp(object *obj_1, object *obj_2);
+object *persistent_vector_ref(object *vec, long int index);
 
 object *p_print(object *arguments);
 
@@ -159,13 +345,37 @@ object *p_print(object *arguments);
 //  Object Allocation
 //___________________________________//
 
+// Each thread takes objects from its own free list, refilled a batch at a
+// time by GC_malloc_many, so threads seldom meet on the allocator's lock.
+// The list hangs off an uncollectable block since the collector does not
+// scan thread-local storage.
+
+typedef struct {
+  void *objects;
+} alloc_buffer;
+
+__thread alloc_buffer *thread_alloc_buffer;
+
 object *alloc_object(void) {
+  alloc_buffer *buffer = thread_alloc_buffer;
   object *obj;
 
-  obj = GC_MALLOC(sizeof(object));
-  if (obj == NULL) {
-    error("Out of memory\n");
+  if (buffer == NULL) {
+    buffer = GC_MALLOC_UNCOLLECTABLE(sizeof(alloc_buffer));
+    if (buffer == NULL) {
+      error("Out of memory\n");
+    }
+    thread_alloc_buffer = buffer;
+  }
+  if (buffer->objects == NULL) {
+    buffer->objects = GC_malloc_many(sizeof(object));
+    if (buffer->objects == NULL) {
+      error("Out of memory\n");
+    }
   }
+  obj = buffer->objects;
+  buffer->objects = GC_NEXT(obj);
+  GC_NEXT(obj) = NULL;
   return obj;
 }
 
@@ -236,7 +446,7 @@ char is_flonum(object *obj) {
 // CHARACTERs
 //___________________________________//
 
-object *make_character(char value) {
+object *make_character(int value) {
   object *obj;
   
   obj = alloc_object();
@@ -250,42 +460,358 @@ char is_character(object *obj) {
 }
 
 
+// UTF-8
+//___________________________________//
+// Strings hold UTF-8 and CHARACTERs hold a codepoint.  Text from outside
+// (source files, FASL) is validated when its string is made; blocks of
+// ASCII are checked 16 or 32 bytes at a time.
+
+int utf8_encode(long int codepoint, char *buffer) {
+  if (codepoint < 0x80) {
+    buffer[0] = codepoint;
+    return 1;
+  }
+  if (codepoint < 0x800) {
+    buffer[0] = 0xC0 | (codepoint >> 6);
+    buffer[1] = 0x80 | (codepoint & 0x3F);
+    return 2;
+  }
+  if (codepoint < 0x10000) {
+    buffer[0] = 0xE0 | (codepoint >> 12);
+    buffer[1] = 0x80 | ((codepoint >> 6) & 0x3F);
+    buffer[2] = 0x80 | (codepoint & 0x3F);
+    return 3;
+  }
+  buffer[0] = 0xF0 | (codepoint >> 18);
+  buffer[1] = 0x80 | ((codepoint >> 12) & 0x3F);
+  buffer[2] = 0x80 | ((codepoint >> 6) & 0x3F);
+  buffer[3] = 0x80 | (codepoint & 0x3F);
+  return 4;
+}
+
+// Size of the character starting with byte c of valid UTF-8
+int utf8_size(char c) {
+  unsigned char u = c;
+  
+  if (u < 0x80) {
+    return 1;
+  }
+  if (u < 0xE0) {
+    return 2;
+  }
+  if (u < 0xF0) {
+    return 3;
+  }
+  return 4;
+}
+
+// The character starting at s in valid UTF-8
+long int utf8_decode(char *s) {
+  unsigned char *u = (unsigned char *) s;
+  
+  switch (utf8_size(*s)) {
+    case 1:
+      return u[0];
+    case 2:
+      return ((u[0] & 0x1F) << 6) | (u[1] & 0x3F);
+    case 3:
+      return ((u[0] & 0x0F) << 12) | ((u[1] & 0x3F) << 6) | (u[2] & 0x3F);
+    default:
+      return ((u[0] & 0x07) << 18) | ((u[1] & 0x3F) << 12) |
+             ((u[2] & 0x3F) << 6) | (u[3] & 0x3F);
+  }
+}
+
+// Number of characters in valid UTF-8: every byte but continuation bytes
+// (0x80 to 0xBF, which are -128 to -65 as signed bytes) starts one
+long int utf8_count(char *s, long int length) {
+  long int count = 0;
+  long int i = 0;
+  
+#if defined(LISPY_AVX2)
+  for (; i + 32 <= length; i += 32) {
+    __m256i v = _mm256_loadu_si256((__m256i *) (s + i));
+    count += __builtin_popcount(_mm256_movemask_epi8(
+               _mm256_cmpgt_epi8(v, _mm256_set1_epi8(-65))));
+  }
+#elif defined(LISPY_SSE2)
+  for (; i + 16 <= length; i += 16) {
+    __m128i v = _mm_loadu_si128((__m128i *) (s + i));
+    count += __builtin_popcount(_mm_movemask_epi8(
+               _mm_cmpgt_epi8(v, _mm_set1_epi8(-65))));
+  }
+#endif
+  for (; i < length; i++) {
+    if ((signed char) s[i] > -65) {
+      count += 1;
+    }
+  }
+  return count;
+}
+
+// Number of characters in s, or -1 if it is not valid UTF-8.  Overlong
+// forms, surrogates and codepoints past 0x10FFFF are rejected.
+long int utf8_validate(char *s, long int length) {
+  unsigned char *u = (unsigned char *) s;
+  long int count = 0;
+  long int i = 0;
+  unsigned char low;
+  unsigned char high;
+  int size;
+  int j;
+  
+  while (i < length) {
+    // Skip whole blocks without a byte of 0x80 or more
+#if defined(LISPY_AVX2)
+    while (i + 32 <= length &&
+           _mm256_movemask_epi8(_mm256_loadu_si256((__m256i *) (s + i))) == 0) {
+      i += 32;
+      count += 32;
+    }
+#elif defined(LISPY_SSE2)
+    while (i + 16 <= length &&
+           _mm_movemask_epi8(_mm_loadu_si128((__m128i *) (s + i))) == 0) {
+      i += 16;
+      count += 16;
+    }
+#endif
+    if (i == length) {
+      break;
+    }
+    if (u[i] < 0x80) {
+      i += 1;
+      count += 1;
+      continue;
+    }
+    
+    low = 0x80;
+    high = 0xBF;
+    if (u[i] >= 0xC2 && u[i] <= 0xDF) {
+      size = 2;
+    }
+    else if (u[i] >= 0xE0 && u[i] <= 0xEF) {
+      size = 3;
+      low = (u[i] == 0xE0) ? 0xA0 : low;
+      high = (u[i] == 0xED) ? 0x9F : high;
+    }
+    else if (u[i] >= 0xF0 && u[i] <= 0xF4) {
+      size = 4;
+      low = (u[i] == 0xF0) ? 0x90 : low;
+      high = (u[i] == 0xF4) ? 0x8F : high;
+    }
+    else {
+      return -1;
+    }
+    if (i + size > length || u[i + 1] < low || u[i + 1] > high) {
+      return -1;
+    }
+    for (j = 2; j < size; j++) {
+      if ((u[i + j] & 0xC0) != 0x80) {
+        return -1;
+      }
+    }
+    i += size;
+    count += 1;
+  }
+  return count;
+}
+
+
 // STRINGs
 //___________________________________//
 
-object *make_string(char *value) {
+// Strings know their length, so they may contain NULs.  Short strings keep
+// their characters in the object instead of a separate block.  Slices share
+// the characters of the string they were cut from and have a capacity of 0;
+// every other string keeps a NUL after its last character, so use
+// string_to_c before handing a string's characters to C.
+//
+// length is in bytes.  The number of characters is counted the first time
+// it is needed unless the constructor already knows it.
+
+// A string of length characters, all NUL
+object *make_empty_string(long int length) {
   object *obj;
   
   obj = alloc_object();
   obj->type = STRING;
-  obj->data.string = GC_MALLOC(strlen(value) + 1);
-  if (obj->data.string == NULL) {
-    error("out of memory\n");
+  obj->data.string.length = length;
+  obj->data.string.count = -1;
+  if (length < STRING_INLINE_SIZE) {
+    obj->data.string.chars = obj->data.string.storage.small;
+    memset(obj->data.string.chars, 0, STRING_INLINE_SIZE);
+  }
+  else {
+    obj->data.string.chars = GC_MALLOC_ATOMIC(length + 1);
+    if (obj->data.string.chars == NULL) {
+      error("out of memory\n");
+    }
+    obj->data.string.storage.heap.capacity = length;
+    obj->data.string.storage.heap.offsets = NULL;
+    obj->data.string.chars[length] = '\0';
+  }
+  return obj;
+}
+
+// Check that a string made from outside text is UTF-8 and count it
+object *validate_string(object *str) {
+  long int count = utf8_validate(str->data.string.chars,
+                                 str->data.string.length);
+  
+  if (count == -1) {
+    error("invalid UTF-8 in string");
   }
-  strcpy(obj->data.string, value);
+  str->data.string.count = count;
+  return str;
+}
+
+object *make_string_length(char *chars, long int length) {
+  object *obj = make_empty_string(length);
+  
+  memcpy(obj->data.string.chars, chars, length);
   return obj;
 }
 
+object *make_string(char *value) {
+  return make_string_length(value, strlen(value));
+}
+
 object *make_string_from_list(object *exp) {
   object *obj;
-  int count = 0;
+  object *lst;
+  char buffer[4];
+  long int length = 0;
+  long int count = 0;
+  char *chars;
+  
+  for (lst = exp; lst != the_empty_list; lst = cdr(lst)) {
+    length += utf8_encode(car(lst)->data.character, buffer);
+    count += 1;
+  }
+  obj = make_empty_string(length);
+  obj->data.string.count = count;
+  chars = obj->data.string.chars;
+  for (lst = exp; lst != the_empty_list; lst = cdr(lst)) {
+    chars += utf8_encode(car(lst)->data.character, chars);
+  }
+  return obj;
+}
+
+// A string sharing length bytes of str from byte start.  Short slices are
+// copied, since the characters fit in the object anyway.
+object *make_string_slice(object *str, long int start, long int length) {
+  object *obj;
   
+  if (length < STRING_INLINE_SIZE) {
+    return make_string_length(str->data.string.chars + start, length);
+  }
   obj = alloc_object();
   obj->type = STRING;
-  obj->data.string = GC_MALLOC(h_length(exp)->data.fixnum + 1);
-  if (obj->data.string == NULL) {
-    error("out of memory");
+  obj->data.string.chars = str->data.string.chars + start;
+  obj->data.string.length = length;
+  obj->data.string.count = -1;
+  obj->data.string.storage.heap.capacity = 0;
+  obj->data.string.storage.heap.offsets = NULL;
+  return obj;
+}
+
+char is_inline_string(object *str) {
+  return str->data.string.chars == str->data.string.storage.small;
+}
+
+long int string_capacity(object *str) {
+  if (is_inline_string(str)) {
+    return STRING_INLINE_SIZE - 1;
   }
+  return str->data.string.storage.heap.capacity;
+}
+
+// Number of characters in str.  The count, like the index below, is filled
+// in by whichever thread asks first, so both are published atomically: a
+// reader sees either nothing or the finished value, and threads racing to
+// fill them in store the same thing.
+long int string_count(object *str) {
+  long int count = __atomic_load_n(&str->data.string.count, __ATOMIC_ACQUIRE);
   
-  while (exp != the_empty_list) {
-    obj->data.string[count] = car(exp)->data.character;
-    exp = cdr(exp);
-    count += 1;
+  if (count == -1) {
+    count = utf8_count(str->data.string.chars, str->data.string.length);
+    __atomic_store_n(&str->data.string.count, count, __ATOMIC_RELEASE);
   }
+  return count;
+}
+
+#define STRING_INDEX_STRIDE 64
+
+// Byte offset of character index of str.  ASCII strings are indexed
+// directly.  Other heap strings build a sparse index of the offset of every
+// STRING_INDEX_STRIDE-th character the first time they are indexed, so at
+// most that many characters are stepped over.
+long int string_offset(object *str, long int index) {
+  char *chars = str->data.string.chars;
+  long int count = string_count(str);
+  long int *offsets;
+  long int offset = 0;
+  long int i = 0;
   
-  obj->data.string[count] = '\0';
+  if (count == str->data.string.length) {
+    return index;
+  }
+  if (index == count) {
+    return str->data.string.length;
+  }
+  if (!is_inline_string(str)) {
+    offsets = __atomic_load_n(&str->data.string.storage.heap.offsets,
+                              __ATOMIC_ACQUIRE);
+    if (offsets == NULL) {
+      offsets = GC_MALLOC_ATOMIC((count / STRING_INDEX_STRIDE + 1) *
+                                 sizeof(long int));
+      if (offsets == NULL) {
+        error("out of memory\n");
+      }
+      for (i = 0; i < count; i++) {
+        if (i % STRING_INDEX_STRIDE == 0) {
+          offsets[i / STRING_INDEX_STRIDE] = offset;
+        }
+        offset += utf8_size(chars[offset]);
+      }
+      __atomic_store_n(&str->data.string.storage.heap.offsets, offsets,
+                       __ATOMIC_RELEASE);
+    }
+    i = index - index % STRING_INDEX_STRIDE;
+    offset = offsets[index / STRING_INDEX_STRIDE];
+  }
+  for (; i < index; i++) {
+    offset += utf8_size(chars[offset]);
+  }
+  return offset;
+}
+
+// The character at index of str
+object *string_ref(object *str, long int index) {
+  return make_character(utf8_decode(str->data.string.chars +
+                                    string_offset(str, index)));
+}
+
+// The characters of str followed by a NUL, copied only for a slice
+char *string_to_c(object *str) {
+  if (string_capacity(str) != 0) {
+    return str->data.string.chars;
+  }
+  return make_string_length(str->data.string.chars,
+                            str->data.string.length)->data.string.chars;
+}
+
+// Negative, zero or positive like strcmp, but NULs compare as characters
+int string_compare(object *str_1, object *str_2) {
+  long int len_1 = str_1->data.string.length;
+  long int len_2 = str_2->data.string.length;
+  int result = memcmp(str_1->data.string.chars, str_2->data.string.chars,
+                      len_1 < len_2 ? len_1 : len_2);
   
-  return obj;
+  if (result != 0) {
+    return result;
+  }
+  return (len_1 > len_2) - (len_1 < len_2);
 }
   
 
@@ -297,18 +823,32 @@ char is_string(object *obj) {
 // VECTORs
 //___________________________________//
 
-object *make_vector_from_list(object *exp) {
+object *make_vector(long int length, object *fill) {
   object *obj;
-  long int len = h_length(exp)->data.fixnum;
-  long int count = 0;
+  long int count;
   
   obj = alloc_object();
   obj->type = VECTOR;
-  obj->data.vector.length = len;
-  obj->data.vector.vec = GC_MALLOC(len);
+  obj->data.vector.length = length;
+  obj->data.vector.capacity = length;
+  obj->data.vector.viewed = 0;
+  obj->data.vector.vec = GC_MALLOC(length * sizeof(object *));
   if (obj->data.vector.vec == NULL) {
     error("out of memory\n");
   }
+  
+  for (count = 0; count < length; count++) {
+    obj->data.vector.vec[count] = fill;
+  }
+  return obj;
+}
+
+object *make_vector_from_list(object *exp) {
+  object *obj;
+  long int len = h_length(exp)->data.fixnum;
+  long int count = 0;
+  
+  obj = make_vector(len, the_empty_list);
 
   while (exp != the_empty_list) {
     obj->data.vector.vec[count] = car(exp);
@@ -319,51 +859,59 @@ object *make_vector_from_list(object *exp) {
   return obj;
 }
 
-object *make_vector_from_vector(object *vec, int start, int end) {
+// A vector sharing length elements of vec from start.  rest and index
+// return these views, so walking or slicing a vector copies nothing.
+object *make_vector_slice(object *vec, long int start, long int length) {
   object *obj;
-  long int count = 0;
-
-  if (vec->data.vector.length == 0) {
-    return make_vector_from_list(the_empty_list);
-  }
-
+  
   obj = alloc_object();
   obj->type = VECTOR;
-  obj->data.vector.length = end - start;
-  obj->data.vector.vec = GC_MALLOC(end-start);
-  if (obj->data.vector.vec == NULL) {
-    error("out of memory\n");
+  obj->data.vector.length = length;
+  obj->data.vector.capacity = 0;
+  obj->data.vector.viewed = 0;
+  obj->data.vector.vec = vec->data.vector.vec + start;
+  if (vec->data.vector.viewed < start + length) {
+    vec->data.vector.viewed = start + length;
   }
+  return obj;
+}
+
+// Make room for one more element, doubling the storage when it is full.  A
+// view gets storage of its own first so the vector it shares is untouched,
+// and so does a vector whose next slot a view can still see after a pop.
+void vector_reserve(object *vec) {
+  long int capacity = vec->data.vector.capacity;
+  object **elements;
   
-  while (start < end) {
-    obj->data.vector.vec[count] = vec->data.vector.vec[start];
-    start += 1;
-    count += 1;
+  if (vec->data.vector.length < capacity &&
+      vec->data.vector.length >= vec->data.vector.viewed) {
+    return;
   }
-  
-  return obj;
+  capacity = (vec->data.vector.length < 4) ? 8 : 2 * vec->data.vector.length;
+  elements = GC_MALLOC(capacity * sizeof(object *));
+  if (elements == NULL) {
+    error("out of memory\n");
+  }
+  memcpy(elements, vec->data.vector.vec,
+         vec->data.vector.length * sizeof(object *));
+  vec->data.vector.vec = elements;
+  vec->data.vector.capacity = capacity;
+  vec->data.vector.viewed = 0;
+}
+
+void vector_push(object *vec, object *obj) {
+  vector_reserve(vec);
+  vec->data.vector.vec[vec->data.vector.length] = obj;
+  vec->data.vector.length += 1;
 }
 
 object *make_vector_from_string(object *str, int start, int end) {
   object *obj;
   long int count = 0;
 
-  if (h_emptyp(str) == True) {
-    return make_vector_from_list(the_empty_list);
-  }
-
-  obj = alloc_object();
-  obj->type = VECTOR;
-  obj->data.vector.length = end - start;
-  obj->data.vector.vec = GC_MALLOC(end-start);
-  if (obj->data.vector.vec == NULL) {
-    error("out of memory\n");
-  }
-  
+  obj = make_vector(end - start, the_empty_list);
   while (start < end) {
-    //printf("%c\n", str->data.string[start]);
-    write(make_character(str->data.string[start])); printf("\n");
-    obj->data.vector.vec[count] = make_character(str->data.string[start]);
+    obj->data.vector.vec[count] = string_ref(str, start);
     start += 1;
     count += 1;
   }
@@ -371,2425 +919,9596 @@ object *make_vector_from_string(object *str, int start, int end) {
   return obj;
 }
 
-// SYMBOLs
+// NUMERIC VECTORs
 //___________________________________//
+// Vectors of unboxed f64, s64 or u8 elements stored contiguously, so the
+// kernels in Numeric Vector Procedures can stream through them.
+
+int numeric_vector_element_size(char kind) {
+  switch (kind) {
+    case F64_VECTOR:
+      return sizeof(double);
+    case S64_VECTOR:
+      return sizeof(long int);
+    default:
+      return 1;
+  }
+}
 
-object *make_symbol(char *value) {
+char *numeric_vector_name(char kind) {
+  switch (kind) {
+    case F64_VECTOR:
+      return "f64vector";
+    case S64_VECTOR:
+      return "s64vector";
+    default:
+      return "u8vector";
+  }
+}
+
+// A numeric vector of length zeroed elements
+object *make_numeric_vector(char kind, long int length) {
   object *obj;
-  object *element;
+  long int size = length * numeric_vector_element_size(kind);
   
-  // search for the symbol in symbol_table
-  element = symbol_table;
-  while (!is_the_empty_list(element)) {
-    if (strcmp(car(element)->data.symbol, value) == 0) {
-      return car(element);
-    }
-    element = cdr(element);
+  obj = alloc_object();
+  obj->type = NUMERIC_VECTOR;
+  obj->data.numeric_vector.kind = kind;
+  obj->data.numeric_vector.length = length;
+  obj->data.numeric_vector.elements.u8 = GC_MALLOC_ATOMIC(size + 1);
+  if (obj->data.numeric_vector.elements.u8 == NULL) {
+    error("out of memory\n");
   }
+  memset(obj->data.numeric_vector.elements.u8, 0, size);
+  return obj;
+}
+
+// A numeric vector sharing length elements of vec from start
+object *make_numeric_vector_slice(object *vec, long int start,
+                                  long int length) {
+  object *obj;
+  char kind = vec->data.numeric_vector.kind;
   
-  // create a symbol and add it to symbol_table
   obj = alloc_object();
-  obj->type = SYMBOL;
-  obj->data.symbol = GC_MALLOC(strlen(value) + 1);
-  if (obj->data.symbol == NULL) {
-    error("out of memory\n");
+  obj->type = NUMERIC_VECTOR;
+  obj->data.numeric_vector.kind = kind;
+  obj->data.numeric_vector.length = length;
+  obj->data.numeric_vector.elements.u8 = vec->data.numeric_vector.elements.u8 +
+                                         start *
+                                         numeric_vector_element_size(kind);
+  return obj;
+}
+
+char is_numeric_vector(object *obj) {
+  return obj->type == NUMERIC_VECTOR;
+}
+
+object *numeric_vector_ref(object *vec, long int index) {
+  switch (vec->data.numeric_vector.kind) {
+    case F64_VECTOR:
+      return make_flonum(vec->data.numeric_vector.elements.f64[index]);
+    case S64_VECTOR:
+      return make_fixnum(vec->data.numeric_vector.elements.s64[index]);
+    default:
+      return make_fixnum(vec->data.numeric_vector.elements.u8[index]);
+  }
+}
+
+// Store a number, which must fit the element type of vec
+void numeric_vector_set(object *vec, long int index, object *value) {
+  char kind = vec->data.numeric_vector.kind;
+  
+  if (kind == F64_VECTOR && value->type == FLONUM) {
+    vec->data.numeric_vector.elements.f64[index] = value->data.flonum;
+  }
+  else if (kind == F64_VECTOR && value->type == FIXNUM) {
+    vec->data.numeric_vector.elements.f64[index] = value->data.fixnum;
+  }
+  else if (kind == S64_VECTOR && value->type == FIXNUM) {
+    vec->data.numeric_vector.elements.s64[index] = value->data.fixnum;
+  }
+  else if (kind == U8_VECTOR && value->type == FIXNUM &&
+           value->data.fixnum >= 0 && value->data.fixnum <= 255) {
+    vec->data.numeric_vector.elements.u8[index] = value->data.fixnum;
+  }
+  else {
+    error("%s: element does not fit", numeric_vector_name(kind));
+  }
+}
+
+object *make_numeric_vector_from_list(char kind, object *lst) {
+  object *obj = make_numeric_vector(kind, h_length(lst)->data.fixnum);
+  long int count = 0;
+  
+  while (lst != the_empty_list) {
+    numeric_vector_set(obj, count, car(lst));
+    lst = cdr(lst);
+    count += 1;
   }
-  strcpy(obj->data.symbol, value);
-  symbol_table = cons(obj, symbol_table);
   return obj;
 }
 
-char is_symbol(object *obj) {
-  return obj->type == SYMBOL;
+// Same kind, same length and elements that compare equal
+char numeric_vector_equal(object *vec_1, object *vec_2) {
+  long int length = vec_1->data.numeric_vector.length;
+  long int i;
+  
+  if (vec_1->data.numeric_vector.kind != vec_2->data.numeric_vector.kind ||
+      length != vec_2->data.numeric_vector.length) {
+    return 0;
+  }
+  switch (vec_1->data.numeric_vector.kind) {
+    case F64_VECTOR:
+      for (i = 0; i < length; i++) {
+        if (vec_1->data.numeric_vector.elements.f64[i] !=
+            vec_2->data.numeric_vector.elements.f64[i]) {
+          return 0;
+        }
+      }
+      return 1;
+    default:
+      return memcmp(vec_1->data.numeric_vector.elements.u8,
+                    vec_2->data.numeric_vector.elements.u8,
+                    length * numeric_vector_element_size(
+                               vec_1->data.numeric_vector.kind)) == 0;
+  }
 }
 
 
-// PAIRs
+// RANGEs
 //___________________________________//
+// The fixnums from start up to but not including stop, step apart.  A range
+// only holds its bounds: its elements are made as they are asked for.
 
-object *cons(object *car, object *cdr) {
+object *make_range(long int start, long int stop, long int step) {
   object *obj;
-  
+
   obj = alloc_object();
-  obj->type = PAIR;
-  obj->data.pair.car = car;
-  obj->data.pair.cdr = cdr;
+  obj->type = RANGE;
+  obj->data.range.start = start;
+  obj->data.range.stop = stop;
+  obj->data.range.step = step;
   return obj;
 }
 
-char is_pair(object *obj) {
-  return obj->type == PAIR;
+char is_range(object *obj) {
+  return obj->type == RANGE;
 }
 
-object *car(object *pair) {
-  return pair->data.pair.car;
+// The number of elements from start to stop, worked out unsigned since the
+// distance between two fixnums may not fit in one
+unsigned long int range_count(long int start, long int stop, long int step) {
+  if (step > 0 && stop > start) {
+    return ((unsigned long int) stop - (unsigned long int) start - 1) /
+           (unsigned long int) step + 1;
+  }
+  if (step < 0 && stop < start) {
+    return ((unsigned long int) start - (unsigned long int) stop - 1) /
+           -(unsigned long int) step + 1;
+  }
+  return 0;
 }
 
-object *cdr(object *pair) {
-  return pair->data.pair.cdr;
+// range makes sure this fits in a fixnum
+long int range_length(object *range) {
+  return range_count(range->data.range.start, range->data.range.stop,
+                     range->data.range.step);
 }
 
-object *set_car(object *obj, object* value) {
-  obj->data.pair.car = value;
+object *range_ref(object *range, long int index) {
+  return make_fixnum(range->data.range.start + index * range->data.range.step);
 }
 
-object *set_cdr(object *obj, object* value) {
-  obj->data.pair.cdr = value;
+// Ranges are equal when they have the same elements, however they got them
+char range_equal(object *range_1, object *range_2) {
+  long int length = range_length(range_1);
+
+  if (length != range_length(range_2)) {
+    return 0;
+  }
+  if (length == 0) {
+    return 1;
+  }
+  if (range_1->data.range.start != range_2->data.range.start) {
+    return 0;
+  }
+  return length == 1 || range_1->data.range.step == range_2->data.range.step;
 }
 
-#define caar(obj) car(car(obj))
-#define cadr(obj) car(cdr(obj))
-#define cdar(obj) cdr(car(obj))
-#define cddr(obj) cdr(cdr(obj))
-#define caaar(obj) car(car(car(obj)))
-#define caadr(obj) car(car(cdr(obj)))
-#define cadar(obj) car(cdr(car(obj)))
-#define caddr(obj) car(cdr(cdr(obj)))
-#define cdaar(obj) cdr(car(car(obj)))
-#define cdadr(obj) cdr(car(cdr(obj)))
-#define cddar(obj) cdr(cdr(car(obj)))
-#define cdddr(obj) cdr(cdr(cdr(obj)))
-#define caaaar(obj) car(car(car(car(obj))))
-#define caaadr(obj) car(car(car(cdr(obj))))
-#define caadar(obj) car(car(cdr(car(obj))))
-#define caaddr(obj) car(car(cdr(cdr(obj))))
-#define cadaar(obj) car(cdr(car(car(obj))))
-#define cadadr(obj) car(cdr(car(cdr(obj))))
-#define caddar(obj) car(cdr(cdr(car(obj))))
-#define cadddr(obj) car(cdr(cdr(cdr(obj))))
-#define cdaaar(obj) cdr(car(car(car(obj))))
-#define cdaadr(obj) cdr(car(car(cdr(obj))))
-#define cdadar(obj) cdr(car(cdr(car(obj))))
-#define cdaddr(obj) cdr(car(cdr(cdr(obj))))
-#define cddaar(obj) cdr(cdr(car(car(obj))))
-#define cddadr(obj) cdr(cdr(car(cdr(obj))))
-#define cdddar(obj) cdr(cdr(cdr(car(obj))))
-#define cddddr(obj) cdr(cdr(cdr(cdr(obj))))
-#define caddddr(obj) car(cdr(cdr(cdr(cdr(obj)))))
-#define cadddddr(obj) car(cdr(cdr(cdr(cdr(cdr(obj))))))
-#define caddddddr(obj) car(cdr(cdr(cdr(cdr(cdr(cdr(obj)))))))
 
-
-// PRIMITIVE_PROCEDUREs
+// HASH TABLEs
 //___________________________________//
+// Open addressing in the style of Swiss tables.  Every slot has a control
+// byte that is HASH_EMPTY, HASH_DELETED or the low 7 bits of the hash of its
+// key.  Slots are probed a group of 16 at a time: one SSE2 compare finds
+// every slot of the group whose control byte matches, and only those keys
+// are compared.  Groups are probed triangularly, which visits every group
+// since their number is a power of two.
+//
+// IS_TABLEs compare keys with is? and EQUAL_TABLEs with equal?, and each
+// hashes keys so that keys which compare equal hash equally.
+
+#define HASH_GROUP_SIZE 16
+#define HASH_EMPTY      (-128)
+#define HASH_DELETED    (-2)
+
+// How much of a list or vector equal-hashing looks at, which also keeps it
+// from following cycles forever
+#define HASH_DEPTH    4
+#define HASH_ELEMENTS 16
+
+typedef struct hash_slots {
+  signed char *control;
+  object **entries;                       // key and value of every slot
+  long int count;
+  long int used;                          // count and deleted slots
+  long int capacity;
+  char kind;
+} hash_slots;
+
+// FNV-1a over 8 byte words
+uint64_t hash_bytes(char *buffer, long length) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  uint64_t word;
+  long i = 0;
+
+  for (; i + 8 <= length; i += 8) {
+    memcpy(&word, &buffer[i], 8);
+    h = (h ^ word) * 0x100000001b3ULL;
+    h ^= h >> 29;
+  }
+  for (; i < length; i++) {
+    h = (h ^ (unsigned char) buffer[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// Spread every bit of h over the whole word (the MurmurHash3 finalizer), since
+// probing uses the low bits and control bytes the high ones
+uint64_t hash_mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+uint64_t hash_flonum(double d) {
+  uint64_t bits;
+
+  d += 0.0;                    // -0.0 is 0.0
+  memcpy(&bits, &d, sizeof(bits));
+  return bits;
+}
+
+// Consistent with is?: numbers and characters by value, the rest by address
+uint64_t hash_is(object *obj) {
+  switch (obj->type) {
+    case FIXNUM:
+      return hash_mix(obj->data.fixnum);
+    case FLONUM:
+      return hash_mix(hash_flonum(obj->data.flonum));
+    case CHARACTER:
+      return hash_mix(obj->data.character);
+    default:
+      return hash_mix((uintptr_t) obj);
+  }
+}
 
-object *make_primitive_procedure(object *(*fn) (struct object *arguments)) {
-  object *obj;
-  
-  obj = alloc_object();
-  obj->type = PRIMITIVE_PROCEDURE;
-  obj->data.primitive_procedure.fn = fn;
-  return obj;
+// Consistent with equal?
+uint64_t hash_equal(object *obj, int depth) {
+  uint64_t h = obj->type;
+  long int i;
+
+  switch (obj->type) {
+    case STRING:
+      return hash_mix(hash_bytes(obj->data.string.chars,
+                                 obj->data.string.length));
+    case PAIR:
+      for (i = 0; obj->type == PAIR && i < HASH_ELEMENTS &&
+                  depth > 0; i++) {
+        h = (h ^ hash_equal(car(obj), depth - 1)) * 0x100000001b3ULL;
+        obj = cdr(obj);
+      }
+      return hash_mix(h);
+    case VECTOR:
+      h ^= obj->data.vector.length;
+      for (i = 0; i < obj->data.vector.length && i < HASH_ELEMENTS &&
+                  depth > 0; i++) {
+        h = (h ^ hash_equal(obj->data.vector.vec[i], depth - 1)) *
+            0x100000001b3ULL;
+      }
+      return hash_mix(h);
+    case NUMERIC_VECTOR:
+      h ^= obj->data.numeric_vector.kind << 8;
+      if (obj->data.numeric_vector.kind != F64_VECTOR) {
+        return hash_mix(h ^ hash_bytes(
+                          (char *) obj->data.numeric_vector.elements.u8,
+                          obj->data.numeric_vector.length *
+                          numeric_vector_element_size(
+                            obj->data.numeric_vector.kind)));
+      }
+      for (i = 0; i < obj->data.numeric_vector.length; i++) {
+        h = (h ^ hash_flonum(obj->data.numeric_vector.elements.f64[i])) *
+            0x100000001b3ULL;
+      }
+      return hash_mix(h);
+    case PERSISTENT_VECTOR:
+      h ^= obj->data.persistent_vector.length;
+      for (i = 0; i < obj->data.persistent_vector.length &&
+                  i < HASH_ELEMENTS && depth > 0; i++) {
+        h = (h ^ hash_equal(persistent_vector_ref(obj, i), depth - 1)) *
+            0x100000001b3ULL;
+      }
+      return hash_mix(h);
+    case RANGE:
+      // By elements, as for range_equal
+      h ^= range_length(obj);
+      if (range_length(obj) > 0) {
+        h = (h ^ obj->data.range.start) * 0x100000001b3ULL;
+      }
+      if (range_length(obj) > 1) {
+        h = (h ^ obj->data.range.step) * 0x100000001b3ULL;
+      }
+      return hash_mix(h);
+    case PERSISTENT_MAP:
+      // Entries are in no particular order, so only the count is used
+      return hash_mix(h ^ obj->data.persistent_map.count);
+    default:
+      return hash_is(obj);
+  }
 }
 
-char is_primitive_procedure(object *obj) {
-  return obj->type == PRIMITIVE_PROCEDURE;
+uint64_t hash_key(object *table, object *key) {
+  if (table->data.hash_table.slots->kind == IS_TABLE) {
+    return hash_is(key);
+  }
+  return hash_equal(key, HASH_DEPTH);
 }
 
+char hash_keys_equal(object *table, object *key_1, object *key_2) {
+  if (key_1 == key_2) {
+    return 1;
+  }
+  if (table->data.hash_table.slots->kind == IS_TABLE) {
+    return h_isp(key_1, key_2) == True;
+  }
+  return h_equalp(key_1, key_2) == True;
+}
 
-// COMPOUND_PROCEDUREs
-//___________________________________//
+// Bit i is set for every control byte i of a group equal to byte
+unsigned int hash_group_match(signed char *group, signed char byte) {
+#if defined(LISPY_SSE2)
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(
+           _mm_loadu_si128((__m128i *) group), _mm_set1_epi8(byte)));
+#else
+  unsigned int bits = 0;
+  int i;
 
-object *make_compound_procedure(object *parameters, object *arguments,
-                                object* env, object *docstring) {
-  object *obj;
-  obj = alloc_object();
-  obj->type = COMPOUND_PROCEDURE;
-  obj->data.compound_procedure.parameters = parameters;
-  obj->data.compound_procedure.body = arguments;
-  obj->data.compound_procedure.env = env;
-  obj->data.compound_procedure.docstring = docstring;
-  return obj;
+  for (i = 0; i < HASH_GROUP_SIZE; i++) {
+    if (group[i] == byte) {
+      bits |= 1 << i;
+    }
+  }
+  return bits;
+#endif
 }
 
-char is_compound_procedure(object *obj) {
-  return obj->type == COMPOUND_PROCEDURE;
-}
+// Bit i is set for every slot i of a group that is empty or deleted
+unsigned int hash_group_free(signed char *group) {
+#if defined(LISPY_SSE2)
+  return _mm_movemask_epi8(_mm_loadu_si128((__m128i *) group));
+#else
+  unsigned int bits = 0;
+  int i;
 
-char is_procedure(object *obj) {
-  return obj->type == COMPOUND_PROCEDURE || obj->type == PRIMITIVE_PROCEDURE;
+  for (i = 0; i < HASH_GROUP_SIZE; i++) {
+    if (group[i] < 0) {
+      bits |= 1 << i;
+    }
+  }
+  return bits;
+#endif
 }
 
-// MACROs
-//___________________________________//
+// Set up empty storage for capacity slots, a power of two of at least
+// HASH_GROUP_SIZE
+void hash_table_allocate(object *table, long int capacity) {
+  hash_slots *slots = table->data.hash_table.slots;
 
-object *make_macro(object *transformer) {
+  slots->control = GC_MALLOC_ATOMIC(capacity);
+  slots->entries = GC_MALLOC(2 * capacity * sizeof(object *));
+  if (slots->control == NULL || slots->entries == NULL) {
+    error("out of memory\n");
+  }
+  memset(slots->control, HASH_EMPTY, capacity);
+  slots->capacity = capacity;
+  slots->count = 0;
+  slots->used = 0;
+}
+
+object *make_hash_table(char kind) {
   object *obj;
+
   obj = alloc_object();
-  obj->type = MACRO;
-  obj->data.macro.transformer = transformer;
+  obj->type = HASH_TABLE;
+  obj->data.hash_table.slots = GC_MALLOC(sizeof(hash_slots));
+  if (obj->data.hash_table.slots == NULL) {
+    error("out of memory\n");
+  }
+  obj->data.hash_table.slots->kind = kind;
+  hash_table_allocate(obj, HASH_GROUP_SIZE);
   return obj;
 }
 
-char is_macro(object *obj) {
-  return obj->type == MACRO;
+char is_hash_table(object *obj) {
+  return obj->type == HASH_TABLE;
+}
+
+// The slot holding key, or -1
+long int hash_table_find(object *table, object *key) {
+  hash_slots *slots = table->data.hash_table.slots;
+  uint64_t hash = hash_key(table, key);
+  signed char tag = hash >> 57;
+  long int groups = slots->capacity / HASH_GROUP_SIZE;
+  long int group = (hash & (groups - 1));
+  signed char *control;
+  unsigned int bits;
+  long int slot;
+  long int step;
+
+  for (step = 1; step <= groups; step++) {
+    control = slots->control + group * HASH_GROUP_SIZE;
+    for (bits = hash_group_match(control, tag); bits != 0; bits &= bits - 1) {
+      slot = group * HASH_GROUP_SIZE + __builtin_ctz(bits);
+      if (hash_keys_equal(table, key, slots->entries[2 * slot])) {
+        return slot;
+      }
+    }
+    // A key is never stored past a group with an empty slot
+    if (hash_group_match(control, HASH_EMPTY) != 0) {
+      return -1;
+    }
+    group = (group + step) & (groups - 1);
+  }
+  return -1;
+}
+
+// Store key in a free slot, which the caller knows is not there already
+void hash_table_place(object *table, object *key, object *value) {
+  hash_slots *slots = table->data.hash_table.slots;
+  uint64_t hash = hash_key(table, key);
+  long int groups = slots->capacity / HASH_GROUP_SIZE;
+  long int group = (hash & (groups - 1));
+  long int step = 1;
+  unsigned int bits;
+  long int slot;
+
+  while ((bits = hash_group_free(slots->control +
+                                 group * HASH_GROUP_SIZE)) == 0) {
+    group = (group + step) & (groups - 1);
+    step += 1;
+  }
+  slot = group * HASH_GROUP_SIZE + __builtin_ctz(bits);
+  if (slots->control[slot] == HASH_EMPTY) {
+    slots->used += 1;
+  }
+  slots->control[slot] = hash >> 57;
+  slots->entries[2 * slot] = key;
+  slots->entries[2 * slot + 1] = value;
+  slots->count += 1;
+}
+
+// Rebuild the table without deleted slots, twice as big if it is more than
+// half full
+void hash_table_rehash(object *table) {
+  hash_slots *slots = table->data.hash_table.slots;
+  long int capacity = slots->capacity;
+  signed char *control = slots->control;
+  object **entries = slots->entries;
+  long int slot;
+
+  hash_table_allocate(table, (2 * slots->count >= capacity) ?
+                             2 * capacity : capacity);
+  for (slot = 0; slot < capacity; slot++) {
+    if (control[slot] >= 0) {
+      hash_table_place(table, entries[2 * slot], entries[2 * slot + 1]);
+    }
+  }
 }
 
-/** ***************************************************************************
-**                             ENVIRONMENTs
-******************************************************************************/
-
-// Frames
-//___________________________________//
+void hash_table_set(object *table, object *key, object *value) {
+  hash_slots *slots = table->data.hash_table.slots;
+  long int slot = hash_table_find(table, key);
 
-object *make_frame(object *variables, object *values) {
-  return cons(variables, values);
+  if (slot != -1) {
+    slots->entries[2 * slot + 1] = value;
+    return;
+  }
+  // Keep at least an eighth of the slots empty so probing stays short
+  if (slots->used + 1 > slots->capacity / 8 * 7) {
+    hash_table_rehash(table);
+  }
+  hash_table_place(table, key, value);
 }
 
-object *frame_variables(object *frame) {
-  return car(frame);
+// The value stored under key, or NULL
+object *hash_table_get(object *table, object *key) {
+  long int slot = hash_table_find(table, key);
+
+  if (slot == -1) {
+    return NULL;
+  }
+  return table->data.hash_table.slots->entries[2 * slot + 1];
 }
 
-object *frame_values(object *frame) {
-  return cdr(frame);
+char hash_table_remove(object *table, object *key) {
+  hash_slots *slots = table->data.hash_table.slots;
+  long int slot = hash_table_find(table, key);
+
+  if (slot == -1) {
+    return 0;
+  }
+  slots->control[slot] = HASH_DELETED;
+  slots->entries[2 * slot] = NULL;
+  slots->entries[2 * slot + 1] = NULL;
+  slots->count -= 1;
+  return 1;
 }
 
-void add_binding_to_frame(object *var, object *val, object *frame) {
-  set_car(frame, cons(var, car(frame)));
-  set_cdr(frame, cons(val, cdr(frame)));
+// Every entry as a (key . value) pair, in slot order
+object *hash_table_entries(object *table) {
+  hash_slots *slots = table->data.hash_table.slots;
+  object *result = the_empty_list;
+  long int slot;
+
+  for (slot = slots->capacity - 1; slot >= 0; slot--) {
+    if (slots->control[slot] >= 0) {
+      result = cons(cons(slots->entries[2 * slot],
+                         slots->entries[2 * slot + 1]),
+                    result);
+    }
+  }
+  return result;
 }
 
 
-// Environments
+// PERSISTENT VECTORs
 //___________________________________//
-
-char is_the_empty_environment(object *env) {
-  return env == the_empty_list;
+// Immutable vectors in the style of Clojure's: a tree of 32-way nodes holds
+// every element but the last 1 to 32, which are kept in a tail so that conj
+// only touches the tree once every 32 elements.  An update copies the nodes
+// on the path from the root to its element and shares the rest with the old
+// vector, so lookups and updates take log32 n steps.
+//
+// rest and index make views which share the whole tree and only differ in
+// start and length.  A transient owns the nodes it has copied, which carry
+// its edit token, and changes those in place until persistent! freezes it.
+
+#define PV_BITS  5
+#define PV_WIDTH (1 << PV_BITS)
+#define PV_MASK  (PV_WIDTH - 1)
+
+typedef struct pv_node {
+  void *edit;
+  void *slots[PV_WIDTH];                  // children, or elements in leaves
+} pv_node;
+
+typedef struct pv_tree {
+  pv_node *root;
+  object **tail;                          // PV_WIDTH slots
+  long int count;
+  int shift;                              // PV_BITS per level above leaves
+  void *edit;                             // non-NULL while transient
+} pv_tree;
+
+// Something no other transient has, to mark the nodes a transient owns
+void *make_edit_token(void) {
+  void *edit = GC_MALLOC_ATOMIC(1);
+
+  if (edit == NULL) {
+    error("out of memory\n");
+  }
+  return edit;
 }
 
-object *current_environment(object *env) {
-  return car(env);
-}
+pv_node *pv_node_copy(pv_node *node, void *edit) {
+  pv_node *copy = GC_MALLOC(sizeof(pv_node));
 
-object *enclosing_environment(object *env) {
-  return cdr(env);
+  if (copy == NULL) {
+    error("out of memory\n");
+  }
+  if (node != NULL) {
+    memcpy(copy->slots, node->slots, sizeof(copy->slots));
+  }
+  copy->edit = edit;
+  return copy;
 }
 
-object *extend_environment(object *vars, object *vals, object *base_env) {
-  return cons(make_frame(vars, vals), base_env);
-}
+object **pv_tail_copy(object **tail) {
+  object **copy = GC_MALLOC(PV_WIDTH * sizeof(object *));
 
+  if (copy == NULL) {
+    error("out of memory\n");
+  }
+  if (tail != NULL) {
+    memcpy(copy, tail, PV_WIDTH * sizeof(object *));
+  }
+  return copy;
+}
 
-// Variables
-//___________________________________//
+pv_tree *pv_tree_make(void *edit) {
+  pv_tree *tree = GC_MALLOC(sizeof(pv_tree));
 
-object *lookup_variable_value(object *var, object *env) {
-  object *frame;
-  object *vars;
-  object *vals;
-  while (!is_the_empty_environment(env)) {
-    frame = current_environment(env);
-    vars = frame_variables(frame);
-    vals = frame_values(frame);
-    while (!is_the_empty_list(vars)) {
-      if (var == car(vars)) {
-        return car(vals);
-      }
-      vars = cdr(vars);
-      vals = cdr(vals);
-    }
-    env = enclosing_environment(env);
+  if (tree == NULL) {
+    error("out of memory\n");
   }
-  error("Unbound Variable: %s", var->data.symbol);
+  tree->root = pv_node_copy(NULL, edit);
+  tree->tail = pv_tail_copy(NULL);
+  tree->count = 0;
+  tree->shift = PV_BITS;
+  tree->edit = edit;
+  return tree;
 }
 
-void set_variable_value(object *var, object *val, object *env) {
-  object *frame;
-  object *vars;
-  object *vals;
-  
-  while (!is_the_empty_environment(env)) {
-    frame = current_environment(env);
-    vars = frame_variables(frame);
-    vals = frame_values(frame);
-    while (!is_the_empty_list(vars)) {
-      if (var == car(vars)) {
-        set_car(vals, val);
-        return;
-      }
-      vars = cdr(vars);
-      vals = cdr(vals);
-    }
-    env = enclosing_environment(env);
+// The tree to change: itself while transient, otherwise a copy
+pv_tree *pv_tree_edit(pv_tree *tree) {
+  pv_tree *copy;
+
+  if (tree->edit != NULL) {
+    return tree;
   }
-  error("Can not set unbound variable: %s\n", var->data.symbol);
+  copy = GC_MALLOC(sizeof(pv_tree));
+  if (copy == NULL) {
+    error("out of memory\n");
+  }
+  *copy = *tree;
+  copy->tail = pv_tail_copy(tree->tail);
+  return copy;
 }
 
-void define_variable(object *var, object *val, object *env) {
-  object *frame;
-  object *vars;
-  object *vals;
-  
-  frame = current_environment(env);
-  vars = frame_variables(frame);
-  vals = frame_values(frame);
-  
-  while (!is_the_empty_list(vars)) {
-    if (var == car(vars)) {
-      set_car(vals, val);
-      return;
-    }
-    vars = cdr(vars);
-    vals = cdr(vals);
+// node, if tree may change it in place, or a copy it may
+pv_node *pv_editable(pv_tree *tree, pv_node *node) {
+  if (tree->edit != NULL && node->edit == tree->edit) {
+    return node;
   }
-  add_binding_to_frame(var, val, frame);
+  return pv_node_copy(node, tree->edit);
 }
 
+// Index of the first element in the tail
+long int pv_tail_offset(long int count) {
+  if (count < PV_WIDTH) {
+    return 0;
+  }
+  return ((count - 1) >> PV_BITS) << PV_BITS;
+}
 
+// The leaf, or the tail, holding element index
+object **pv_tree_leaf(pv_tree *tree, long int index) {
+  pv_node *node = tree->root;
+  int level;
 
-/** ***************************************************************************
-**                                   Read
-******************************************************************************/
+  if (index >= pv_tail_offset(tree->count)) {
+    return tree->tail;
+  }
+  for (level = tree->shift; level > 0; level -= PV_BITS) {
+    node = node->slots[(index >> level) & PV_MASK];
+  }
+  return (object **) node->slots;
+}
 
-char is_delimiter(int c) {
-  return isspace(c) || c == EOF ||
-     c == '(' || c == ')' ||
-     c == '"' || c == ';';
+object *pv_tree_ref(pv_tree *tree, long int index) {
+  return pv_tree_leaf(tree, index)[index & PV_MASK];
 }
 
-char is_initial(int c) {
-  return isalpha(c) || c == '*' || c == '/' || c == '>' ||
-         c == '<'   || c == '=' || c == '?' || c == '!' ||
-         c == '-'   || c == '&';
+pv_tree *pv_tree_set(pv_tree *tree, long int index, object *value) {
+  pv_node *node;
+  void **child;
+  int level;
+
+  tree = pv_tree_edit(tree);
+  if (index >= pv_tail_offset(tree->count)) {
+    tree->tail[index & PV_MASK] = value;
+    return tree;
+  }
+  tree->root = pv_editable(tree, tree->root);
+  node = tree->root;
+  for (level = tree->shift; level > 0; level -= PV_BITS) {
+    child = &node->slots[(index >> level) & PV_MASK];
+    *child = pv_editable(tree, *child);
+    node = *child;
+  }
+  node->slots[index & PV_MASK] = value;
+  return tree;
 }
 
+// A chain of nodes from level down to leaf
+pv_node *pv_new_path(pv_tree *tree, int level, pv_node *leaf) {
+  pv_node *node;
 
-// Peek at Next Character
-//___________________________________//
+  if (level == 0) {
+    return leaf;
+  }
+  node = pv_node_copy(NULL, tree->edit);
+  node->slots[0] = pv_new_path(tree, level - PV_BITS, leaf);
+  return node;
+}
 
-int peek(FILE *in) {
-  int c;
+// Hang leaf after the last one under parent, which has room for it
+pv_node *pv_push_leaf(pv_tree *tree, int level, pv_node *parent,
+                      pv_node *leaf) {
+  int branch = ((tree->count - 1) >> level) & PV_MASK;
+  pv_node *node = pv_editable(tree, parent);
 
-  c = getc(in);
-  ungetc(c, in);
-  return c;
+  if (level == PV_BITS) {
+    node->slots[branch] = leaf;
+  }
+  else if (node->slots[branch] != NULL) {
+    node->slots[branch] = pv_push_leaf(tree, level - PV_BITS,
+                                       node->slots[branch], leaf);
+  }
+  else {
+    node->slots[branch] = pv_new_path(tree, level - PV_BITS, leaf);
+  }
+  return node;
 }
 
-void peek_expected_delimiter(FILE *in) {
-  if (!is_delimiter(peek(in))) {
-    error("Character not followed by delimiter");
+pv_tree *pv_tree_push(pv_tree *tree, object *value) {
+  long int offset;
+  pv_node *leaf;
+  pv_node *root;
+
+  tree = pv_tree_edit(tree);
+  offset = tree->count - pv_tail_offset(tree->count);
+  if (offset < PV_WIDTH) {
+    tree->tail[offset] = value;
+    tree->count += 1;
+    return tree;
+  }
+  // The tail is full: it becomes a leaf and a new tail starts
+  leaf = pv_node_copy(NULL, tree->edit);
+  memcpy(leaf->slots, tree->tail, sizeof(leaf->slots));
+  if ((tree->count >> PV_BITS) > (1L << tree->shift)) {
+    root = pv_node_copy(NULL, tree->edit);
+    root->slots[0] = tree->root;
+    root->slots[1] = pv_new_path(tree, tree->shift, leaf);
+    tree->root = root;
+    tree->shift += PV_BITS;
+  }
+  else {
+    tree->root = pv_push_leaf(tree, tree->shift, tree->root, leaf);
   }
+  tree->tail = pv_tail_copy(NULL);
+  tree->tail[0] = value;
+  tree->count += 1;
+  return tree;
 }
 
+object *make_persistent_vector(pv_tree *tree, long int start,
+                               long int length) {
+  object *obj;
 
-// Remove Whitespace
-//___________________________________//
+  obj = alloc_object();
+  obj->type = PERSISTENT_VECTOR;
+  obj->data.persistent_vector.tree = tree;
+  obj->data.persistent_vector.start = start;
+  obj->data.persistent_vector.length = length;
+  return obj;
+}
 
-void remove_whitespace(FILE *in) {
-  int c;
-    
-  while ((c = getc(in)) != EOF) {
-    if (isspace(c)) {
-      continue;
-    }
-    else if (c == ';') { // comments are whitespace also
-      while (((c = getc(in)) != EOF) && (c != '\n'));
-      continue;
-    }
-    ungetc(c, in);
-    break;
-  }
+char is_persistent_vector(object *obj) {
+  return obj->type == PERSISTENT_VECTOR;
 }
 
+object *persistent_vector_ref(object *vec, long int index) {
+  return pv_tree_ref(vec->data.persistent_vector.tree,
+                     vec->data.persistent_vector.start + index);
+}
 
-// Read Characters
-//___________________________________//
+// A tree of just the elements vec sees, transient when edit is not NULL
+pv_tree *persistent_vector_tree(object *vec, void *edit) {
+  pv_tree *tree = pv_tree_make(edit != NULL ? edit : make_edit_token());
+  long int i;
 
-// Read #\newline and #\space characters
-void read_expected_string(FILE *in, char *str) {
-  int c;
-  
-  while (*str != '\0') {
-    c = getc(in);
-    if (c != *str) {
-      error("unexpected character '%c'\n", c);
-    }
-    str++;
+  for (i = 0; i < vec->data.persistent_vector.length; i++) {
+    pv_tree_push(tree, persistent_vector_ref(vec, i));
   }
+  tree->edit = edit;
+  return tree;
 }
 
-// Read a character
+object *persistent_vector_from_list(object *lst) {
+  pv_tree *tree = pv_tree_make(make_edit_token());
 
-object *read_character(FILE *in) {
-  int c;
-  
-  c = getc(in);
-  
-  switch (c) {
-    case EOF:
-      error("incomplete character literal");
-    // #\space
-    case 's':
-      if (peek(in) == 'p') {
-        read_expected_string(in, "pace");
-        peek_expected_delimiter(in);
-        return make_character(' ');
-      }
-      break;
-    // #\newline
-    case 'n':
-      if (peek(in) == 'e') {
-        read_expected_string(in, "ewline");
-        peek_expected_delimiter(in);
-        return make_character('\n');
-      }
-      break;
+  for (; lst != the_empty_list; lst = cdr(lst)) {
+    pv_tree_push(tree, car(lst));
   }
-  peek_expected_delimiter(in);
-  return make_character(c);
+  tree->edit = NULL;
+  return make_persistent_vector(tree, 0, tree->count);
 }
 
-// Read a number
-
-object *read_number(FILE *in) {
-  int c;
-  int count = 0;
-  char buffer[30];
+// A vector with element index replaced, or vec itself while transient
+object *persistent_vector_set(object *vec, long int index, object *value) {
+  pv_tree *tree = pv_tree_set(vec->data.persistent_vector.tree,
+                              vec->data.persistent_vector.start + index,
+                              value);
 
-  // Read until delimiter and store in buffer
-  while (c = getc(in), !is_delimiter(c)) {
-    buffer[count] = c;
-    count++;
+  if (tree->edit != NULL) {
+    return vec;
   }
-  buffer[count] = '\0';
-  ungetc(c, in);
+  return make_persistent_vector(tree, vec->data.persistent_vector.start,
+                                vec->data.persistent_vector.length);
+}
 
-  //  FLONUMs
-  if (strchr(buffer, '.')) {
-    double n = strtof(buffer, NULL);
-    return make_flonum(n);
-  }
-  
-  //  RATIONALs
-  if (strchr(buffer, '/')) {
-    // build a RATIONAL : 3/4
-    error("Rational Numbers not implemented yet.");
+// A vector with value added at the end, or vec itself while transient
+object *persistent_vector_push(object *vec, object *value) {
+  pv_tree *tree = vec->data.persistent_vector.tree;
+  long int start = vec->data.persistent_vector.start;
+  long int length = vec->data.persistent_vector.length;
+
+  // A view ending before its tree does cannot grow in place
+  if (start + length != tree->count) {
+    tree = persistent_vector_tree(vec, NULL);
+    start = 0;
   }
-  
-  //  FIXNUMs
-  else {
-    return make_fixnum(strtol(buffer, NULL, 10));
+  tree = pv_tree_push(tree, value);
+  if (tree->edit != NULL) {
+    vec->data.persistent_vector.length += 1;
+    return vec;
   }
+  return make_persistent_vector(tree, start, length + 1);
 }
 
-// Read
+
+// PERSISTENT MAPs
 //___________________________________//
+// Immutable maps as hash array mapped tries in the compressed layout of
+// CHAMP.  A node covers 5 bits of the equal? hash of its keys and has two
+// bitmaps of which of its 32 branches hold an entry and which a child node.
+// Only branches in use take space, entries first and children after, so the
+// slot of a branch is the population count of the bits below it.  Keys whose
+// hashes are identical share a collision node, which is searched in order.
+//
+// Updates copy the path from the root down to the entry.  Removing an entry
+// moves a child left with a single entry up into its parent, so every child
+// holds at least two.  Transients own nodes as for vectors.
+
+#define HAMT_BITS      5
+#define HAMT_MAX_SHIFT 60                 // deeper nodes are collision nodes
+#define HAMT_MAX_DEPTH (HAMT_MAX_SHIFT / HAMT_BITS + 2)
+
+typedef struct hamt_node {
+  void *edit;
+  uint32_t datamap;                       // branches holding key and value
+  uint32_t nodemap;                       // branches holding a child
+  int size;                               // slots
+  void *slots[];                          // keys and values, then children
+} hamt_node;
+
+hamt_node *hamt_node_alloc(void *edit, int size) {
+  hamt_node *node = GC_MALLOC(sizeof(hamt_node) + size * sizeof(void *));
+
+  if (node == NULL) {
+    error("out of memory\n");
+  }
+  node->edit = edit;
+  node->size = size;
+  return node;
+}
 
-object *lispy_read(FILE *in);
+// node, if a transient with edit may change it in place, or a copy it may
+hamt_node *hamt_editable(void *edit, hamt_node *node) {
+  hamt_node *copy;
 
-object *read_pair(FILE *in) {
-  int c;
-  object *car_obj;
-  object *cdr_obj;
-  
-  remove_whitespace(in);
-  
-  c = getc(in);
-  if (c == ')') {
-    return the_empty_list;
+  if (edit != NULL && node->edit == edit) {
+    return node;
   }
-  ungetc(c, in);
-  
-  car_obj = lispy_read(in);
-  
-  remove_whitespace(in);
+  copy = hamt_node_alloc(edit, node->size);
+  copy->datamap = node->datamap;
+  copy->nodemap = node->nodemap;
+  memcpy(copy->slots, node->slots, node->size * sizeof(void *));
+  return copy;
+}
 
-  cdr_obj = read_pair(in);
-  return cons(car_obj, cdr_obj);
+uint32_t hamt_bit(uint64_t hash, int shift) {
+  return 1U << ((hash >> shift) & ((1 << HAMT_BITS) - 1));
 }
 
+// Slot of the key of the entry in branch bit
+int hamt_data_slot(hamt_node *node, uint32_t bit) {
+  return 2 * __builtin_popcount(node->datamap & (bit - 1));
+}
 
-object *lispy_read(FILE *in) {
-  int c;                         // Character from input
-  int i;                         // Counter for strings
-  #define BUFFER_MAX 1000
-  char buffer[BUFFER_MAX + 1];   // Buffer to hold strings/symbols
+// Slot of the child in branch bit
+int hamt_child_slot(hamt_node *node, uint32_t bit) {
+  return 2 * __builtin_popcount(node->datamap) +
+         __builtin_popcount(node->nodemap & (bit - 1));
+}
 
-  remove_whitespace(in);
+char hamt_keys_equal(object *key_1, object *key_2) {
+  return key_1 == key_2 || h_equalp(key_1, key_2) == True;
+}
 
-  c = getc(in);
+// The value stored under key, or NULL
+object *hamt_lookup(hamt_node *node, object *key, uint64_t hash) {
+  int shift;
+  uint32_t bit;
+  int i;
 
-  // Numbers
-  if (isdigit(c) || (c == '-' && (isdigit(peek(in)) ||
-                                  peek(in) == '.')) ||
-                    (c == '.' && (isdigit(peek(in))))) {
-    ungetc(c, in);
-    return read_number(in);
+  for (shift = 0; shift <= HAMT_MAX_SHIFT; shift += HAMT_BITS) {
+    bit = hamt_bit(hash, shift);
+    if (node->datamap & bit) {
+      i = hamt_data_slot(node, bit);
+      return hamt_keys_equal(key, node->slots[i]) ? node->slots[i + 1] : NULL;
+    }
+    if (!(node->nodemap & bit)) {
+      return NULL;
+    }
+    node = node->slots[hamt_child_slot(node, bit)];
   }
-  
-  // BOOLEANs and CHARACTERs
-  else if (c == '#') {
-    c = getc(in);
-
-    switch (c) {
-      case '\\':
-        return read_character(in);
-      case '(':
-        ungetc(c, in);
-        return cons(vector_symbol, lispy_read(in));
-      default:
-        error("Unrecognized syntax");
+  for (i = 0; i < node->size; i += 2) {
+    if (hamt_keys_equal(key, node->slots[i])) {
+      return node->slots[i + 1];
     }
   }
+  return NULL;
+}
+
+// A node holding just the two entries, at depth shift
+hamt_node *hamt_merge(void *edit, int shift,
+                      object *key_1, object *value_1, uint64_t hash_1,
+                      object *key_2, object *value_2, uint64_t hash_2) {
+  hamt_node *node;
+  uint32_t bit_1;
+  uint32_t bit_2;
+
+  if (shift > HAMT_MAX_SHIFT) {
+    node = hamt_node_alloc(edit, 4);
+    node->slots[0] = key_1;
+    node->slots[1] = value_1;
+    node->slots[2] = key_2;
+    node->slots[3] = value_2;
+    return node;
+  }
+  bit_1 = hamt_bit(hash_1, shift);
+  bit_2 = hamt_bit(hash_2, shift);
+  if (bit_1 == bit_2) {
+    node = hamt_node_alloc(edit, 1);
+    node->nodemap = bit_1;
+    node->slots[0] = hamt_merge(edit, shift + HAMT_BITS,
+                                key_1, value_1, hash_1,
+                                key_2, value_2, hash_2);
+    return node;
+  }
+  node = hamt_node_alloc(edit, 4);
+  node->datamap = bit_1 | bit_2;
+  if (bit_1 > bit_2) {
+    node->slots[0] = key_2;
+    node->slots[1] = value_2;
+    node->slots[2] = key_1;
+    node->slots[3] = value_1;
+  }
+  else {
+    node->slots[0] = key_1;
+    node->slots[1] = value_1;
+    node->slots[2] = key_2;
+    node->slots[3] = value_2;
+  }
+  return node;
+}
+
+// node with key and value added as the entry of the empty branch bit
+hamt_node *hamt_insert_entry(void *edit, hamt_node *node, uint32_t bit,
+                             object *key, object *value) {
+  hamt_node *copy = hamt_node_alloc(edit, node->size + 2);
+  int i = hamt_data_slot(node, bit);
+
+  copy->datamap = node->datamap | bit;
+  copy->nodemap = node->nodemap;
+  memcpy(copy->slots, node->slots, i * sizeof(void *));
+  copy->slots[i] = key;
+  copy->slots[i + 1] = value;
+  memcpy(copy->slots + i + 2, node->slots + i,
+         (node->size - i) * sizeof(void *));
+  return copy;
+}
+
+// node without the entry in branch bit
+hamt_node *hamt_remove_entry(void *edit, hamt_node *node, uint32_t bit) {
+  hamt_node *copy = hamt_node_alloc(edit, node->size - 2);
+  int i = hamt_data_slot(node, bit);
+
+  copy->datamap = node->datamap & ~bit;
+  copy->nodemap = node->nodemap;
+  memcpy(copy->slots, node->slots, i * sizeof(void *));
+  memcpy(copy->slots + i, node->slots + i + 2,
+         (node->size - i - 2) * sizeof(void *));
+  return copy;
+}
+
+// node with the entry in branch bit replaced by child
+hamt_node *hamt_entry_to_child(void *edit, hamt_node *node, uint32_t bit,
+                               hamt_node *child) {
+  hamt_node *copy = hamt_remove_entry(edit, node, bit);
+  hamt_node *result = hamt_node_alloc(edit, copy->size + 1);
+  int j;
+
+  result->datamap = copy->datamap;
+  result->nodemap = copy->nodemap | bit;
+  j = hamt_child_slot(result, bit);
+  memcpy(result->slots, copy->slots, j * sizeof(void *));
+  result->slots[j] = child;
+  memcpy(result->slots + j + 1, copy->slots + j,
+         (copy->size - j) * sizeof(void *));
+  return result;
+}
 
-  // SYMBOLs
-  else if (is_initial(c) || 
-           ((c == '+' || c == '-') && is_delimiter(peek(in)))) {
-    i = 0;
-    while (is_initial(c) || isdigit(c) || c == '+' || c == '-') {
-      if (i < BUFFER_MAX) {
-        buffer[i++] = c;
-      }
-      else {
-        error("Symbol too long.  Maximum length is %d\n", BUFFER_MAX);
+// node with the child in branch bit replaced by the entry key and value
+hamt_node *hamt_child_to_entry(void *edit, hamt_node *node, uint32_t bit,
+                               object *key, object *value) {
+  hamt_node *copy = hamt_node_alloc(edit, node->size - 1);
+  int j = hamt_child_slot(node, bit);
+
+  copy->datamap = node->datamap;
+  copy->nodemap = node->nodemap & ~bit;
+  memcpy(copy->slots, node->slots, j * sizeof(void *));
+  memcpy(copy->slots + j, node->slots + j + 1,
+         (node->size - j - 1) * sizeof(void *));
+  return hamt_insert_entry(edit, copy, bit, key, value);
+}
+
+// node with key bound to value, setting added when key is new
+hamt_node *hamt_assoc(void *edit, hamt_node *node, int shift,
+                      object *key, uint64_t hash, object *value,
+                      char *added) {
+  hamt_node *child;
+  hamt_node *copy;
+  uint32_t bit;
+  int i;
+
+  if (shift > HAMT_MAX_SHIFT) {
+    for (i = 0; i < node->size; i += 2) {
+      if (hamt_keys_equal(key, node->slots[i])) {
+        copy = hamt_editable(edit, node);
+        copy->slots[i + 1] = value;
+        return copy;
       }
-      c = getc(in);
     }
-    if (is_delimiter(c)) {
-      buffer[i] = '\0';
-      ungetc(c, in);
-      return make_symbol(buffer);
+    copy = hamt_node_alloc(edit, node->size + 2);
+    memcpy(copy->slots, node->slots, node->size * sizeof(void *));
+    copy->slots[node->size] = key;
+    copy->slots[node->size + 1] = value;
+    *added = 1;
+    return copy;
+  }
+  bit = hamt_bit(hash, shift);
+  if (node->datamap & bit) {
+    i = hamt_data_slot(node, bit);
+    if (hamt_keys_equal(key, node->slots[i])) {
+      if (node->slots[i + 1] == value) {
+        return node;
+      }
+      copy = hamt_editable(edit, node);
+      copy->slots[i + 1] = value;
+      return copy;
     }
-    else {
-      error("Symbol not followed by delimiter.");
+    // Two keys in one branch: both move down into a new child
+    child = hamt_merge(edit, shift + HAMT_BITS,
+                       node->slots[i], node->slots[i + 1],
+                       hash_equal(node->slots[i], HASH_DEPTH),
+                       key, value, hash);
+    *added = 1;
+    return hamt_entry_to_child(edit, node, bit, child);
+  }
+  if (node->nodemap & bit) {
+    i = hamt_child_slot(node, bit);
+    child = hamt_assoc(edit, node->slots[i], shift + HAMT_BITS,
+                       key, hash, value, added);
+    if (child == node->slots[i]) {
+      return node;
     }
-  }
-  
-  // STRINGs
-  else if (c == '"') {
-    i = 0;
-    while ((c = getc(in)) != '"') {
-      // Newline Escape Character
-      if (c == '\\') {
-        c = getc(in);
-        if (c == 'n') {c = '\n';}
-      }
-      if (c == EOF) {
-        error("Non-terminated string");
-      }
-      if (i < BUFFER_MAX) {
-        buffer[i++] = c;
-      }
-      else {
-        error("String too long.  Maximum length is %i", BUFFER_MAX);
+    copy = hamt_editable(edit, node);
+    copy->slots[i] = child;
+    return copy;
+  }
+  *added = 1;
+  return hamt_insert_entry(edit, node, bit, key, value);
+}
+
+// node without key, setting removed when it was there
+hamt_node *hamt_dissoc(void *edit, hamt_node *node, int shift,
+                       object *key, uint64_t hash, char *removed) {
+  hamt_node *child;
+  hamt_node *copy;
+  uint32_t bit;
+  int i;
+
+  if (shift > HAMT_MAX_SHIFT) {
+    for (i = 0; i < node->size; i += 2) {
+      if (hamt_keys_equal(key, node->slots[i])) {
+        copy = hamt_node_alloc(edit, node->size - 2);
+        memcpy(copy->slots, node->slots, i * sizeof(void *));
+        memcpy(copy->slots + i, node->slots + i + 2,
+               (node->size - i - 2) * sizeof(void *));
+        *removed = 1;
+        return copy;
       }
     }
-    buffer[i] = '\0';
-    return make_string(buffer);
-  }
-      
-  // Pairs
-  else if (c == '(') {
-    return read_pair(in);
+    return node;
   }
-  
-  // Quote
-  else if (c == '\'') {
-    return cons(quote_symbol, cons(lispy_read(in), the_empty_list));
+  bit = hamt_bit(hash, shift);
+  if (node->datamap & bit) {
+    if (!hamt_keys_equal(key, node->slots[hamt_data_slot(node, bit)])) {
+      return node;
+    }
+    *removed = 1;
+    return hamt_remove_entry(edit, node, bit);
+  }
+  if (node->nodemap & bit) {
+    i = hamt_child_slot(node, bit);
+    child = hamt_dissoc(edit, node->slots[i], shift + HAMT_BITS,
+                        key, hash, removed);
+    if (!*removed) {
+      return node;
+    }
+    if (child->nodemap == 0 && child->size == 2) {
+      return hamt_child_to_entry(edit, node, bit,
+                                 child->slots[0], child->slots[1]);
+    }
+    copy = hamt_editable(edit, node);
+    copy->slots[i] = child;
+    return copy;
   }
+  return node;
+}
 
-  // EOF
-  else if (c == EOF) {
-    return NULL;
+// Slots of node holding keys and values rather than children
+int hamt_entry_slots(hamt_node *node, int shift) {
+  if (shift > HAMT_MAX_SHIFT) {
+    return node->size;
   }
+  return 2 * __builtin_popcount(node->datamap);
+}
 
-  // UNRECOGNIZED INPUT
-  else {
-    error("bad input. Unexpected '%c'\n", c);
+// The (key . value) entries under node consed onto result
+object *hamt_entries(hamt_node *node, int shift, object *result) {
+  int data = hamt_entry_slots(node, shift);
+  int i;
+
+  for (i = node->size - 1; i >= data; i--) {
+    result = hamt_entries(node->slots[i], shift + HAMT_BITS, result);
   }
-  error("read illegal state\n");
+  for (i = data - 2; i >= 0; i -= 2) {
+    result = cons(cons(node->slots[i], node->slots[i + 1]), result);
+  }
+  return result;
 }
 
+object *make_persistent_map(hamt_node *root, long int count, void *edit) {
+  object *obj;
 
+  obj = alloc_object();
+  obj->type = PERSISTENT_MAP;
+  obj->data.persistent_map.root = root;
+  obj->data.persistent_map.count = count;
+  obj->data.persistent_map.edit = edit;
+  return obj;
+}
 
-/** ***************************************************************************
-**                               Evaluate
-******************************************************************************/
-
-// Self-Evaluating
-//___________________________________//
+object *make_empty_persistent_map(void) {
+  return make_persistent_map(hamt_node_alloc(NULL, 0), 0, NULL);
+}
 
-char is_self_evaluating(object *exp) {
-  return is_boolean(exp)   ||
-         is_fixnum(exp)    ||
-         is_flonum(exp)    ||
-         is_character(exp) ||
-         is_string(exp)    ||
-         exp->type == VOID;
+char is_persistent_map(object *obj) {
+  return obj->type == PERSISTENT_MAP;
 }
 
+// The value stored under key, or NULL
+object *persistent_map_get(object *map, object *key) {
+  return hamt_lookup(map->data.persistent_map.root, key,
+                     hash_equal(key, HASH_DEPTH));
+}
 
-// Primitive Syntax?
-//___________________________________//
+// A map with key bound to value, or map itself while transient
+object *persistent_map_set(object *map, object *key, object *value) {
+  void *edit = map->data.persistent_map.edit;
+  char added = 0;
+  hamt_node *root = hamt_assoc(edit, map->data.persistent_map.root, 0, key,
+                               hash_equal(key, HASH_DEPTH), value, &added);
 
-char is_primitive_syntax(object *expression, object *identifier) {
-  object *the_car;
-  
-  if (is_pair(expression)) {
-    the_car = car(expression);
-    return is_symbol(the_car) && (the_car == identifier);
+  if (edit != NULL) {
+    map->data.persistent_map.root = root;
+    map->data.persistent_map.count += added;
+    return map;
   }
-  return 0;
+  if (root == map->data.persistent_map.root) {
+    return map;
+  }
+  return make_persistent_map(root, map->data.persistent_map.count + added,
+                             NULL);
 }
 
+// A map without key, or map itself while transient
+object *persistent_map_remove(object *map, object *key) {
+  void *edit = map->data.persistent_map.edit;
+  char removed = 0;
+  hamt_node *root = hamt_dissoc(edit, map->data.persistent_map.root, 0, key,
+                                hash_equal(key, HASH_DEPTH), &removed);
 
-// quote
-//___________________________________//
+  if (!removed) {
+    return map;
+  }
+  if (edit != NULL) {
+    map->data.persistent_map.root = root;
+    map->data.persistent_map.count -= 1;
+    return map;
+  }
+  return make_persistent_map(root, map->data.persistent_map.count - 1, NULL);
+}
 
-char is_quoted(object *expression) {
-  return is_primitive_syntax(expression, quote_symbol);
+// Every entry as a (key . value) pair, in hash order
+object *persistent_map_entries(object *map) {
+  return hamt_entries(map->data.persistent_map.root, 0, the_empty_list);
 }
 
-object *quote_macro_arguments(object *exp) {
-  return cons(quote_symbol, 
-              cons(exp, 
-                   the_empty_list));
+// The entry first sees, which is the leftmost one in the trie
+object *persistent_map_first(object *map) {
+  hamt_node *node = map->data.persistent_map.root;
+
+  while (node->datamap == 0 && node->nodemap != 0) {
+    node = node->slots[0];
+  }
+  if (node->size == 0) {
+    error("first: empty map");
+  }
+  return cons(node->slots[0], node->slots[1]);
 }
 
 
-// set!
+// Persistent Collections
 //___________________________________//
 
-char is_assignment(object *exp) {
-  return is_primitive_syntax(exp, set_symbol);
+char is_transient(object *obj) {
+  if (obj->type == PERSISTENT_VECTOR) {
+    return obj->data.persistent_vector.tree->edit != NULL;
+  }
+  return obj->type == PERSISTENT_MAP && obj->data.persistent_map.edit != NULL;
 }
 
-object *assignment_variable(object *exp) {
-  return car(cdr(exp));
-}
+// A transient with the contents of coll, leaving coll as it is
+object *make_transient(object *coll) {
+  void *edit = make_edit_token();
+  pv_tree *tree;
 
-object *assignment_value(object *exp) {
-  return car(cdr(cdr(exp)));
+  if (coll->type == PERSISTENT_MAP) {
+    return make_persistent_map(coll->data.persistent_map.root,
+                               coll->data.persistent_map.count, edit);
+  }
+  tree = coll->data.persistent_vector.tree;
+  if (coll->data.persistent_vector.start != 0 ||
+      coll->data.persistent_vector.length != tree->count) {
+    tree = persistent_vector_tree(coll, edit);
+  }
+  else {
+    tree = pv_tree_edit(tree);
+    tree->edit = edit;
+  }
+  return make_persistent_vector(tree, 0, tree->count);
 }
 
+// Every element of a persistent vector, or every key followed by its value
+// of a persistent map, as a vector
+object *persistent_items(object *coll) {
+  object *items;
+  object *entries;
+  long int i;
 
-// lambda
+  if (coll->type == PERSISTENT_VECTOR) {
+    items = make_vector(coll->data.persistent_vector.length, False);
+    for (i = 0; i < coll->data.persistent_vector.length; i++) {
+      items->data.vector.vec[i] = persistent_vector_ref(coll, i);
+    }
+    return items;
+  }
+  items = make_vector(2 * coll->data.persistent_map.count, False);
+  entries = persistent_map_entries(coll);
+  for (i = 0; entries != the_empty_list; entries = cdr(entries), i += 2) {
+    items->data.vector.vec[i] = car(car(entries));
+    items->data.vector.vec[i + 1] = cdr(car(entries));
+  }
+  return items;
+}
+
+// SYMBOLs
 //___________________________________//
 
-object *make_lambda(object *parameters, object *body) {
-  return cons(lambda_symbol, cons(parameters, body));
-}
+// Futures may read or convert to symbols on several threads at once
+pthread_mutex_t symbol_lock = PTHREAD_MUTEX_INITIALIZER;
 
-char is_lambda(object *exp) {
-  return is_primitive_syntax(exp, lambda_symbol);
+object *make_symbol(char *value) {
+  object *obj;
+  object *element;
+  
+  pthread_mutex_lock(&symbol_lock);
+  // search for the symbol in symbol_table
+  element = symbol_table;
+  while (!is_the_empty_list(element)) {
+    if (strcmp(car(element)->data.symbol, value) == 0) {
+      pthread_mutex_unlock(&symbol_lock);
+      return car(element);
+    }
+    element = cdr(element);
+  }
+  
+  // create a symbol and add it to symbol_table
+  obj = alloc_object();
+  obj->type = SYMBOL;
+  obj->data.symbol = GC_MALLOC(strlen(value) + 1);
+  if (obj->data.symbol == NULL) {
+    pthread_mutex_unlock(&symbol_lock);
+    error("out of memory\n");
+  }
+  strcpy(obj->data.symbol, value);
+  symbol_table = cons(obj, symbol_table);
+  pthread_mutex_unlock(&symbol_lock);
+  return obj;
 }
 
-object *lambda_parameters(object *exp) {
-  return cadr(exp);
+char is_symbol(object *obj) {
+  return obj->type == SYMBOL;
 }
 
-object *lambda_body(object *exp) {
-  return cddr(exp);
+
+// PAIRs
+//___________________________________//
+
+object *cons(object *car, object *cdr) {
+  object *obj;
+  
+  obj = alloc_object();
+  obj->type = PAIR;
+  obj->data.pair.car = car;
+  obj->data.pair.cdr = cdr;
+  return obj;
 }
 
-char is_last_exp(object *seq) {
-  return is_the_empty_list(cdr(seq));
+char is_pair(object *obj) {
+  return obj->type == PAIR;
+}
+
+object *car(object *pair) {
+  return pair->data.pair.car;
 }
 
+object *cdr(object *pair) {
+  return pair->data.pair.cdr;
+}
 
-// define
+object *set_car(object *obj, object* value) {
+  obj->data.pair.car = value;
+}
+
+object *set_cdr(object *obj, object* value) {
+  obj->data.pair.cdr = value;
+}
+
+#define caar(obj) car(car(obj))
+#define cadr(obj) car(cdr(obj))
+#define cdar(obj) cdr(car(obj))
+#define cddr(obj) cdr(cdr(obj))
+#define caaar(obj) car(car(car(obj)))
+#define caadr(obj) car(car(cdr(obj)))
+#define cadar(obj) car(cdr(car(obj)))
+#define caddr(obj) car(cdr(cdr(obj)))
+#define cdaar(obj) cdr(car(car(obj)))
+#define cdadr(obj) cdr(car(cdr(obj)))
+#define cddar(obj) cdr(cdr(car(obj)))
+#define cdddr(obj) cdr(cdr(cdr(obj)))
+#define caaaar(obj) car(car(car(car(obj))))
+#define caaadr(obj) car(car(car(cdr(obj))))
+#define caadar(obj) car(car(cdr(car(obj))))
+#define caaddr(obj) car(car(cdr(cdr(obj))))
+#define cadaar(obj) car(cdr(car(car(obj))))
+#define cadadr(obj) car(cdr(car(cdr(obj))))
+#define caddar(obj) car(cdr(cdr(car(obj))))
+#define cadddr(obj) car(cdr(cdr(cdr(obj))))
+#define cdaaar(obj) cdr(car(car(car(obj))))
+#define cdaadr(obj) cdr(car(car(cdr(obj))))
+#define cdadar(obj) cdr(car(cdr(car(obj))))
+#define cdaddr(obj) cdr(car(cdr(cdr(obj))))
+#define cddaar(obj) cdr(cdr(car(car(obj))))
+#define cddadr(obj) cdr(cdr(car(cdr(obj))))
+#define cdddar(obj) cdr(cdr(cdr(car(obj))))
+#define cddddr(obj) cdr(cdr(cdr(cdr(obj))))
+#define caddddr(obj) car(cdr(cdr(cdr(cdr(obj)))))
+#define cadddddr(obj) car(cdr(cdr(cdr(cdr(cdr(obj))))))
+#define caddddddr(obj) car(cdr(cdr(cdr(cdr(cdr(cdr(obj)))))))
+
+
+// PRIMITIVE_PROCEDUREs
 //___________________________________//
 
+object *make_primitive_procedure(object *(*fn) (struct lispy_object *arguments)) {
+  object *obj;
+  
+  obj = alloc_object();
+  obj->type = PRIMITIVE_PROCEDURE;
+  obj->data.primitive_procedure.fn = fn;
+  return obj;
+}
 
-char is_definition(object *exp) {
-  return is_primitive_syntax(exp, define_symbol);
+char is_primitive_procedure(object *obj) {
+  return obj->type == PRIMITIVE_PROCEDURE;
 }
 
-object *definition_variable(object *exp) {
-  if (is_symbol(cadr(exp))) {
-    return cadr(exp);
-  }
-  else {
-    return caadr(exp);
-  }
+
+// COMPOUND_PROCEDUREs
+//___________________________________//
+
+// Counts what this thread has made that keeps hold of an environment:
+// procedures, futures and definitions.  Comprehensions watch it to know
+// when the frame they reuse has been captured.
+__thread unsigned long int env_captures;
+
+object *make_compound_procedure(object *parameters, object *arguments,
+                                object* env, object *docstring) {
+  object *obj;
+  env_captures += 1;
+  obj = alloc_object();
+  obj->type = COMPOUND_PROCEDURE;
+  obj->data.compound_procedure.parameters = parameters;
+  obj->data.compound_procedure.body = arguments;
+  obj->data.compound_procedure.env = env;
+  obj->data.compound_procedure.docstring = docstring;
+  return obj;
 }
 
-object *definition_value(object *exp) {
-  if (is_symbol(cadr(exp))) {
-    return caddr(exp);
-  }
-  else {
-    return make_lambda(cdadr(exp), cddr(exp));
-  }
+char is_compound_procedure(object *obj) {
+  return obj->type == COMPOUND_PROCEDURE;
 }
 
+char is_procedure(object *obj) {
+  return obj->type == COMPOUND_PROCEDURE || obj->type == PRIMITIVE_PROCEDURE;
+}
 
-// if
+// MACROs
 //___________________________________//
 
-char is_if(object *expression) {
-  return is_primitive_syntax(expression, if_symbol);
+object *make_macro(object *transformer) {
+  object *obj;
+  obj = alloc_object();
+  obj->type = MACRO;
+  obj->data.macro.transformer = transformer;
+  return obj;
 }
 
-object *make_if(object *test, object *consequent, object *alternative) {
-  return cons(if_symbol,
-              cons(test,
-                   cons(consequent,
-                        cons(alternative,
-                             the_empty_list))));
+char is_macro(object *obj) {
+  return obj->type == MACRO;
 }
 
 
-// cond
+// PORTs
 //___________________________________//
 
-object *make_cond(object *clauses) {
-  object *first = car(clauses);
-  object *rest = cdr(clauses);
-  
-  if (clauses == the_empty_list) {
-    return False;
-  }
-  else if (car(first) == else_symbol) {
-    return cadr(first);            // Does not check that else is last clause
-  }
-  else {
-    return make_if(car(first), cadr(first), make_cond(rest));
+object *make_port(FILE *stream, char kind) {
+  object *obj;
+  obj = alloc_object();
+  obj->type = PORT;
+  obj->data.port.stream = stream;
+  obj->data.port.kind = kind;
+  obj->data.port.buffer = NULL;
+  obj->data.port.length = 0;
+  obj->data.port.capacity = 0;
+
+  if (kind == OUTPUT_PORT) {
+    obj->data.port.capacity = PORT_BUFFER_SIZE;
+  } else if (kind == STRING_PORT) {
+    obj->data.port.capacity = 256;
+  }
+  if (obj->data.port.capacity > 0) {
+    obj->data.port.buffer = GC_MALLOC_ATOMIC(obj->data.port.capacity);
+    if (obj->data.port.buffer == NULL) {
+      error("Out of memory!");
+    }
   }
+  return obj;
+}
+
+char is_port(object *obj) {
+  return obj->type == PORT;
 }
 
 
-// let
+// FUTUREs
 //___________________________________//
+// See Futures under Primitive Procedures for how they are run
 
-object *make_let(object *exp) {
-  object *bindings = car(exp);
-  object *first_binding = car(bindings);
-  object *body = cdr(exp);
-  object *params = the_empty_list;
-  object *values = the_empty_list;
-  
-  while (bindings != the_empty_list) {
-    params = cons(car(first_binding), params);
-    values = cons(cadr(first_binding), values);
-    bindings = cdr(bindings);
-    first_binding = car(bindings);
-  }
+object *make_future(object *exp, object *env) {
+  object *obj;
   
-  return cons(make_lambda(params, body), values);
+  env_captures += 1;
+  obj = alloc_object();
+  obj->type = FUTURE;
+  obj->data.future.exp = exp;
+  obj->data.future.env = env;
+  obj->data.future.value = NULL;
+  obj->data.future.interpreter = current_interpreter;
+  obj->data.future.state = FUTURE_PENDING;
+  return obj;
+}
+
+char is_future(object *obj) {
+  return obj->type == FUTURE;
 }
 
 
-// test
+// TASKs and CHANNELs
 //___________________________________//
-object *h_equalp(object *obj_1, object *obj_2);
-object *eval(object *exp, object *env);
+// See Tasks under Primitive Procedures for how tasks are run
 
-object *test(object *exp) {
-  object *test_case;
-  object *expected;
-  object *result;
-  object *env = extend_environment(the_empty_list,
-                                   the_empty_list,
-                                   the_global_environment);
+struct green_queue *make_green_queue(void);
 
-  while (exp != the_empty_list) {
-    test_case = car(exp);
-    expected = caddr(exp);
+object *make_task(void) {
+  object *obj;
+  
+  obj = alloc_object();
+  obj->type = TASK;
+  obj->data.task.waiters = make_green_queue();
+  obj->data.task.value = Void;
+  obj->data.task.state = FUTURE_PENDING;
+  return obj;
+}
 
-    result = h_equalp(eval(test_case, env), eval(expected, env));
-    
-    if (result == False) {
-      write(test_case);
-      printf("\n!= ");
-      write(expected); printf("\n");
-    }
-    exp = cdddr(exp);
-  }
-  return Void;
+char is_task(object *obj) {
+  return obj->type == TASK;
 }
 
-// Application of Primitive Procedures
-//___________________________________//
+typedef struct channel_queue {
+  object *head;                           // the values sent, oldest first
+  object *tail;
+  long int count;
+  long int capacity;                      // 0 for no limit
+  struct green_queue *receivers;          // tasks waiting for a value
+  struct green_queue *senders;            // tasks waiting for room
+} channel_queue;
 
-char is_application(object *exp) {
-  return is_pair(exp);
+object *make_channel(long int capacity) {
+  channel_queue *queue = GC_MALLOC(sizeof(channel_queue));
+  object *obj;
+  
+  if (queue == NULL) {
+    error("out of memory\n");
+  }
+  queue->head = the_empty_list;
+  queue->tail = the_empty_list;
+  queue->count = 0;
+  queue->capacity = capacity;
+  queue->receivers = make_green_queue();
+  queue->senders = make_green_queue();
+  obj = alloc_object();
+  obj->type = CHANNEL;
+  obj->data.channel.queue = queue;
+  return obj;
 }
 
+char is_channel(object *obj) {
+  return obj->type == CHANNEL;
+}
 
-// eval arguments
+/** ***************************************************************************
+**                             ENVIRONMENTs
+******************************************************************************/
+
+// Frames
 //___________________________________//
 
+object *make_frame(object *variables, object *values) {
+  return cons(variables, values);
+}
 
-object *list_of_values(object *exps, object *env) {
-  if (is_the_empty_list(exps)) {
-    return the_empty_list;
-  }
-  else {
-    return cons(eval(car(exps), env),
-                list_of_values(cdr(exps), env));
-  }
+object *frame_variables(object *frame) {
+  return car(frame);
 }
 
-object *h_reverse(object *lst) {
-  object *temp_list = the_empty_list;
-  while (lst != the_empty_list) {
+object *frame_values(object *frame) {
+  return cdr(frame);
+}
+
+void add_binding_to_frame(object *var, object *val, object *frame) {
+  set_car(frame, cons(var, car(frame)));
+  set_cdr(frame, cons(val, cdr(frame)));
+}
+
+
+// Environments
+//___________________________________//
+
+char is_the_empty_environment(object *env) {
+  return env == the_empty_list;
+}
+
+object *current_environment(object *env) {
+  return car(env);
+}
+
+object *enclosing_environment(object *env) {
+  return cdr(env);
+}
+
+object *extend_environment(object *vars, object *vals, object *base_env) {
+  return cons(make_frame(vars, vals), base_env);
+}
+
+
+// Variables
+//___________________________________//
+
+object *lookup_variable_value(object *var, object *env) {
+  object *frame;
+  object *vars;
+  object *vals;
+  while (!is_the_empty_environment(env)) {
+    frame = current_environment(env);
+    vars = frame_variables(frame);
+    vals = frame_values(frame);
+    while (!is_the_empty_list(vars)) {
+      if (var == car(vars)) {
+        return car(vals);
+      }
+      vars = cdr(vars);
+      vals = cdr(vals);
+    }
+    env = enclosing_environment(env);
+  }
+  error("Unbound Variable: %s", var->data.symbol);
+}
+
+// While pmap has workers for the interpreter, its changes is a list of the
+// (var . val) of every global definition and set!, newest first, for pmap to
+// send them.  Otherwise it is NULL and nothing is kept.  Threads running
+// futures or pfor bodies may define at once, so entries are pushed with a
+// compare and swap.
+void log_global_change(object *var, object *val, object *env) {
+  object *entry;
+
+  // Interpreters are being made while there is no current one
+  if (current_interpreter == NULL ||
+      env != current_interpreter->global_environment ||
+      __atomic_load_n(&current_interpreter->changes, __ATOMIC_ACQUIRE) ==
+      NULL) {
+    return;
+  }
+  entry = cons(cons(var, val), NULL);
+  entry->data.pair.cdr = __atomic_load_n(&current_interpreter->changes,
+                                         __ATOMIC_ACQUIRE);
+  while (entry->data.pair.cdr != NULL &&
+         !__atomic_compare_exchange_n(&current_interpreter->changes,
+                                      &entry->data.pair.cdr, entry, 0,
+                                      __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+  }
+}
+
+void set_variable_value(object *var, object *val, object *env) {
+  object *frame;
+  object *vars;
+  object *vals;
+  
+  while (!is_the_empty_environment(env)) {
+    frame = current_environment(env);
+    vars = frame_variables(frame);
+    vals = frame_values(frame);
+    while (!is_the_empty_list(vars)) {
+      if (var == car(vars)) {
+        set_car(vals, val);
+        log_global_change(var, val, env);
+        return;
+      }
+      vars = cdr(vars);
+      vals = cdr(vals);
+    }
+    env = enclosing_environment(env);
+  }
+  error("Can not set unbound variable: %s\n", var->data.symbol);
+}
+
+void define_variable(object *var, object *val, object *env) {
+  object *frame;
+  object *vars;
+  object *vals;
+  
+  env_captures += 1;
+  log_global_change(var, val, env);
+  frame = current_environment(env);
+  vars = frame_variables(frame);
+  vals = frame_values(frame);
+  
+  while (!is_the_empty_list(vars)) {
+    if (var == car(vars)) {
+      set_car(vals, val);
+      return;
+    }
+    vars = cdr(vars);
+    vals = cdr(vals);
+  }
+  add_binding_to_frame(var, val, frame);
+}
+
+
+
+/** ***************************************************************************
+**                                   Read
+******************************************************************************/
+
+char is_delimiter(int c) {
+  return isspace(c) || c == EOF ||
+     c == '(' || c == ')' ||
+     c == '{' || c == '}' ||
+     c == '"' || c == ';';
+}
+
+char is_initial(int c) {
+  return isalpha(c) || c == '*' || c == '/' || c == '>' ||
+         c == '<'   || c == '=' || c == '?' || c == '!' ||
+         c == '-'   || c == '&' || c == ':';
+}
+
+
+// Peek at Next Character
+//___________________________________//
+
+int peek(FILE *in) {
+  int c;
+
+  c = getc(in);
+  ungetc(c, in);
+  return c;
+}
+
+void peek_expected_delimiter(FILE *in) {
+  if (!is_delimiter(peek(in))) {
+    error("Character not followed by delimiter");
+  }
+}
+
+
+// Remove Whitespace
+//___________________________________//
+
+void remove_whitespace(FILE *in) {
+  int c;
+    
+  while ((c = getc(in)) != EOF) {
+    if (isspace(c)) {
+      continue;
+    }
+    else if (c == ';') { // comments are whitespace also
+      while (((c = getc(in)) != EOF) && (c != '\n'));
+      continue;
+    }
+    ungetc(c, in);
+    break;
+  }
+}
+
+
+// Read Characters
+//___________________________________//
+
+// Read #\newline and #\space characters
+void read_expected_string(FILE *in, char *str) {
+  int c;
+  
+  while (*str != '\0') {
+    c = getc(in);
+    if (c != *str) {
+      error("unexpected character '%c'\n", c);
+    }
+    str++;
+  }
+}
+
+// Read a character
+
+object *read_character(FILE *in) {
+  char bytes[4];
+  int size;
+  int i;
+  int c;
+  
+  c = getc(in);
+  
+  switch (c) {
+    case EOF:
+      error("incomplete character literal");
+    // #\space
+    case 's':
+      if (peek(in) == 'p') {
+        read_expected_string(in, "pace");
+        peek_expected_delimiter(in);
+        return make_character(' ');
+      }
+      break;
+    // #\newline
+    case 'n':
+      if (peek(in) == 'e') {
+        read_expected_string(in, "ewline");
+        peek_expected_delimiter(in);
+        return make_character('\n');
+      }
+      break;
+  }
+  // A character past ASCII is several bytes of UTF-8
+  if (c >= 0x80) {
+    bytes[0] = c;
+    size = utf8_size(c);
+    for (i = 1; i < size; i++) {
+      bytes[i] = getc(in);
+    }
+    if (utf8_validate(bytes, size) != 1) {
+      error("invalid UTF-8 in character literal");
+    }
+    c = utf8_decode(bytes);
+  }
+  peek_expected_delimiter(in);
+  return make_character(c);
+}
+
+// Parse the text of a number, shared by the stream and bulk readers
+
+// Every power of ten up to 10^22 is exactly representable as a double
+static const double exact_powers_of_ten[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Clinger's fast path: with at most 15 significant digits and a power of
+// ten no larger than 10^22 both operands of one multiply or divide are
+// exact, so the result is correctly rounded.  Anything else goes to strtod,
+// which is also correctly rounded but much slower.
+double parse_flonum(char *buffer) {
+  char *p = buffer;
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int exponent = 0;
+  int exponent_value = 0;
+  char exponent_negative = 0;
+  char negative = 0;
+  double value;
+  
+  if (*p == '-' || *p == '+') {
+    negative = (*p == '-');
+    p++;
+  }
+  for (; isdigit(*p); p++) {
+    if (mantissa != 0 || *p != '0') {
+      digits++;
+      mantissa = mantissa * 10 + (*p - '0');
+    }
+  }
+  if (*p == '.') {
+    for (p++; isdigit(*p); p++) {
+      if (mantissa != 0 || *p != '0') {
+        digits++;
+        mantissa = mantissa * 10 + (*p - '0');
+      }
+      exponent--;
+    }
+  }
+  if (*p == 'e' || *p == 'E') {
+    p++;
+    if (*p == '-' || *p == '+') {
+      exponent_negative = (*p == '-');
+      p++;
+    }
+    for (; isdigit(*p) && exponent_value < 10000; p++) {
+      exponent_value = exponent_value * 10 + (*p - '0');
+    }
+  }
+  exponent += exponent_negative ? -exponent_value : exponent_value;
+  
+  if (*p != '\0' || digits > 15 || exponent < -22 || exponent > 22) {
+    return strtod(buffer, NULL);
+  }
+  value = (double) mantissa;
+  if (exponent < 0) {
+    value /= exact_powers_of_ten[-exponent];
+  } else {
+    value *= exact_powers_of_ten[exponent];
+  }
+  return negative ? -value : value;
+}
+
+// A sign, digits with at most one '.' among them, and an exponent
+char is_number_text(char *p) {
+  int digits = 0;
+  
+  if (*p == '-' || *p == '+') {
+    p++;
+  }
+  for (; isdigit(*p); p++) {
+    digits++;
+  }
+  if (*p == '.') {
+    for (p++; isdigit(*p); p++) {
+      digits++;
+    }
+  }
+  if (digits == 0) {
+    return 0;
+  }
+  if (*p == 'e' || *p == 'E') {
+    p++;
+    if (*p == '-' || *p == '+') {
+      p++;
+    }
+    if (!isdigit(*p)) {
+      return 0;
+    }
+    while (isdigit(*p)) {
+      p++;
+    }
+  }
+  return *p == '\0';
+}
+
+object *parse_number(char *buffer) {
+  if (!is_number_text(buffer)) {
+    //  RATIONALs
+    if (strchr(buffer, '/')) {
+      // build a RATIONAL : 3/4
+      error("Rational Numbers not implemented yet.");
+    }
+    error("\"%s\" is not a number", buffer);
+  }
+  
+  //  FLONUMs
+  if (strpbrk(buffer, ".eE")) {
+    return make_flonum(parse_flonum(buffer));
+  }
+  
+  //  FIXNUMs
+  else {
+    return make_fixnum(strtol(buffer, NULL, 10));
+  }
+}
+
+// Read a number
+
+object *read_number(FILE *in) {
+  int c;
+  int count = 0;
+  char buffer[30];
+
+  // Read until delimiter and store in buffer
+  while (c = getc(in), !is_delimiter(c)) {
+    if (count == sizeof(buffer) - 1) {
+      error("Number too long");
+    }
+    buffer[count] = c;
+    count++;
+  }
+  buffer[count] = '\0';
+  ungetc(c, in);
+
+  return parse_number(buffer);
+}
+
+// Read
+//___________________________________//
+
+object *lispy_read(FILE *in);
+
+// Read the rest of a list up to close, which is ')' or '}' for #{
+object *read_pair(FILE *in, int close) {
+  int c;
+  object *car_obj;
+  object *cdr_obj;
+  
+  remove_whitespace(in);
+  
+  c = getc(in);
+  if (c == close) {
+    return the_empty_list;
+  }
+  ungetc(c, in);
+  
+  car_obj = lispy_read(in);
+  
+  remove_whitespace(in);
+
+  cdr_obj = read_pair(in, close);
+  return cons(car_obj, cdr_obj);
+}
+
+
+object *lispy_read(FILE *in) {
+  int c;                         // Character from input
+  int i;                         // Counter for strings
+  #define BUFFER_MAX 1000
+  char buffer[BUFFER_MAX + 1];   // Buffer to hold strings/symbols
+
+  remove_whitespace(in);
+
+  c = getc(in);
+
+  // Numbers
+  if (isdigit(c) || (c == '-' && (isdigit(peek(in)) ||
+                                  peek(in) == '.')) ||
+                    (c == '.' && (isdigit(peek(in))))) {
+    ungetc(c, in);
+    return read_number(in);
+  }
+  
+  // BOOLEANs and CHARACTERs
+  else if (c == '#') {
+    c = getc(in);
+
+    switch (c) {
+      case '\\':
+        return read_character(in);
+      case '(':
+        ungetc(c, in);
+        return cons(vector_symbol, lispy_read(in));
+      // #{key value ...} hash tables
+      case '{':
+        return cons(hash_table_symbol, read_pair(in, '}'));
+      // #f64( #s64( and #u8( numeric vectors
+      case 'f':
+        read_expected_string(in, "64(");
+        ungetc('(', in);
+        return cons(f64vector_symbol, lispy_read(in));
+      case 's':
+        read_expected_string(in, "64(");
+        ungetc('(', in);
+        return cons(s64vector_symbol, lispy_read(in));
+      case 'u':
+        read_expected_string(in, "8(");
+        ungetc('(', in);
+        return cons(u8vector_symbol, lispy_read(in));
+      default:
+        error("Unrecognized syntax");
+    }
+  }
+
+  // SYMBOLs
+  else if (is_initial(c) || 
+           ((c == '+' || c == '-') && is_delimiter(peek(in)))) {
+    i = 0;
+    while (is_initial(c) || isdigit(c) || c == '+' || c == '-') {
+      if (i < BUFFER_MAX) {
+        buffer[i++] = c;
+      }
+      else {
+        error("Symbol too long.  Maximum length is %d\n", BUFFER_MAX);
+      }
+      c = getc(in);
+    }
+    if (is_delimiter(c)) {
+      buffer[i] = '\0';
+      ungetc(c, in);
+      return make_symbol(buffer);
+    }
+    else {
+      error("Symbol not followed by delimiter.");
+    }
+  }
+  
+  // STRINGs
+  else if (c == '"') {
+    i = 0;
+    while ((c = getc(in)) != '"') {
+      // Newline Escape Character
+      if (c == '\\') {
+        c = getc(in);
+        if (c == 'n') {c = '\n';}
+      }
+      if (c == EOF) {
+        error("Non-terminated string");
+      }
+      if (i < BUFFER_MAX) {
+        buffer[i++] = c;
+      }
+      else {
+        error("String too long.  Maximum length is %i", BUFFER_MAX);
+      }
+    }
+    return validate_string(make_string_length(buffer, i));
+  }
+      
+  // Pairs
+  else if (c == '(') {
+    return read_pair(in, ')');
+  }
+  
+  // Quote
+  else if (c == '\'') {
+    return cons(quote_symbol, cons(lispy_read(in), the_empty_list));
+  }
+
+  // EOF
+  else if (c == EOF) {
+    return NULL;
+  }
+
+  // UNRECOGNIZED INPUT
+  else {
+    error("bad input. Unexpected '%c'\n", c);
+  }
+  error("read illegal state\n");
+}
+
+
+// Bulk Read
+//___________________________________//
+//
+// Whole files are read in two passes in the style of simdjson.  The first
+// pass classifies the buffer 64 bytes at a time into bitmasks and walks the
+// set bits to build an index of token boundaries.  The second pass builds
+// objects from that index without looking at the bytes between tokens.
+
+typedef struct {
+  long start;
+  long end;
+} token;
+
+typedef struct {
+  char  *buffer;
+  long   length;
+  token *tokens;
+  long   count;
+  long   capacity;
+} structural_index;
+
+
+// Set one bit per byte for delimiters (whitespace ( ) { } " ;) and backslashes
+
+void classify_block(char *p, uint64_t *delimiters, uint64_t *backslashes) {
+  uint64_t d = 0;
+  uint64_t b = 0;
+  int i;
+
+#if defined(LISPY_AVX2)
+  for (i = 0; i < 64; i += 32) {
+    __m256i v  = _mm256_loadu_si256((__m256i *) (p + i));
+    __m256i t  = _mm256_sub_epi8(v, _mm256_set1_epi8(9));
+    __m256i ws = _mm256_or_si256(
+                   _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                   _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(4)), t));
+    __m256i delim = _mm256_or_si256(
+                      _mm256_or_si256(ws, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(';'))),
+                      _mm256_or_si256(
+                        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('(')),
+                                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(')'))),
+                        _mm256_or_si256(
+                          _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('{')),
+                                          _mm256_cmpeq_epi8(v, _mm256_set1_epi8('}'))),
+                          _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')))));
+    d |= (uint64_t) (uint32_t) _mm256_movemask_epi8(delim) << i;
+    b |= (uint64_t) (uint32_t) _mm256_movemask_epi8(
+           _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))) << i;
+  }
+#elif defined(LISPY_SSE2)
+  for (i = 0; i < 64; i += 16) {
+    __m128i v  = _mm_loadu_si128((__m128i *) (p + i));
+    __m128i t  = _mm_sub_epi8(v, _mm_set1_epi8(9));
+    __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                              _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(4)), t));
+    __m128i delim = _mm_or_si128(
+                      _mm_or_si128(ws, _mm_cmpeq_epi8(v, _mm_set1_epi8(';'))),
+                      _mm_or_si128(
+                        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('(')),
+                                     _mm_cmpeq_epi8(v, _mm_set1_epi8(')'))),
+                        _mm_or_si128(
+                          _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('{')),
+                                       _mm_cmpeq_epi8(v, _mm_set1_epi8('}'))),
+                          _mm_cmpeq_epi8(v, _mm_set1_epi8('"')))));
+    d |= (uint64_t) (uint16_t) _mm_movemask_epi8(delim) << i;
+    b |= (uint64_t) (uint16_t) _mm_movemask_epi8(
+           _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << i;
+  }
+#else
+  for (i = 0; i < 64; i++) {
+    unsigned char c = p[i];
+    if (c == ' ' || (c >= 9 && c <= 13) ||
+        c == '(' || c == ')' || c == '{' || c == '}' ||
+        c == '"' || c == ';') {
+      d |= (uint64_t) 1 << i;
+    }
+    if (c == '\\') {
+      b |= (uint64_t) 1 << i;
+    }
+  }
+#endif
+
+  *delimiters = d;
+  *backslashes = b;
+}
+
+
+void add_token(structural_index *idx, long start, long end) {
+  if (idx->count == idx->capacity) {
+    idx->capacity *= 2;
+    idx->tokens = GC_REALLOC(idx->tokens, idx->capacity * sizeof(token));
+    if (idx->tokens == NULL) {
+      error("out of memory\n");
+    }
+  }
+  idx->tokens[idx->count].start = start;
+  idx->tokens[idx->count].end = end;
+  idx->count += 1;
+}
+
+
+// Pass 1: walk the classified bits and record the start and end of every
+// token.  Only delimiters, backslashes and the first byte after a delimiter
+// are visited, so long strings, comments and symbols are skipped in bulk.
+
+enum { SCAN_NONE, SCAN_ATOM, SCAN_STRING, SCAN_COMMENT };
+
+// Length of a #f64( #s64( or #u8( that opens a numeric vector at text, or 0
+int numeric_vector_prefix(char *text, long len) {
+  if (len >= 5 && (!strncmp(text, "#f64(", 5) || !strncmp(text, "#s64(", 5))) {
+    return 5;
+  }
+  if (len >= 4 && !strncmp(text, "#u8(", 4)) {
+    return 4;
+  }
+  return 0;
+}
+
+void index_structurals(structural_index *idx) {
+  char *buf = idx->buffer;
+  long len = idx->length;
+  long block;
+  int n;
+  long skip = 0;                 // bits below skip belong to an escape
+  long start = 0;                // start of the current atom or string
+  int state = SCAN_NONE;
+  uint64_t carry = 1;            // start of buffer counts as a delimiter
+
+  for (block = 0; block < len; block += 64) {
+    uint64_t delimiters;
+    uint64_t backslashes;
+    uint64_t starts;
+    uint64_t bits;
+
+    classify_block(&buf[block], &delimiters, &backslashes);
+    if (len - block < 64) {
+      uint64_t valid = ((uint64_t) 1 << (len - block)) - 1;
+      delimiters &= valid;
+      backslashes &= valid;
+      starts = ~delimiters & ((delimiters << 1) | carry) & valid;
+    }
+    else {
+      starts = ~delimiters & ((delimiters << 1) | carry);
+    }
+    carry = delimiters >> 63;
+    bits = delimiters | backslashes | starts;
+
+    while (bits != 0) {
+      long p = block + __builtin_ctzll(bits);
+      char c = buf[p];
+      bits &= bits - 1;
+
+      if (p < skip) {
+        continue;
+      }
+
+      switch (state) {
+        case SCAN_STRING:
+          if (c == '\\') {
+            skip = p + 2;
+          }
+          else if (c == '"') {
+            add_token(idx, start, p + 1);
+            state = SCAN_NONE;
+          }
+          continue;
+
+        case SCAN_COMMENT:
+          if (c == '\n') {
+            state = SCAN_NONE;
+          }
+          continue;
+
+        case SCAN_ATOM:
+          if (!((delimiters >> (p - block)) & 1)) {
+            continue;
+          }
+          add_token(idx, start, p);
+          state = SCAN_NONE;
+          break;            // the delimiter itself still needs handling
+      }
+
+      switch (c) {
+        case '(':
+        case ')':
+        case '}':
+          add_token(idx, p, p + 1);
+          break;
+        case '{':
+          error("bad input. Unexpected '{'\n");
+        case '"':
+          start = p;
+          state = SCAN_STRING;
+          break;
+        case ';':
+          state = SCAN_COMMENT;
+          break;
+        default:
+          if (!((starts >> (p - block)) & 1)) {
+            break;           // whitespace or a stray backslash
+          }
+          // Quotes are tokens of their own and may prefix any datum
+          if (c == '\'') {
+            while (p < len && buf[p] == '\'') {
+              add_token(idx, p, p + 1);
+              p++;
+            }
+            if (p == len || is_delimiter((unsigned char) buf[p])) {
+              break;
+            }
+          }
+          if (buf[p] == '#' && p + 1 < len &&
+              (buf[p + 1] == '(' || buf[p + 1] == '{')) {
+            add_token(idx, p, p + 2);
+            skip = p + 2;
+            break;
+          }
+          if (buf[p] == '#' && (n = numeric_vector_prefix(&buf[p], len - p))) {
+            add_token(idx, p, p + n);
+            skip = p + n;
+            break;
+          }
+          if (buf[p] == '#' && p + 1 < len && buf[p + 1] == '\\') {
+            skip = p + 3;    // #\( and #\" are characters, not delimiters
+          }
+          start = p;
+          state = SCAN_ATOM;
+      }
+    }
+  }
+
+  if (state == SCAN_ATOM) {
+    add_token(idx, start, len);
+  }
+  else if (state == SCAN_STRING) {
+    error("Non-terminated string");
+  }
+}
+
+
+// Pass 2 helpers: turn the text of a single token into an object
+
+object *parse_string_token(char *text, long len) {
+  // Escapes only make the string shorter than the text between the quotes
+  object *obj = make_empty_string(len - 2);
+  char *buffer = obj->data.string.chars;
+  long i;
+  long count = 0;
+
+  // Skip the surrounding quotes
+  for (i = 1; i < len - 1; i++) {
+    char c = text[i];
+    if (c == '\\') {
+      i++;
+      c = (text[i] == 'n') ? '\n' : text[i];
+    }
+    buffer[count++] = c;
+  }
+  buffer[count] = '\0';
+  obj->data.string.length = count;
+  return validate_string(obj);
+}
+
+object *parse_atom_token(char *text, long len) {
+  char c = text[0];
+  char next = (len > 1) ? text[1] : ' ';
+  char buffer[30];
+  char *name;
+  long i;
+
+  // Numbers
+  if (isdigit(c) || (c == '-' && (isdigit(next) || next == '.')) ||
+                    (c == '.' && isdigit(next))) {
+    if (len >= sizeof(buffer)) {
+      error("Number too long");
+    }
+    memcpy(buffer, text, len);
+    buffer[len] = '\0';
+    return parse_number(buffer);
+  }
+
+  // CHARACTERs
+  else if (c == '#') {
+    if (next != '\\') {
+      error("Unrecognized syntax");
+    }
+    if (len == 2) {
+      error("incomplete character literal");
+    }
+    if (len == 3) {
+      return make_character(text[2]);
+    }
+    if ((unsigned char) text[2] >= 0x80 &&
+        utf8_validate(&text[2], len - 2) == 1) {
+      return make_character(utf8_decode(&text[2]));
+    }
+    if (len == 7 && !strncmp(&text[2], "space", 5)) {
+      return make_character(' ');
+    }
+    if (len == 9 && !strncmp(&text[2], "newline", 7)) {
+      return make_character('\n');
+    }
+    error("Character not followed by delimiter");
+  }
+
+  // SYMBOLs
+  else if (is_initial(c) || ((c == '+' || c == '-') && len == 1)) {
+    for (i = 0; i < len; i++) {
+      c = text[i];
+      if (!(is_initial(c) || isdigit(c) || c == '+' || c == '-')) {
+        error("Symbol not followed by delimiter.");
+      }
+    }
+    name = GC_MALLOC_ATOMIC(len + 1);
+    if (name == NULL) {
+      error("out of memory\n");
+    }
+    memcpy(name, text, len);
+    name[len] = '\0';
+    return make_symbol(name);
+  }
+
+  error("bad input. Unexpected '%c'\n", c);
+}
+
+
+// Pass 2: build the objects.  Open lists, vectors and pending quotes are kept
+// on an explicit stack so deeply nested data does not use the C stack.
+
+typedef struct {
+  char    kind;                  // '(' list, '#' vector, '\'' quote,
+                                 // 'f' 's' or 'u' numeric vector, '{' table
+  object *head;
+  object *tail;
+} read_frame;
+
+object *build_from_index(structural_index *idx) {
+  object *result = the_empty_list;
+  object *result_tail = NULL;
+  object *datum;
+  object *cell;
+  long capacity = 64;
+  long sp = 0;
+  long i;
+  read_frame *stack = GC_MALLOC(capacity * sizeof(read_frame));
+
+  if (stack == NULL) {
+    error("out of memory\n");
+  }
+
+  for (i = 0; i < idx->count; i++) {
+    char *text = &idx->buffer[idx->tokens[i].start];
+    long len = idx->tokens[i].end - idx->tokens[i].start;
+    char kind = 0;
+
+    switch (text[0]) {
+      case '(':
+        kind = '(';
+        break;
+      case '#':
+        if (len == 2 && text[1] == '(') {
+          kind = '#';
+        }
+        else if (len == 2 && text[1] == '{') {
+          kind = '{';
+        }
+        else if (text[len - 1] == '(') {
+          kind = text[1];
+        }
+        break;
+      case '\'':
+        kind = '\'';
+        break;
+    }
+
+    // Open a list, vector or quote
+    if (kind) {
+      if (sp == capacity) {
+        capacity *= 2;
+        stack = GC_REALLOC(stack, capacity * sizeof(read_frame));
+        if (stack == NULL) {
+          error("out of memory\n");
+        }
+      }
+      stack[sp].kind = kind;
+      stack[sp].head = the_empty_list;
+      stack[sp].tail = NULL;
+      sp++;
+      continue;
+    }
+
+    if (text[0] == ')' || text[0] == '}') {
+      if (sp == 0 || stack[sp - 1].kind == '\'' ||
+          (text[0] == '}') != (stack[sp - 1].kind == '{')) {
+        error("bad input. Unexpected '%c'\n", text[0]);
+      }
+      sp--;
+      datum = stack[sp].head;
+      switch (stack[sp].kind) {
+        case '#':
+          datum = cons(vector_symbol, datum);
+          break;
+        case 'f':
+          datum = cons(f64vector_symbol, datum);
+          break;
+        case 's':
+          datum = cons(s64vector_symbol, datum);
+          break;
+        case 'u':
+          datum = cons(u8vector_symbol, datum);
+          break;
+        case '{':
+          datum = cons(hash_table_symbol, datum);
+          break;
+      }
+    }
+    else if (text[0] == '"') {
+      datum = parse_string_token(text, len);
+    }
+    else {
+      datum = parse_atom_token(text, len);
+    }
+
+    // A complete datum closes any pending quotes, then joins its parent
+    while (sp > 0 && stack[sp - 1].kind == '\'') {
+      datum = cons(quote_symbol, cons(datum, the_empty_list));
+      sp--;
+    }
+    cell = cons(datum, the_empty_list);
+    if (sp == 0) {
+      if (result_tail == NULL) {
+        result = cell;
+      }
+      else {
+        set_cdr(result_tail, cell);
+      }
+      result_tail = cell;
+    }
+    else {
+      if (stack[sp - 1].tail == NULL) {
+        stack[sp - 1].head = cell;
+      }
+      else {
+        set_cdr(stack[sp - 1].tail, cell);
+      }
+      stack[sp - 1].tail = cell;
+    }
+  }
+
+  if (sp != 0) {
+    error("Unexpected end of input");
+  }
+  return result;
+}
+
+
+// Read every datum in a buffer into a list.  The buffer must have 64 readable
+// bytes past length for the block classifier.
+
+object *read_buffer(char *buffer, long length) {
+  structural_index idx;
+
+  idx.buffer = buffer;
+  idx.length = length;
+  idx.count = 0;
+  idx.capacity = length / 8 + 64;
+  idx.tokens = GC_MALLOC_ATOMIC(idx.capacity * sizeof(token));
+  if (idx.tokens == NULL) {
+    error("out of memory\n");
+  }
+
+  index_structurals(&idx);
+  return build_from_index(&idx);
+}
+
+
+// Read a whole file into a buffer padded for read_buffer
+
+char *read_file_contents(char *filename, long *length_out) {
+  FILE *in;
+  char *buffer;
+  long length;
+
+  in = fopen(filename, "rb");
+  if (in == NULL) {
+    error("could not load file \"%s\"", filename);
+  }
+  fseek(in, 0, SEEK_END);
+  length = ftell(in);
+  fseek(in, 0, SEEK_SET);
+
+  // Padding lets classify_block read a full 64 bytes at the end
+  buffer = GC_MALLOC_ATOMIC(length + 64);
+  if (buffer == NULL) {
+    fclose(in);
+    error("out of memory\n");
+  }
+  if (fread(buffer, 1, length, in) != length) {
+    fclose(in);
+    error("could not read file \"%s\"", filename);
+  }
+  fclose(in);
+
+  *length_out = length;
+  return buffer;
+}
+
+
+// Read every datum in a file into a list
+
+object *read_file(char *filename) {
+  char *buffer;
+  long length;
+
+  buffer = read_file_contents(filename, &length);
+  return read_buffer(buffer, length);
+}
+
+
+
+/** ***************************************************************************
+**                               Evaluate
+******************************************************************************/
+
+// Self-Evaluating
+//___________________________________//
+
+char is_self_evaluating(object *exp) {
+  return is_boolean(exp)   ||
+         is_fixnum(exp)    ||
+         is_flonum(exp)    ||
+         is_character(exp) ||
+         is_string(exp)    ||
+         is_numeric_vector(exp) ||
+         is_persistent_vector(exp) ||
+         is_persistent_map(exp) ||
+         is_range(exp)     ||
+         exp->type == VOID;
+}
+
+
+// Primitive Syntax?
+//___________________________________//
+
+char is_primitive_syntax(object *expression, object *identifier) {
+  object *the_car;
+  
+  if (is_pair(expression)) {
+    the_car = car(expression);
+    return is_symbol(the_car) && (the_car == identifier);
+  }
+  return 0;
+}
+
+
+// quote
+//___________________________________//
+
+char is_quoted(object *expression) {
+  return is_primitive_syntax(expression, quote_symbol);
+}
+
+object *quote_macro_arguments(object *exp) {
+  return cons(quote_symbol, 
+              cons(exp, 
+                   the_empty_list));
+}
+
+
+// set!
+//___________________________________//
+
+char is_assignment(object *exp) {
+  return is_primitive_syntax(exp, set_symbol);
+}
+
+object *assignment_variable(object *exp) {
+  return car(cdr(exp));
+}
+
+object *assignment_value(object *exp) {
+  return car(cdr(cdr(exp)));
+}
+
+
+// lambda
+//___________________________________//
+
+object *make_lambda(object *parameters, object *body) {
+  return cons(lambda_symbol, cons(parameters, body));
+}
+
+char is_lambda(object *exp) {
+  return is_primitive_syntax(exp, lambda_symbol);
+}
+
+object *lambda_parameters(object *exp) {
+  return cadr(exp);
+}
+
+object *lambda_body(object *exp) {
+  return cddr(exp);
+}
+
+char is_last_exp(object *seq) {
+  return is_the_empty_list(cdr(seq));
+}
+
+
+// define
+//___________________________________//
+
+
+char is_definition(object *exp) {
+  return is_primitive_syntax(exp, define_symbol);
+}
+
+object *definition_variable(object *exp) {
+  if (is_symbol(cadr(exp))) {
+    return cadr(exp);
+  }
+  else {
+    return caadr(exp);
+  }
+}
+
+object *definition_value(object *exp) {
+  if (is_symbol(cadr(exp))) {
+    return caddr(exp);
+  }
+  else {
+    return make_lambda(cdadr(exp), cddr(exp));
+  }
+}
+
+
+// if
+//___________________________________//
+
+char is_if(object *expression) {
+  return is_primitive_syntax(expression, if_symbol);
+}
+
+object *make_if(object *test, object *consequent, object *alternative) {
+  return cons(if_symbol,
+              cons(test,
+                   cons(consequent,
+                        cons(alternative,
+                             the_empty_list))));
+}
+
+
+// cond
+//___________________________________//
+
+object *make_cond(object *clauses) {
+  object *first = car(clauses);
+  object *rest = cdr(clauses);
+  
+  if (clauses == the_empty_list) {
+    return False;
+  }
+  else if (car(first) == else_symbol) {
+    return cadr(first);            // Does not check that else is last clause
+  }
+  else {
+    return make_if(car(first), cadr(first), make_cond(rest));
+  }
+}
+
+
+// let
+//___________________________________//
+
+object *make_let(object *exp) {
+  object *bindings = car(exp);
+  object *first_binding = car(bindings);
+  object *body = cdr(exp);
+  object *params = the_empty_list;
+  object *values = the_empty_list;
+  
+  while (bindings != the_empty_list) {
+    params = cons(car(first_binding), params);
+    values = cons(cadr(first_binding), values);
+    bindings = cdr(bindings);
+    first_binding = car(bindings);
+  }
+  
+  return cons(make_lambda(params, body), values);
+}
+
+
+// test
+//___________________________________//
+object *h_equalp(object *obj_1, object *obj_2);
+object *eval(object *exp, object *env);
+
+object *test(object *exp) {
+  object *test_case;
+  object *expected;
+  object *result;
+  object *env = extend_environment(the_empty_list,
+                                   the_empty_list,
+                                   current_interpreter->global_environment);
+
+  while (exp != the_empty_list) {
+    test_case = car(exp);
+    expected = caddr(exp);
+
+    result = h_equalp(eval(test_case, env), eval(expected, env));
+    
+    if (result == False) {
+      write_object(current_interpreter->stdout_port, test_case);
+      port_puts(current_interpreter->stdout_port, "\n!= ");
+      write_object(current_interpreter->stdout_port, expected);
+      port_putc(current_interpreter->stdout_port, '\n');
+    }
+    exp = cdddr(exp);
+  }
+  return Void;
+}
+
+// Application of Primitive Procedures
+//___________________________________//
+
+char is_application(object *exp) {
+  return is_pair(exp);
+}
+
+
+// eval arguments
+//___________________________________//
+
+
+object *list_of_values(object *exps, object *env) {
+  if (is_the_empty_list(exps)) {
+    return the_empty_list;
+  }
+  else {
+    return cons(eval(car(exps), env),
+                list_of_values(cdr(exps), env));
+  }
+}
+
+object *h_reverse(object *lst) {
+  object *temp_list = the_empty_list;
+  while (lst != the_empty_list) {
     temp_list = cons(car(lst), temp_list);
     lst = cdr(lst);
   }
-  return temp_list;
+  return temp_list;
+}
+
+// This needs some serious refactoring!!!
+// It also needs to check for too few arguments.
+object *eval_arguments(object *args, object *env, object *parameters) {
+  object *result_list = the_empty_list;
+  object *rest_list = the_empty_list;
+  int rest_argument_present = 0;
+  
+  while (parameters != the_empty_list) {
+    if (car(parameters) == rest_symbol) {
+      rest_argument_present = 1;
+      while (args != the_empty_list) {
+        rest_list = cons(eval(car(args), env),
+                         rest_list);
+        args = cdr(args);
+      }
+      break;
+    }
+    else {
+      result_list = cons(eval(car(args), env), 
+                         result_list);
+      args = cdr(args);
+      parameters = cdr(parameters);
+    }
+  }
+  if (!rest_argument_present) {
+    return h_reverse(result_list);
+  }
+  else {
+    rest_list = h_reverse(rest_list);
+    result_list = cons(rest_list, result_list);
+    return h_reverse(result_list);
+  }
+}
+
+
+// eval
+//___________________________________//
+
+object *eval(object *exp, object *env) {
+  object *procedure;
+  object *arguments;
+
+tailcall:
+
+  switch (exp->type) {
+    case BOOLEAN:
+    case FIXNUM:
+    case FLONUM:
+    case CHARACTER:
+    case STRING:
+    case NUMERIC_VECTOR:
+    case PERSISTENT_VECTOR:
+    case PERSISTENT_MAP:
+    case RANGE:
+    case VOID:
+      return exp;
+    case SYMBOL:
+      return lookup_variable_value(exp, env);
+    case PAIR:
+      procedure = car(exp);
+      
+      if (procedure == quote_symbol) {
+        return cadr(exp);
+      }
+      else if (procedure == set_symbol) {
+        set_variable_value(assignment_variable(exp),
+                           eval(assignment_value(exp), env),
+                           env);
+        return Void;
+
+      }
+      else if (procedure == define_symbol) {
+        define_variable(definition_variable(exp),
+                        eval(definition_value(exp), env),
+                        env);
+        return Void;
+      }
+      else if (procedure == if_symbol) {
+        exp = is_true(eval(cadr(exp), env)) ?
+                caddr(exp) :
+                // Handle (if test consequent else alternative)
+                (cadddr(exp) == else_symbol) ?
+                  caddddr(exp) :
+                  cadddr(exp);
+        goto tailcall;
+      }
+      else if (procedure == cond_symbol) {
+        exp = make_cond(cdr(exp));
+        goto tailcall;
+      }
+      else if (procedure == lambda_symbol) {
+        // Check for presence of a docstring
+        if (caddr(exp)->type == STRING) {
+          return make_compound_procedure(cadr(exp), cdddr(exp), env, caddr(exp));
+        }
+        else {
+          return make_compound_procedure(cadr(exp), cddr(exp), env, make_string("No docstring"));
+        }
+      }
+      else if (procedure == begin_symbol) {
+        exp = cdr(exp);
+        while (!is_last_exp(exp)) {
+          eval(car(exp), env);
+          exp = cdr(exp);
+        }
+        exp = car(exp);
+        goto tailcall;
+      }
+      else if (procedure == let_symbol) {
+        exp = make_let(cdr(exp));
+        goto tailcall;
+      }
+      else if (procedure == and_symbol) {
+        object *args = cdr(exp);
+        object *e;
+        while (args != the_empty_list) {
+          e = eval(car(args), env);
+          if (e == False) {
+            return False;
+          }
+          args = cdr(args);
+        }
+        return e;
+      }
+      else if (procedure == or_symbol) {
+        object *result;
+        exp = cdr(exp);
+        while (exp != the_empty_list) {
+          result = eval(car(exp), env);
+          if (result == False) {
+            exp = cdr(exp);
+          }
+          else {
+            return result;
+          }
+        }
+        return False;
+      }
+      else if (procedure == apply_symbol) {
+        exp = cons(cadr(exp), h_sequence_list(eval(caddr(exp), env)));
+        goto tailcall;
+      }
+      else if (procedure == eval_symbol) {
+        if (cddr(exp) != the_empty_list) {
+          env = eval(caddr(exp), env);
+          exp = eval(cadr(exp), env);
+          goto tailcall;
+        }
+        else {
+          exp = eval(cadr(exp), env);
+          goto tailcall;
+        }
+      }
+      else if (procedure == define_macro_symbol) {
+        define_variable(cadr(exp), make_macro(caddr(exp)), env);
+        return Void;
+        
+      }
+      else if (procedure == test_symbol) {
+        return test(cdr(exp));
+        
+      }
+      else if (procedure == list_symbol) {
+        return h_list(cdr(exp), env);
+      }
+      else if (procedure == string_symbol) {
+        return h_string(cdr(exp), env);
+      }
+      else if (procedure == vector_symbol) {
+        return h_vector(cdr(exp), env);
+      }
+      else if (procedure == for_symbol) {
+        return h_for(cdr(exp), env);
+      }
+      else if (procedure == future_symbol) {
+        return h_future(cdr(exp), env);
+      }
+      else if (procedure == pmap_symbol) {
+        return h_pmap(cdr(exp), env);
+      }
+      else {
+        procedure = eval(procedure, env);
+        switch (procedure->type) {
+          case PRIMITIVE_PROCEDURE:
+            return (procedure->data.primitive_procedure.fn)(list_of_values(cdr(exp), env));
+          case COMPOUND_PROCEDURE:
+            env = extend_environment(procedure->data.compound_procedure.parameters,
+                                    eval_arguments(cdr(exp), env, procedure->data.compound_procedure.parameters),
+                                    procedure->data.compound_procedure.env);
+            
+            // Transform lambda body into begin form
+            exp = cons(begin_symbol, procedure->data.compound_procedure.body);
+            goto tailcall;
+            break;
+          case MACRO:
+            // Expand macro by passing the arguments to the transformer unevaluated
+            exp =  eval(cons(procedure->data.macro.transformer, 
+                            cons(quote_macro_arguments(cdr(exp)),
+                                  the_empty_list)),
+                        env);
+            goto tailcall;
+            break;
+        }
+      }
+  }
+}
+
+// Call a procedure object from C with a list of already evaluated arguments
+object *apply_procedure(object *procedure, object *arguments) {
+  object *exp = the_empty_list;
+  
+  arguments = h_reverse(arguments);
+  while (arguments != the_empty_list) {
+    exp = cons(quote_macro_arguments(car(arguments)), exp);
+    arguments = cdr(arguments);
+  }
+  return eval(cons(quote_macro_arguments(procedure), exp),
+              current_interpreter->global_environment);
+}
+
+
+/** ***************************************************************************
+**                                 Print
+******************************************************************************/
+
+
+// Ports
+//___________________________________//
+// Output ports collect characters in a userspace buffer.  File ports hand the
+// buffer to stdio in one block when it fills or is flushed; string ports grow
+// their buffer instead and are read back with port_to_string.
+
+void port_drain(object *port) {
+  if (port->data.port.kind == OUTPUT_PORT && port->data.port.length > 0) {
+    fwrite(port->data.port.buffer, 1, port->data.port.length,
+           port->data.port.stream);
+    port->data.port.length = 0;
+  }
+}
+
+void port_flush(object *port) {
+  if (port->data.port.kind == OUTPUT_PORT) {
+    port_drain(port);
+    fflush(port->data.port.stream);
+  }
+}
+
+void flush_output(void) {
+  if (current_interpreter != NULL) {
+    port_flush(current_interpreter->stdout_port);
+  }
+}
+
+// Output file ports are kept on their interpreter's output_files until they
+// are closed, so what is still in their buffers when the interpreter is
+// freed or the process exits is written out.  Interpreters and futures on
+// other threads open and close them, hence the lock.
+pthread_mutex_t ports_lock = PTHREAD_MUTEX_INITIALIZER;
+interpreter *interpreters;
+
+void port_opened(object *port) {
+  pthread_mutex_lock(&ports_lock);
+  current_interpreter->output_files = cons(port,
+                                           current_interpreter->output_files);
+  pthread_mutex_unlock(&ports_lock);
+}
+
+void port_closed(object *port) {
+  interpreter *interp;
+  object **files;
+
+  pthread_mutex_lock(&ports_lock);
+  for (interp = interpreters; interp != NULL; interp = interp->next) {
+    for (files = &interp->output_files; *files != the_empty_list;
+         files = &(*files)->data.pair.cdr) {
+      if (car(*files) == port) {
+        *files = cdr(*files);
+        pthread_mutex_unlock(&ports_lock);
+        return;
+      }
+    }
+  }
+  pthread_mutex_unlock(&ports_lock);
+}
+
+void interpreter_flush_all(interpreter *interp) {
+  object *files;
+
+  port_flush(interp->stdout_port);
+  for (files = interp->output_files; files != the_empty_list;
+       files = cdr(files)) {
+    port_flush(car(files));
+  }
+}
+
+// Registered with atexit, for hosts that return without lispy_free
+void flush_all_output(void) {
+  interpreter *interp;
+
+  pthread_mutex_lock(&ports_lock);
+  for (interp = interpreters; interp != NULL; interp = interp->next) {
+    interpreter_flush_all(interp);
+  }
+  pthread_mutex_unlock(&ports_lock);
+}
+
+void port_write(object *port, char *chars, long int len) {
+  long int needed = port->data.port.length + len;
+
+  if (needed > port->data.port.capacity) {
+    if (port->data.port.kind == STRING_PORT) {
+      port->data.port.capacity *= 2;
+      if (port->data.port.capacity < needed) {
+        port->data.port.capacity = needed;
+      }
+      port->data.port.buffer = GC_REALLOC(port->data.port.buffer,
+                                          port->data.port.capacity);
+      if (port->data.port.buffer == NULL) {
+        error("Out of memory!");
+      }
+    } else {
+      port_drain(port);
+      // Blocks larger than the buffer skip it
+      if (len >= port->data.port.capacity) {
+        fwrite(chars, 1, len, port->data.port.stream);
+        return;
+      }
+    }
+  }
+  memcpy(port->data.port.buffer + port->data.port.length, chars, len);
+  port->data.port.length += len;
+}
+
+void port_putc(object *port, char c) {
+  if (port->data.port.length < port->data.port.capacity) {
+    port->data.port.buffer[port->data.port.length++] = c;
+  } else {
+    port_write(port, &c, 1);
+  }
+}
+
+void port_puts(object *port, char *str) {
+  port_write(port, str, strlen(str));
+}
+
+object *port_to_string(object *port) {
+  return make_string_length(port->data.port.buffer, port->data.port.length);
+}
+
+
+// Flonums
+//___________________________________//
+// Flonums are written with the fewest digits that read back as the same
+// double, using Loitsch's Grisu2: the value and its rounding boundaries are
+// scaled by a cached power of ten into 64-bit fixed point and digits are
+// generated until the boundaries are within reach.  The output always has a
+// '.' or an exponent so it reads back as a flonum.
+
+typedef struct {
+  uint64_t f;
+  int e;
+} diy_fp;
+
+#define DP_SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+#define DP_HIDDEN_BIT       0x0010000000000000ULL
+#define DP_EXPONENT_BIAS    (0x3FF + 52)
+
+// 10^k as normalized diy_fps for k = -348, -340, ..., 340
+static const uint64_t cached_powers_f[] = {
+  0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+  0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+  0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+  0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+  0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+  0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+  0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+  0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+  0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+  0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+  0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+  0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+  0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+  0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+  0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+  0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+  0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+  0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+  0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+  0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+  0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+  0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+  0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+  0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+  0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+  0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+  0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+  0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+  0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+
+static const int16_t cached_powers_e[] = {
+  -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+  -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+  -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+  -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+  -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+  109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+  375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+  641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+  907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static const uint64_t powers_of_ten[] = {
+  1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+  100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL,
+  1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+  1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+  1000000000000000000ULL, 10000000000000000000ULL
+};
+
+diy_fp make_diy_fp(uint64_t f, int e) {
+  diy_fp fp;
+  fp.f = f;
+  fp.e = e;
+  return fp;
+}
+
+// The upper 64 bits of the 128-bit product, rounded
+diy_fp diy_fp_multiply(diy_fp x, diy_fp y) {
+  const uint64_t M32 = 0xFFFFFFFFULL;
+  uint64_t a = x.f >> 32;
+  uint64_t b = x.f & M32;
+  uint64_t c = y.f >> 32;
+  uint64_t d = y.f & M32;
+  uint64_t ac = a * c;
+  uint64_t bc = b * c;
+  uint64_t ad = a * d;
+  uint64_t bd = b * d;
+  uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32) + (1ULL << 31);
+  
+  return make_diy_fp(ac + (ad >> 32) + (bc >> 32) + (tmp >> 32),
+                     x.e + y.e + 64);
+}
+
+diy_fp diy_fp_normalize(diy_fp x) {
+  int shift = __builtin_clzll(x.f);
+  return make_diy_fp(x.f << shift, x.e - shift);
+}
+
+diy_fp diy_fp_from_double(double value) {
+  uint64_t bits;
+  int biased_e;
+  
+  memcpy(&bits, &value, sizeof(bits));
+  biased_e = (bits >> 52) & 0x7FF;
+  if (biased_e != 0) {
+    return make_diy_fp((bits & DP_SIGNIFICAND_MASK) + DP_HIDDEN_BIT,
+                       biased_e - DP_EXPONENT_BIAS);
+  }
+  return make_diy_fp(bits & DP_SIGNIFICAND_MASK, 1 - DP_EXPONENT_BIAS);
+}
+
+// The halfway points to the neighbouring doubles, sharing plus's exponent
+void diy_fp_boundaries(diy_fp v, diy_fp *minus, diy_fp *plus) {
+  diy_fp pl = make_diy_fp((v.f << 1) + 1, v.e - 1);
+  diy_fp mi;
+  
+  while (!(pl.f & (DP_HIDDEN_BIT << 1))) {
+    pl.f <<= 1;
+    pl.e--;
+  }
+  pl.f <<= 10;
+  pl.e -= 10;
+  
+  // The gap below a power of two is half the gap above it
+  if (v.f == DP_HIDDEN_BIT) {
+    mi = make_diy_fp((v.f << 2) - 1, v.e - 2);
+  } else {
+    mi = make_diy_fp((v.f << 1) - 1, v.e - 1);
+  }
+  mi.f <<= mi.e - pl.e;
+  mi.e = pl.e;
+  
+  *minus = mi;
+  *plus = pl;
+}
+
+// A cached power 10^-k that brings a number with binary exponent e into
+// the range where digit generation works
+diy_fp cached_power(int e, int *k) {
+  double dk = (-61 - e) * 0.30102999566398114 + 347;
+  int ik = (int) dk;
+  int index;
+  
+  if (dk - ik > 0.0) {
+    ik++;
+  }
+  index = (ik >> 3) + 1;
+  *k = -(-348 + index * 8);
+  return make_diy_fp(cached_powers_f[index], cached_powers_e[index]);
+}
+
+// Move the last digit towards w while it stays within the boundaries
+void grisu_round(char *buffer, int length, uint64_t delta, uint64_t rest,
+                 uint64_t ten_kappa, uint64_t wp_w) {
+  while (rest < wp_w && delta - rest >= ten_kappa &&
+         (rest + ten_kappa < wp_w ||
+          wp_w - rest > rest + ten_kappa - wp_w)) {
+    buffer[length - 1]--;
+    rest += ten_kappa;
+  }
+}
+
+int count_digits(uint32_t n) {
+  int digits = 1;
+  
+  while (n >= 10) {
+    n /= 10;
+    digits++;
+  }
+  return digits;
+}
+
+// Write the digits of w, returning how many, and adjust k so that the
+// value is digits * 10^k
+int grisu_digits(diy_fp w, diy_fp mp, uint64_t delta, char *buffer, int *k) {
+  diy_fp one = make_diy_fp(1ULL << -mp.e, mp.e);
+  uint64_t wp_w = mp.f - w.f;
+  uint32_t p1 = (uint32_t) (mp.f >> -one.e);
+  uint64_t p2 = mp.f & (one.f - 1);
+  int kappa = count_digits(p1);
+  int length = 0;
+  uint32_t d;
+  uint64_t rest;
+  
+  // Integral part
+  while (kappa > 0) {
+    d = p1 / powers_of_ten[kappa - 1];
+    p1 %= powers_of_ten[kappa - 1];
+    if (d != 0 || length != 0) {
+      buffer[length++] = '0' + d;
+    }
+    kappa--;
+    rest = ((uint64_t) p1 << -one.e) + p2;
+    if (rest <= delta) {
+      *k += kappa;
+      grisu_round(buffer, length, delta, rest,
+                  powers_of_ten[kappa] << -one.e, wp_w);
+      return length;
+    }
+  }
+  
+  // Fractional part
+  while (1) {
+    p2 *= 10;
+    delta *= 10;
+    d = p2 >> -one.e;
+    if (d != 0 || length != 0) {
+      buffer[length++] = '0' + d;
+    }
+    p2 &= one.f - 1;
+    kappa--;
+    if (p2 < delta) {
+      *k += kappa;
+      grisu_round(buffer, length, delta, p2, one.f,
+                  -kappa < 20 ? wp_w * powers_of_ten[-kappa] : 0);
+      return length;
+    }
+  }
+}
+
+// Lay out digits * 10^k the way a reader expects a flonum
+int format_digits(char *buffer, int length, int k) {
+  int point = length + k;           // digits before the decimal point
+  int i;
+  
+  if (k >= 0 && point <= 21) {
+    // 1234e7 -> 12340000000.0
+    for (i = length; i < point; i++) {
+      buffer[i] = '0';
+    }
+    buffer[point] = '.';
+    buffer[point + 1] = '0';
+    return point + 2;
+  }
+  if (point > 0 && point <= 21) {
+    // 1234e-2 -> 12.34
+    memmove(&buffer[point + 1], &buffer[point], length - point);
+    buffer[point] = '.';
+    return length + 1;
+  }
+  if (point > -6 && point <= 0) {
+    // 1234e-6 -> 0.001234
+    memmove(&buffer[2 - point], buffer, length);
+    buffer[0] = '0';
+    buffer[1] = '.';
+    for (i = 2; i < 2 - point; i++) {
+      buffer[i] = '0';
+    }
+    return length + 2 - point;
+  }
+  // 1234e30 -> 1.234e33
+  if (length > 1) {
+    memmove(&buffer[2], &buffer[1], length - 1);
+    buffer[1] = '.';
+    length++;
+  }
+  return length + sprintf(&buffer[length], "e%d", point - 1);
+}
+
+// Write value into buffer, which must hold 32 characters, and return the
+// length
+int format_flonum(double value, char *buffer) {
+  diy_fp v;
+  diy_fp w;
+  diy_fp minus;
+  diy_fp plus;
+  diy_fp c_mk;
+  int sign = 0;
+  int k;
+  int length;
+  
+  if (isnan(value)) {
+    strcpy(buffer, "+nan.0");
+    return 6;
+  }
+  if (signbit(value)) {
+    buffer[0] = '-';
+    value = -value;
+    sign = 1;
+  }
+  if (isinf(value)) {
+    if (!sign) {
+      buffer[0] = '+';
+    }
+    strcpy(&buffer[1], "inf.0");
+    return 6;
+  }
+  if (value == 0.0) {
+    strcpy(&buffer[sign], "0.0");
+    return sign + 3;
+  }
+  
+  v = diy_fp_from_double(value);
+  diy_fp_boundaries(v, &minus, &plus);
+  c_mk = cached_power(plus.e, &k);
+  w = diy_fp_multiply(diy_fp_normalize(v), c_mk);
+  plus = diy_fp_multiply(plus, c_mk);
+  minus = diy_fp_multiply(minus, c_mk);
+  minus.f++;
+  plus.f--;
+  length = grisu_digits(w, plus, plus.f - minus.f, &buffer[sign], &k);
+  return sign + format_digits(&buffer[sign], length, k);
+}
+
+
+// Pointer Table
+//___________________________________//
+// Open addressing map from objects to numbers: labels for shared structure
+// when printing and object numbers when writing FASL.  The objects are
+// reachable from the one being written, so the table does not need to be
+// scanned by the collector.
+
+typedef struct {
+  object *key;
+  long    value;
+} pointer_entry;
+
+typedef struct {
+  pointer_entry *entries;
+  long           count;
+  long           capacity;
+} pointer_table;
+
+void pointer_table_init(pointer_table *table, long capacity) {
+  table->count = 0;
+  table->capacity = capacity;
+  table->entries = GC_MALLOC_ATOMIC(capacity * sizeof(pointer_entry));
+  if (table->entries == NULL) {
+    error("out of memory\n");
+  }
+  memset(table->entries, 0, capacity * sizeof(pointer_entry));
+}
+
+// Objects are allocated close together and mostly visited in allocation
+// order, so dropping the alignment bits keeps neighbouring probes in cache.
+unsigned long hash_pointer(object *obj) {
+  return (uintptr_t) obj >> 4;
+}
+
+// Returns the value already stored for obj, or stores value and returns -1
+long pointer_table_add(pointer_table *table, object *obj, long value) {
+  unsigned long mask;
+  unsigned long i;
+  
+  if (2 * (table->count + 1) > table->capacity) {
+    pointer_table old = *table;
+    long j;
+    
+    pointer_table_init(table, old.capacity * 2);
+    for (j = 0; j < old.capacity; j++) {
+      if (old.entries[j].key != NULL) {
+        pointer_table_add(table, old.entries[j].key, old.entries[j].value);
+      }
+    }
+  }
+  
+  mask = table->capacity - 1;
+  i = hash_pointer(obj) & mask;
+  while (table->entries[i].key != NULL) {
+    if (table->entries[i].key == obj) {
+      return table->entries[i].value;
+    }
+    i = (i + 1) & mask;
+  }
+  table->entries[i].key = obj;
+  table->entries[i].value = value;
+  table->count += 1;
+  return -1;
+}
+
+// The entry is only valid until the next pointer_table_add
+pointer_entry *pointer_table_lookup(pointer_table *table, object *obj) {
+  unsigned long mask = table->capacity - 1;
+  unsigned long i = hash_pointer(obj) & mask;
+  
+  while (table->entries[i].key != NULL) {
+    if (table->entries[i].key == obj) {
+      return &table->entries[i];
+    }
+    i = (i + 1) & mask;
+  }
+  return NULL;
+}
+
+
+// Printer
+//___________________________________//
+// The printer keeps the lists, vectors and procedures it is inside of on an
+// explicit stack, so neither long lists nor deep nesting use the C stack.
+// It can label shared structure as #0= ... #0# and stop at a depth or length
+// limit, which the REPL uses so huge or circular results still print.
+
+#define WRITE_STACK_SIZE 32
+
+// Objects found once by find_shared are -1, objects found more than once are
+// -2 until printed, then their label
+#define LABEL_UNSHARED -1
+#define LABEL_PENDING  -2
+
+typedef struct {
+  object *obj;             // current pair of a list, a vector, a hash table
+                           // or a procedure
+  long int index;          // elements written so far, -1 after a dotted tail,
+                           // the next of the entries of a hash table
+  long int count;          // elements of a hash table written so far
+} write_frame;
+
+typedef struct {
+  object *port;
+  pointer_table *labels;   // NULL unless labelling shared structure
+  long int next_label;
+  long int max_depth;      // 0 for no limit
+  long int max_length;     // 0 for no limit
+  write_frame *stack;
+  long int top;
+  long int capacity;
+} printer;
+
+
+void printer_init(printer *p, object *port, write_frame *stack) {
+  p->port = port;
+  p->labels = NULL;
+  p->next_label = 0;
+  p->max_depth = 0;
+  p->max_length = 0;
+  p->stack = stack;
+  p->top = 0;
+  p->capacity = WRITE_STACK_SIZE;
+}
+
+void printer_push(printer *p, object *obj) {
+  write_frame *stack;
+  
+  if (p->top == p->capacity) {
+    stack = GC_MALLOC(2 * p->capacity * sizeof(write_frame));
+    if (stack == NULL) {
+      error("out of memory\n");
+    }
+    memcpy(stack, p->stack, p->capacity * sizeof(write_frame));
+    p->stack = stack;
+    p->capacity *= 2;
+  }
+  p->stack[p->top].obj = obj;
+  p->stack[p->top].index = 0;
+  p->stack[p->top].count = 0;
+  p->top += 1;
+}
+
+
+// Record in labels every pair, vector and procedure reachable from obj, marking
+// the ones reached more than once
+void find_shared(pointer_table *labels, object *obj) {
+  long int capacity = WRITE_STACK_SIZE;
+  long int elements;
+  long int top = 0;
+  object **stack = GC_MALLOC(capacity * sizeof(object *));
+  object **bigger;
+  pointer_entry *entry;
+  hash_slots *slots;
+  long int i;
+  
+  stack[top++] = obj;
+  while (top > 0) {
+    obj = stack[--top];
+    while (obj != NULL) {
+      if (obj->type != PAIR && obj->type != VECTOR &&
+          obj->type != HASH_TABLE && obj->type != PERSISTENT_VECTOR &&
+          obj->type != PERSISTENT_MAP &&
+          obj->type != COMPOUND_PROCEDURE && obj->type != MACRO) {
+        break;
+      }
+      entry = pointer_table_lookup(labels, obj);
+      if (entry != NULL) {
+        entry->value = LABEL_PENDING;
+        break;
+      }
+      pointer_table_add(labels, obj, LABEL_UNSHARED);
+      
+      // Persistent collections are walked as the vector they print as
+      if (obj->type == PERSISTENT_VECTOR || obj->type == PERSISTENT_MAP) {
+        obj = persistent_items(obj);
+      }
+      
+      // Make room for every element of a vector or hash table at once
+      elements = (obj->type == VECTOR) ? obj->data.vector.length :
+                 (obj->type == HASH_TABLE) ?
+                   2 * obj->data.hash_table.slots->count : 0;
+      if (top + 2 + elements > capacity) {
+        capacity = 2 * capacity + elements;
+        bigger = GC_MALLOC(capacity * sizeof(object *));
+        if (bigger == NULL) {
+          error("out of memory\n");
+        }
+        memcpy(bigger, stack, top * sizeof(object *));
+        stack = bigger;
+      }
+      
+      switch (obj->type) {
+        case PAIR:
+          stack[top++] = car(obj);
+          obj = cdr(obj);
+          break;
+        case VECTOR:
+          for (i = obj->data.vector.length - 1; i >= 0; i--) {
+            stack[top++] = obj->data.vector.vec[i];
+          }
+          obj = NULL;
+          break;
+        case HASH_TABLE:
+          slots = obj->data.hash_table.slots;
+          for (i = 0; i < slots->capacity; i++) {
+            if (slots->control[i] >= 0) {
+              stack[top++] = slots->entries[2 * i + 1];
+              stack[top++] = slots->entries[2 * i];
+            }
+          }
+          obj = NULL;
+          break;
+        case COMPOUND_PROCEDURE:
+          stack[top++] = obj->data.compound_procedure.parameters;
+          obj = obj->data.compound_procedure.body;
+          break;
+        default:
+          obj = obj->data.macro.transformer;
+      }
+    }
+  }
+}
+
+// Write the #n= or #n# of a labelled object.  Returns 1 when obj has already
+// been written and nothing more should be.
+char write_label(printer *p, object *obj) {
+  char buffer[32];
+  pointer_entry *entry;
+  
+  if (p->labels == NULL) {
+    return 0;
+  }
+  entry = pointer_table_lookup(p->labels, obj);
+  if (entry == NULL || entry->value == LABEL_UNSHARED) {
+    return 0;
+  }
+  if (entry->value == LABEL_PENDING) {
+    entry->value = p->next_label++;
+    port_write(p->port, buffer, sprintf(buffer, "#%ld=", entry->value));
+    return 0;
+  }
+  port_write(p->port, buffer, sprintf(buffer, "#%ld#", entry->value));
+  return 1;
+}
+
+char is_labelled(printer *p, object *obj) {
+  pointer_entry *entry;
+  
+  if (p->labels == NULL) {
+    return 0;
+  }
+  entry = pointer_table_lookup(p->labels, obj);
+  return entry != NULL && entry->value != LABEL_UNSHARED;
+}
+
+
+void write_string(object *port, object *obj) {
+  char *str = obj->data.string.chars;
+  char *end = str + obj->data.string.length;
+  char *run;
+
+  port_putc(port, '"');
+  while (str < end) {
+    // Copy everything up to the next character that needs escaping at once
+    run = str;
+    while (str < end && *str != '\n' && *str != '\\' && *str != '"') {
+      str++;
+    }
+    port_write(port, run, str - run);
+    if (str == end) {
+      break;
+    }
+    switch (*str) {
+      case '\n':
+        port_write(port, "\\n", 2);
+        str++;
+        break;
+      case '\\':
+        port_write(port, "\\\\", 2);
+        str++;
+        break;
+      case '"':
+        port_write(port, "\\\"", 2);
+        str++;
+        break;
+    }
+  }
+  port_putc(port, '"');
+}
+
+
+// Write an object that has no elements
+void write_atom(object *port, object *obj) {
+  char buffer[64];
+  int c;
+
+  switch (obj->type) {
+    case FIXNUM:                                      // FIXNUM
+      port_write(port, buffer, sprintf(buffer, "%ld", obj->data.fixnum));
+      break;
+
+    case FLONUM:                                      // FLONUM
+      port_write(port, buffer, format_flonum(obj->data.flonum, buffer));
+      break;
+
+    case BOOLEAN:                                     // BOOLEAN
+      port_puts(port, is_false(obj) ? "False" : "True");
+      break;
+
+    case CHARACTER:                                   // CHARACTER
+      c = obj->data.character;
+      port_write(port, "#\\", 2);
+      switch (c) {
+        case '\n':
+          port_puts(port, "newline");
+          break;
+        case ' ':
+          port_puts(port, "space");
+          break;
+        default:
+          port_write(port, buffer, utf8_encode(c, buffer));
+      }
+      break;
+
+    case STRING:                                      // STRING
+      write_string(port, obj);
+      break;
+
+    case THE_EMPTY_LIST:                              // THE_EMPTY_LIST
+      port_write(port, "()", 2);
+      break;
+
+    case SYMBOL:                                      // SYMBOL
+      port_puts(port, obj->data.symbol);
+      break;
+
+    case PRIMITIVE_PROCEDURE:                         // PRIMITIVE_PROCEDURE
+      port_puts(port, "#<primitive>");
+      break;
+
+    case PORT:                                        // PORT
+      port_puts(port, "#<port>");
+      break;
+
+    case FUTURE:                                      // FUTURE
+      port_puts(port, "#<future>");
+      break;
+
+    case TASK:                                        // TASK
+      port_puts(port, "#<task>");
+      break;
+
+    case CHANNEL:                                     // CHANNEL
+      port_puts(port, "#<channel>");
+      break;
+
+    case RANGE:                                       // RANGE
+      port_write(port, buffer, sprintf(buffer, "#<range %ld %ld",
+                                       obj->data.range.start,
+                                       obj->data.range.stop));
+      if (obj->data.range.step != 1) {
+        port_write(port, buffer, sprintf(buffer, " %ld",
+                                         obj->data.range.step));
+      }
+      port_putc(port, '>');
+      break;
+
+    case VOID:                                        // VOID
+      break;
+
+    default:
+      error("cannot write unknown type\n");
+    }
+}
+
+
+// Numeric vectors hold no objects, so they are written in one go
+void write_numeric_vector(object *port, object *obj, long int max_length) {
+  static char *prefixes[] = {"#f64(", "#s64(", "#u8("};
+  char buffer[32];
+  long int length = obj->data.numeric_vector.length;
+  long int i;
+  
+  port_puts(port, prefixes[(int) obj->data.numeric_vector.kind]);
+  for (i = 0; i < length; i++) {
+    if (i > 0) {
+      port_putc(port, ' ');
+    }
+    if (max_length != 0 && i >= max_length) {
+      port_write(port, "...", 3);
+      break;
+    }
+    switch (obj->data.numeric_vector.kind) {
+      case F64_VECTOR:
+        port_write(port, buffer,
+                   format_flonum(obj->data.numeric_vector.elements.f64[i],
+                                 buffer));
+        break;
+      case S64_VECTOR:
+        port_write(port, buffer,
+                   sprintf(buffer, "%ld",
+                           obj->data.numeric_vector.elements.s64[i]));
+        break;
+      default:
+        port_write(port, buffer,
+                   sprintf(buffer, "%d",
+                           obj->data.numeric_vector.elements.u8[i]));
+    }
+  }
+  port_putc(port, ')');
+}
+
+
+// Advance the innermost frame, closing it when it is finished.  Returns the
+// next object to write, or NULL when the frame was closed.
+object *printer_next(printer *p) {
+  write_frame *frame = &p->stack[p->top - 1];
+  object *obj = frame->obj;
+  object *rest;
+  
+  switch (obj->type) {
+    case PAIR:
+      if (frame->index == 0) {
+        frame->index = 1;
+        return car(obj);
+      }
+      if (frame->index == -1) {
+        break;
+      }
+      rest = cdr(obj);
+      if (is_the_empty_list(rest)) {
+        break;
+      }
+      if (p->max_length != 0 && frame->index >= p->max_length) {
+        port_write(p->port, " ...", 4);
+        break;
+      }
+      // A shared tail has to be written as a dotted pair to carry its label
+      if (is_pair(rest) && !is_labelled(p, rest)) {
+        port_putc(p->port, ' ');
+        frame->obj = rest;
+        frame->index += 1;
+        return car(rest);
+      }
+      port_write(p->port, " . ", 3);
+      frame->index = -1;
+      return rest;
+      
+    case VECTOR:
+      if (frame->index == obj->data.vector.length) {
+        break;
+      }
+      if (p->max_length != 0 && frame->index >= p->max_length) {
+        port_write(p->port, " ...", 4);
+        break;
+      }
+      if (frame->index > 0) {
+        port_putc(p->port, ' ');
+      }
+      frame->index += 1;
+      return obj->data.vector.vec[frame->index - 1];
+    
+    case HASH_TABLE:
+      // Skip to the key of the next full slot
+      while (frame->index % 2 == 0 &&
+             frame->index < 2 * obj->data.hash_table.slots->capacity &&
+             obj->data.hash_table.slots->control[frame->index / 2] < 0) {
+        frame->index += 2;
+      }
+      if (frame->index == 2 * obj->data.hash_table.slots->capacity) {
+        port_putc(p->port, '}');
+        p->top -= 1;
+        return NULL;
+      }
+      if (frame->index % 2 == 0 && p->max_length != 0 &&
+          frame->count >= 2 * p->max_length) {
+        port_write(p->port, " ...}", 5);
+        p->top -= 1;
+        return NULL;
+      }
+      if (frame->count > 0) {
+        port_putc(p->port, ' ');
+      }
+      frame->count += 1;
+      frame->index += 1;
+      return obj->data.hash_table.slots->entries[frame->index - 1];
+    
+    default:                                          // COMPOUND_PROCEDURE
+      frame->index += 1;
+      if (frame->index == 1) {
+        return obj->data.compound_procedure.parameters;
+      }
+      if (frame->index == 2) {
+        port_write(p->port, "  ", 2);
+        return obj->data.compound_procedure.body;
+      }
+      p->top -= 1;
+      return NULL;
+  }
+  
+  port_putc(p->port, ')');
+  p->top -= 1;
+  return NULL;
+}
+
+void print_object(printer *p, object *obj) {
+  long int base = p->top;
+  
+  while (1) {
+    // Write obj, opening a frame when it has elements
+    while (obj != NULL) {
+      if (obj->type == PAIR || obj->type == VECTOR ||
+          obj->type == HASH_TABLE || obj->type == PERSISTENT_VECTOR ||
+          obj->type == PERSISTENT_MAP ||
+          obj->type == COMPOUND_PROCEDURE || obj->type == MACRO) {
+        if (write_label(p, obj)) {
+          obj = NULL;
+          break;
+        }
+        if (p->max_depth != 0 && p->top - base >= p->max_depth) {
+          port_write(p->port, "...", 3);
+          obj = NULL;
+          break;
+        }
+      }
+      
+      switch (obj->type) {
+        case PAIR:
+          port_putc(p->port, '(');
+          printer_push(p, obj);
+          obj = NULL;
+          break;
+        case VECTOR:
+          port_write(p->port, "#(", 2);
+          printer_push(p, obj);
+          obj = NULL;
+          break;
+        case HASH_TABLE:
+          port_write(p->port, "#{", 2);
+          printer_push(p, obj);
+          obj = NULL;
+          break;
+        case PERSISTENT_VECTOR:
+          port_puts(p->port, "#persistent-vector(");
+          printer_push(p, persistent_items(obj));
+          obj = NULL;
+          break;
+        case PERSISTENT_MAP:
+          port_puts(p->port, "#persistent-map(");
+          printer_push(p, persistent_items(obj));
+          obj = NULL;
+          break;
+        case COMPOUND_PROCEDURE:
+          port_puts(p->port, "#<procedure> ");
+          printer_push(p, obj);
+          obj = NULL;
+          break;
+        case MACRO:
+          port_puts(p->port, "#<macro> ");
+          obj = obj->data.macro.transformer;
+          break;
+        case NUMERIC_VECTOR:
+          write_numeric_vector(p->port, obj, p->max_length);
+          obj = NULL;
+          break;
+        default:
+          write_atom(p->port, obj);
+          obj = NULL;
+      }
+    }
+    
+    // Find the next element of the innermost unfinished frame
+    while (obj == NULL) {
+      if (p->top == base) {
+        return;
+      }
+      obj = printer_next(p);
+    }
+  }
+}
+
+
+void write_object(object *port, object *obj) {
+  write_frame stack[WRITE_STACK_SIZE];
+  printer p;
+  
+  printer_init(&p, port, stack);
+  print_object(&p, obj);
+}
+
+// Write strings and characters as their bare characters and anything else
+// as write would
+void display(object *port, object *obj) {
+  char buffer[4];
+  
+  switch (obj->type) {
+    case STRING:
+      port_write(port, obj->data.string.chars, obj->data.string.length);
+      break;
+    case CHARACTER:
+      port_write(port, buffer, utf8_encode(obj->data.character, buffer));
+      break;
+    default:
+      write_object(port, obj);
+  }
+}
+
+// Write obj labelling every pair, vector and procedure that appears in it
+// more than once, so shared and circular structure can be read back
+void write_shared(object *port, object *obj) {
+  write_frame stack[WRITE_STACK_SIZE];
+  pointer_table labels;
+  printer p;
+  
+  printer_init(&p, port, stack);
+  pointer_table_init(&labels, 64);
+  find_shared(&labels, obj);
+  p.labels = &labels;
+  print_object(&p, obj);
+}
+
+// Write obj giving up on anything nested more than max_depth deep or on
+// elements after the first max_length of a list or vector
+void write_limited(object *port, object *obj,
+                   long int max_depth, long int max_length) {
+  write_frame stack[WRITE_STACK_SIZE];
+  printer p;
+  
+  printer_init(&p, port, stack);
+  p.max_depth = max_depth;
+  p.max_length = max_length;
+  print_object(&p, obj);
+}
+
+/** ***************************************************************************
+**                          Binary Serialization
+*******************************************************************************
+** FASL records are a version header followed by one object written depth
+** first as a tag byte and a payload.  Integers and lengths are LEB128
+** varints, flonums are their 8 raw bytes in little-endian order and
+** characters are their codepoint as a varint.
+**
+** Strings, symbols, pairs, vectors, procedures and macros are numbered in the
+** order they are first written and later occurrences are written as a
+** FASL_REF to that number, so shared structure and cycles survive a round
+** trip.  Primitives are written by the name they are bound to in the global
+** environment and the global environment itself is written as a single tag.
+** Numeric vectors are their kind, length and elements, 8 little-endian bytes
+** each for f64 and s64.  Hash tables are their kind, count and every key
+** followed by its value.  Persistent vectors are their length and elements,
+** persistent maps twice their count and every key followed by its value.
+** Ranges are their start, stop and step.
+**/
+
+#define FASL_MAGIC   'L'
+#define FASL_VERSION 3
+
+enum {
+  FASL_FALSE, FASL_TRUE, FASL_VOID, FASL_EMPTY_LIST,
+  FASL_FIXNUM, FASL_FLONUM, FASL_CHARACTER,
+  FASL_STRING, FASL_SYMBOL, FASL_PAIR, FASL_VECTOR,
+  FASL_PRIMITIVE, FASL_COMPOUND, FASL_MACRO,
+  FASL_GLOBAL_ENVIRONMENT, FASL_REF, FASL_NUMERIC_VECTOR, FASL_HASH_TABLE,
+  FASL_PERSISTENT_VECTOR, FASL_PERSISTENT_MAP, FASL_RANGE
+};
+
+
+// Write
+//___________________________________//
+
+void fasl_write_varint(object *port, unsigned long n) {
+  while (n >= 0x80) {
+    port_putc(port, (n & 0x7f) | 0x80);
+    n >>= 7;
+  }
+  port_putc(port, n);
+}
+
+// zigzag encoding keeps small negative numbers small
+void fasl_write_integer(object *port, long n) {
+  fasl_write_varint(port, ((unsigned long) n << 1) ^
+                          (unsigned long) (n >> 63));
+}
+
+// Find the name a primitive is bound to in the global environment
+object *primitive_name(object *obj) {
+  object *env = current_environment(current_interpreter->global_environment);
+  object *vars = frame_variables(env);
+  object *vals = frame_values(env);
+  
+  while (!is_the_empty_list(vars)) {
+    if (car(vals) == obj) {
+      return car(vars);
+    }
+    vars = cdr(vars);
+    vals = cdr(vals);
+  }
+  error("fasl-write: primitive is not bound in the global environment");
+}
+
+void fasl_write_object(object *port, object *obj, pointer_table *seen) {
+  long ref;
+  long i;
+  int byte;
+  uint64_t bits;
+  char *str;
+  hash_slots *slots;
+  
+  while (1) {
+    if (obj == current_interpreter->global_environment) {
+      port_putc(port, FASL_GLOBAL_ENVIRONMENT);
+      return;
+    }
+    
+    switch (obj->type) {
+      case BOOLEAN:
+        port_putc(port, is_false(obj) ? FASL_FALSE : FASL_TRUE);
+        return;
+      case VOID:
+        port_putc(port, FASL_VOID);
+        return;
+      case THE_EMPTY_LIST:
+        port_putc(port, FASL_EMPTY_LIST);
+        return;
+      case FIXNUM:
+        port_putc(port, FASL_FIXNUM);
+        fasl_write_integer(port, obj->data.fixnum);
+        return;
+      case RANGE:
+        port_putc(port, FASL_RANGE);
+        fasl_write_integer(port, obj->data.range.start);
+        fasl_write_integer(port, obj->data.range.stop);
+        fasl_write_integer(port, obj->data.range.step);
+        return;
+      case FLONUM:
+        port_putc(port, FASL_FLONUM);
+        memcpy(&bits, &obj->data.flonum, sizeof(bits));
+        for (i = 0; i < 8; i++) {
+          port_putc(port, (bits >> (8 * i)) & 0xff);
+        }
+        return;
+      case CHARACTER:
+        port_putc(port, FASL_CHARACTER);
+        fasl_write_varint(port, obj->data.character);
+        return;
+      case PORT:
+        error("fasl-write: ports can not be serialized");
+      case FUTURE:
+        error("fasl-write: futures can not be serialized");
+      case TASK:
+        error("fasl-write: tasks can not be serialized");
+      case CHANNEL:
+        error("fasl-write: channels can not be serialized");
+    }
+    
+    // Everything else may be shared
+    ref = pointer_table_add(seen, obj, seen->count);
+    if (ref != -1) {
+      port_putc(port, FASL_REF);
+      fasl_write_varint(port, ref);
+      return;
+    }
+    
+    switch (obj->type) {
+      case STRING:
+        port_putc(port, FASL_STRING);
+        fasl_write_varint(port, obj->data.string.length);
+        port_write(port, obj->data.string.chars, obj->data.string.length);
+        return;
+      case SYMBOL:
+        str = obj->data.symbol;
+        port_putc(port, FASL_SYMBOL);
+        fasl_write_varint(port, strlen(str));
+        port_write(port, str, strlen(str));
+        return;
+      case PAIR:
+        // Recurse on the car and loop on the cdr so long lists are flat
+        port_putc(port, FASL_PAIR);
+        fasl_write_object(port, car(obj), seen);
+        obj = cdr(obj);
+        break;
+      case VECTOR:
+        port_putc(port, FASL_VECTOR);
+        fasl_write_varint(port, obj->data.vector.length);
+        for (i = 0; i < obj->data.vector.length; i++) {
+          fasl_write_object(port, obj->data.vector.vec[i], seen);
+        }
+        return;
+      case NUMERIC_VECTOR:
+        port_putc(port, FASL_NUMERIC_VECTOR);
+        port_putc(port, obj->data.numeric_vector.kind);
+        fasl_write_varint(port, obj->data.numeric_vector.length);
+        if (obj->data.numeric_vector.kind == U8_VECTOR) {
+          port_write(port, (char *) obj->data.numeric_vector.elements.u8,
+                     obj->data.numeric_vector.length);
+          return;
+        }
+        // f64 and s64 elements are both 8 bytes
+        for (i = 0; i < obj->data.numeric_vector.length; i++) {
+          memcpy(&bits, obj->data.numeric_vector.elements.u8 + 8 * i, 8);
+          for (byte = 0; byte < 8; byte++) {
+            port_putc(port, (bits >> (8 * byte)) & 0xff);
+          }
+        }
+        return;
+      case HASH_TABLE:
+        port_putc(port, FASL_HASH_TABLE);
+        slots = obj->data.hash_table.slots;
+        port_putc(port, slots->kind);
+        fasl_write_varint(port, slots->count);
+        for (i = 0; i < slots->capacity; i++) {
+          if (slots->control[i] >= 0) {
+            fasl_write_object(port, slots->entries[2 * i], seen);
+            fasl_write_object(port, slots->entries[2 * i + 1], seen);
+          }
+        }
+        return;
+      case PERSISTENT_VECTOR:
+      case PERSISTENT_MAP:
+        port_putc(port, (obj->type == PERSISTENT_VECTOR) ?
+                        FASL_PERSISTENT_VECTOR : FASL_PERSISTENT_MAP);
+        obj = persistent_items(obj);
+        fasl_write_varint(port, obj->data.vector.length);
+        for (i = 0; i < obj->data.vector.length; i++) {
+          fasl_write_object(port, obj->data.vector.vec[i], seen);
+        }
+        return;
+      case PRIMITIVE_PROCEDURE:
+        port_putc(port, FASL_PRIMITIVE);
+        fasl_write_object(port, primitive_name(obj), seen);
+        return;
+      case COMPOUND_PROCEDURE:
+        port_putc(port, FASL_COMPOUND);
+        fasl_write_object(port, obj->data.compound_procedure.parameters, seen);
+        fasl_write_object(port, obj->data.compound_procedure.body, seen);
+        fasl_write_object(port, obj->data.compound_procedure.env, seen);
+        fasl_write_object(port, obj->data.compound_procedure.docstring, seen);
+        return;
+      case MACRO:
+        port_putc(port, FASL_MACRO);
+        fasl_write_object(port, obj->data.macro.transformer, seen);
+        return;
+      default:
+        error("fasl-write: cannot serialize unknown type");
+    }
+  }
+}
+
+void fasl_write(object *port, object *obj) {
+  pointer_table seen;
+  
+  pointer_table_init(&seen, 64);
+  port_putc(port, FASL_MAGIC);
+  port_putc(port, FASL_VERSION);
+  fasl_write_object(port, obj, &seen);
+}
+
+
+// Read
+//___________________________________//
+
+typedef struct {
+  FILE    *in;
+  object **objects;              // shareable objects in the order written
+  long     count;
+  long     capacity;
+} fasl_reader;
+
+int fasl_read_byte(fasl_reader *reader) {
+  int c = getc(reader->in);
+  
+  if (c == EOF) {
+    error("fasl-read: unexpected end of file");
+  }
+  return c;
+}
+
+unsigned long fasl_read_varint(fasl_reader *reader) {
+  unsigned long n = 0;
+  int shift = 0;
+  int c;
+  
+  do {
+    c = fasl_read_byte(reader);
+    n |= (unsigned long) (c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return n;
+}
+
+long fasl_read_integer(fasl_reader *reader) {
+  unsigned long n = fasl_read_varint(reader);
+  
+  return (long) (n >> 1) ^ -(long) (n & 1);
+}
+
+void fasl_register(fasl_reader *reader, object *obj) {
+  if (reader->count == reader->capacity) {
+    reader->capacity *= 2;
+    reader->objects = GC_REALLOC(reader->objects, 
+                                 reader->capacity * sizeof(object *));
+    if (reader->objects == NULL) {
+      error("out of memory\n");
+    }
+  }
+  reader->objects[reader->count] = obj;
+  reader->count += 1;
+}
+
+char *fasl_read_chars(fasl_reader *reader) {
+  unsigned long len = fasl_read_varint(reader);
+  char *str = GC_MALLOC_ATOMIC(len + 1);
+  
+  if (str == NULL) {
+    error("out of memory\n");
+  }
+  if (fread(str, 1, len, reader->in) != len) {
+    error("fasl-read: unexpected end of file");
+  }
+  str[len] = '\0';
+  return str;
+}
+
+object *fasl_read_string(fasl_reader *reader) {
+  unsigned long len = fasl_read_varint(reader);
+  object *obj = make_empty_string(len);
+  
+  if (fread(obj->data.string.chars, 1, len, reader->in) != len) {
+    error("fasl-read: unexpected end of file");
+  }
+  return validate_string(obj);
+}
+
+object *fasl_read_object(fasl_reader *reader) {
+  object *head = NULL;           // first pair of a list being read
+  object *tail = NULL;           // last pair, whose cdr is read next
+  object *obj;
+  unsigned long n;
+  uint64_t bits;
+  double d;
+  long i;
+  int shift;
+  int kind;
+  object *key;
+  object *collection;
+  
+  while (1) {
+    switch (fasl_read_byte(reader)) {
+      case FASL_FALSE:
+        obj = False;
+        break;
+      case FASL_TRUE:
+        obj = True;
+        break;
+      case FASL_VOID:
+        obj = Void;
+        break;
+      case FASL_EMPTY_LIST:
+        obj = the_empty_list;
+        break;
+      case FASL_GLOBAL_ENVIRONMENT:
+        obj = current_interpreter->global_environment;
+        break;
+      case FASL_FIXNUM:
+        obj = make_fixnum(fasl_read_integer(reader));
+        break;
+      case FASL_RANGE:
+        obj = make_range(fasl_read_integer(reader), 0, 0);
+        obj->data.range.stop = fasl_read_integer(reader);
+        obj->data.range.step = fasl_read_integer(reader);
+        break;
+      case FASL_FLONUM:
+        bits = 0;
+        for (i = 0; i < 8; i++) {
+          bits |= (uint64_t) fasl_read_byte(reader) << (8 * i);
+        }
+        memcpy(&d, &bits, sizeof(d));
+        obj = make_flonum(d);
+        break;
+      case FASL_CHARACTER:
+        obj = make_character(fasl_read_varint(reader));
+        break;
+      case FASL_STRING:
+        obj = fasl_read_string(reader);
+        fasl_register(reader, obj);
+        break;
+      case FASL_SYMBOL:
+        obj = make_symbol(fasl_read_chars(reader));
+        fasl_register(reader, obj);
+        break;
+      case FASL_REF:
+        n = fasl_read_varint(reader);
+        if (n >= reader->count) {
+          error("fasl-read: bad reference");
+        }
+        obj = reader->objects[n];
+        break;
+      case FASL_PAIR:
+        // Register the pair before its car so cycles resolve to it
+        obj = cons(the_empty_list, the_empty_list);
+        fasl_register(reader, obj);
+        if (tail == NULL) {
+          head = obj;
+        }
+        else {
+          set_cdr(tail, obj);
+        }
+        tail = obj;
+        set_car(obj, fasl_read_object(reader));
+        continue;
+      case FASL_VECTOR:
+        n = fasl_read_varint(reader);
+        obj = make_vector(n, the_empty_list);
+        fasl_register(reader, obj);
+        for (i = 0; i < n; i++) {
+          obj->data.vector.vec[i] = fasl_read_object(reader);
+        }
+        break;
+      case FASL_NUMERIC_VECTOR:
+        kind = fasl_read_byte(reader);
+        if (kind != F64_VECTOR && kind != S64_VECTOR && kind != U8_VECTOR) {
+          error("fasl-read: unknown numeric vector kind");
+        }
+        n = fasl_read_varint(reader);
+        obj = make_numeric_vector(kind, n);
+        fasl_register(reader, obj);
+        if (kind == U8_VECTOR) {
+          if (fread(obj->data.numeric_vector.elements.u8, 1, n,
+                    reader->in) != n) {
+            error("fasl-read: unexpected end of file");
+          }
+          break;
+        }
+        for (i = 0; i < n; i++) {
+          bits = 0;
+          for (shift = 0; shift < 8; shift++) {
+            bits |= (uint64_t) fasl_read_byte(reader) << (8 * shift);
+          }
+          memcpy(obj->data.numeric_vector.elements.u8 + 8 * i, &bits, 8);
+        }
+        break;
+      case FASL_HASH_TABLE:
+        kind = fasl_read_byte(reader);
+        if (kind != IS_TABLE && kind != EQUAL_TABLE) {
+          error("fasl-read: unknown hash table kind");
+        }
+        n = fasl_read_varint(reader);
+        obj = make_hash_table(kind);
+        fasl_register(reader, obj);
+        for (i = 0; i < n; i++) {
+          key = fasl_read_object(reader);
+          hash_table_set(obj, key, fasl_read_object(reader));
+        }
+        break;
+      case FASL_PERSISTENT_VECTOR:
+        // Registered before its elements are read, which may refer to it
+        obj = make_persistent_vector(pv_tree_make(NULL), 0, 0);
+        fasl_register(reader, obj);
+        n = fasl_read_varint(reader);
+        collection = make_transient(obj);
+        for (i = 0; i < n; i++) {
+          persistent_vector_push(collection, fasl_read_object(reader));
+        }
+        collection->data.persistent_vector.tree->edit = NULL;
+        obj->data.persistent_vector = collection->data.persistent_vector;
+        break;
+      case FASL_PERSISTENT_MAP:
+        obj = make_empty_persistent_map();
+        fasl_register(reader, obj);
+        n = fasl_read_varint(reader);
+        collection = make_transient(obj);
+        for (i = 0; i < n; i += 2) {
+          key = fasl_read_object(reader);
+          persistent_map_set(collection, key, fasl_read_object(reader));
+        }
+        collection->data.persistent_map.edit = NULL;
+        obj->data.persistent_map = collection->data.persistent_map;
+        break;
+      case FASL_PRIMITIVE:
+        // The writer numbered the primitive before its name
+        n = reader->count;
+        fasl_register(reader, Void);
+        obj = lookup_variable_value(fasl_read_object(reader),
+                                    current_interpreter->global_environment);
+        reader->objects[n] = obj;
+        break;
+      case FASL_COMPOUND:
+        obj = make_compound_procedure(the_empty_list, the_empty_list,
+                                      the_empty_list, the_empty_list);
+        fasl_register(reader, obj);
+        obj->data.compound_procedure.parameters = fasl_read_object(reader);
+        obj->data.compound_procedure.body = fasl_read_object(reader);
+        obj->data.compound_procedure.env = fasl_read_object(reader);
+        obj->data.compound_procedure.docstring = fasl_read_object(reader);
+        break;
+      case FASL_MACRO:
+        obj = make_macro(the_empty_list);
+        fasl_register(reader, obj);
+        obj->data.macro.transformer = fasl_read_object(reader);
+        break;
+      default:
+        error("fasl-read: unknown tag");
+    }
+    
+    if (tail == NULL) {
+      return obj;
+    }
+    set_cdr(tail, obj);
+    return head;
+  }
+}
+
+object *fasl_read(FILE *in) {
+  fasl_reader reader;
+  int c;
+  
+  c = getc(in);
+  if (c == EOF) {
+    error("fasl-read: end of file");
+  }
+  if (c != FASL_MAGIC || getc(in) != FASL_VERSION) {
+    error("fasl-read: not a FASL record");
+  }
+  
+  reader.in = in;
+  reader.count = 0;
+  reader.capacity = 64;
+  reader.objects = GC_MALLOC(reader.capacity * sizeof(object *));
+  if (reader.objects == NULL) {
+    error("out of memory\n");
+  }
+  return fasl_read_object(&reader);
+}
+
+
+// Compiled File Cache
+//___________________________________//
+// load keeps the expressions read from foo.lispy in foo.lispyc, next to the
+// source.  The cache starts with a hash and the length of the source it was
+// built from and is rebuilt whenever they no longer match; the rest is a FASL
+// record of the list of expressions.  CACHE_VERSION changes whenever the
+// reader would build different objects from the same source.
+
+#define CACHE_MAGIC   "LSPC"
+#define CACHE_VERSION 5
+
+void write_cache_header(object *port, uint64_t hash, long length) {
+  int i;
+  
+  port_puts(port, CACHE_MAGIC);
+  port_putc(port, CACHE_VERSION);
+  for (i = 0; i < 8; i++) {
+    port_putc(port, (hash >> (8 * i)) & 0xff);
+  }
+  for (i = 0; i < 8; i++) {
+    port_putc(port, ((uint64_t) length >> (8 * i)) & 0xff);
+  }
+}
+
+char read_cache_header(FILE *in, uint64_t hash, long length) {
+  unsigned char header[21];
+  uint64_t cached_hash = 0;
+  uint64_t cached_length = 0;
+  int i;
+  
+  if (fread(header, 1, sizeof(header), in) != sizeof(header) ||
+      memcmp(header, CACHE_MAGIC, 4) != 0 || header[4] != CACHE_VERSION) {
+    return 0;
+  }
+  for (i = 0; i < 8; i++) {
+    cached_hash |= (uint64_t) header[5 + i] << (8 * i);
+    cached_length |= (uint64_t) header[13 + i] << (8 * i);
+  }
+  return cached_hash == hash && cached_length == (uint64_t) length;
+}
+
+object *read_file_cached(char *filename) {
+  char *buffer;
+  long length;
+  uint64_t hash;
+  char *cache_name;
+  char *temp_name;
+  FILE *cache;
+  object *port;
+  object *exps;
+  int fd;
+  jmp_buf recover;
+  jmp_buf *outer = recover_point;
+  
+  buffer = read_file_contents(filename, &length);
+  hash = hash_bytes(buffer, length);
+  
+  cache_name = GC_MALLOC_ATOMIC(strlen(filename) + 2);
+  temp_name = GC_MALLOC_ATOMIC(strlen(filename) + 9);
+  if (cache_name == NULL || temp_name == NULL) {
+    error("out of memory\n");
+  }
+  sprintf(cache_name, "%sc", filename);
+  sprintf(temp_name, "%scXXXXXX", filename);
+  
+  cache = fopen(cache_name, "rb");
+  if (cache != NULL && read_cache_header(cache, hash, length)) {
+    recover_point = &recover;
+    if (setjmp(recover) == 0) {
+      exps = fasl_read(cache);
+      recover_point = outer;
+      fclose(cache);
+      return exps;
+    }
+    // A truncated or damaged cache is thrown away and built again
+    recover_point = outer;
+    unlink(cache_name);
+  }
+  if (cache != NULL) {
+    fclose(cache);
+  }
+  
+  exps = read_buffer(buffer, length);
+  
+  // Write the new cache to a temporary file and rename it into place so
+  // concurrent loads never see a partial cache.  Failing to write the cache
+  // (a read-only directory, say) is not an error.
+  fd = mkstemp(temp_name);
+  if (fd != -1) {
+    fchmod(fd, 0644);
+    cache = fdopen(fd, "wb");
+    port = make_port(cache, OUTPUT_PORT);
+    write_cache_header(port, hash, length);
+    fasl_write(port, exps);
+    port_drain(port);
+    if (fclose(cache) == 0) {
+      rename(temp_name, cache_name);
+    }
+    else {
+      remove(temp_name);
+    }
+  }
+  return exps;
+}
+
+
+
+/** ***************************************************************************
+**                           Primitive Procedures
+*******************************************************************************
+** Primitive procedures are prefixed with p_
+** Helper procedures are prefixed with h_ and are for internal use.
+** Predicates (like equal? or number?) end with a p (p_equalp, p_numberp)
+**/
+
+//  Language Procedures
+//_____________________________________________//
+object *make_initial_environment(void);
+
+object *p_apply(object *arguments) {
+  error("apply procedure should never be called");
+}
+
+object *p_eval(object *arguments) {
+  error("eval procedure should never be called");
+}
+
+object *p_global_environment(object *arguments) {
+  return current_interpreter->global_environment;
+}
+
+object *p_initial_environment(object *arguments) {
+  return make_initial_environment();
+}
+
+object *p_empty_environment(object *arguments) {
+  return the_empty_list;
+}
+
+//  I/O
+//___________________________________//
+
+//  display
+
+object *p_display(object *arguments) {
+  while (!is_the_empty_list(arguments)) {
+    display(current_interpreter->output_port, car(arguments));
+    arguments = cdr(arguments);
+  }
+  return Void;
+}
+
+
+//  print
+//  Same as display except it prints a newline after displaying all arguments
+
+object *p_print(object *arguments) {
+  p_display(arguments);
+  port_putc(current_interpreter->output_port, '\n');
+  return Void;
+}
+
+
+//  load
+
+object *p_load(object *arguments) {
+  object *exp;
+  object *result = Void;
+  
+  exp = read_file_cached(string_to_c(car(arguments)));
+  while (exp != the_empty_list) {
+    result = eval(car(exp), current_interpreter->global_environment);
+    exp = cdr(exp);
+  }
+  return result;
+}
+
+
+//  read-all
+//  Read every expression in a file into a list without evaluating them
+
+object *p_read_all(object *arguments) {
+  return read_file(string_to_c(car(arguments)));
+}
+
+
+//  Ports
+
+FILE *h_input_port(object *port) {
+  if (!is_port(port)) {
+    error("Expected a port");
+  }
+  if (port->data.port.kind == CLOSED_PORT) {
+    error("Port is closed");
+  }
+  if (port->data.port.kind != INPUT_PORT) {
+    error("Expected an input port");
+  }
+  return port->data.port.stream;
+}
+
+object *h_output_port(object *port) {
+  if (!is_port(port)) {
+    error("Expected a port");
+  }
+  if (port->data.port.kind == CLOSED_PORT) {
+    error("Port is closed");
+  }
+  if (port->data.port.kind == INPUT_PORT) {
+    error("Expected an output port");
+  }
+  return port;
+}
+
+object *p_open_input_file(object *arguments) {
+  FILE *stream = fopen(string_to_c(car(arguments)), "rb");
+  
+  if (stream == NULL) {
+    error("could not open file \"%s\"", string_to_c(car(arguments)));
+  }
+  return make_port(stream, INPUT_PORT);
+}
+
+object *p_open_output_file(object *arguments) {
+  object *port;
+  FILE *stream = fopen(string_to_c(car(arguments)), "wb");
+  
+  if (stream == NULL) {
+    error("could not open file \"%s\"", string_to_c(car(arguments)));
+  }
+  port = make_port(stream, OUTPUT_PORT);
+  port_opened(port);
+  return port;
+}
+
+object *p_open_output_string(object *arguments) {
+  return make_port(NULL, STRING_PORT);
+}
+
+object *p_get_output_string(object *arguments) {
+  object *port = car(arguments);
+  
+  if (!is_port(port) || port->data.port.kind != STRING_PORT) {
+    error("Expected a string port");
+  }
+  return port_to_string(port);
+}
+
+object *p_close_port(object *arguments) {
+  object *port = car(arguments);
+  
+  if (!is_port(port)) {
+    error("Expected a port");
+  }
+  if (port->data.port.stream != NULL) {
+    if (port->data.port.kind == OUTPUT_PORT) {
+      port_closed(port);
+    }
+    port_drain(port);
+    fclose(port->data.port.stream);
+    port->data.port.stream = NULL;
+  }
+  port->data.port.kind = CLOSED_PORT;
+  return Void;
+}
+
+
+//  flush
+//  Hand buffered output to the operating system, stdout when no port is given
+
+object *p_flush(object *arguments) {
+  if (arguments == the_empty_list) {
+    port_flush(current_interpreter->output_port);
+  }
+  else {
+    port_flush(h_output_port(car(arguments)));
+  }
+  return Void;
+}
+
+
+//  write
+//  Write an object in a form read can parse, to the current output or the
+//  given port
+
+object *p_write(object *arguments) {
+  object *port = current_interpreter->output_port;
+  
+  if (cdr(arguments) != the_empty_list) {
+    port = h_output_port(cadr(arguments));
+  }
+  write_object(port, car(arguments));
+  return Void;
+}
+
+
+//  write-shared
+//  Like write but labels shared and circular structure as #0= ... #0#
+
+object *p_write_shared(object *arguments) {
+  object *port = current_interpreter->output_port;
+  
+  if (cdr(arguments) != the_empty_list) {
+    port = h_output_port(cadr(arguments));
+  }
+  write_shared(port, car(arguments));
+  return Void;
+}
+
+
+//  write-to-string / with-output-to-string
+
+object *p_write_to_string(object *arguments) {
+  object *port = make_port(NULL, STRING_PORT);
+  
+  write_object(port, car(arguments));
+  return port_to_string(port);
+}
+
+object *p_with_output_to_string(object *arguments) {
+  object *saved = current_interpreter->output_port;
+  object *port = make_port(NULL, STRING_PORT);
+  jmp_buf recover;
+  jmp_buf *outer = recover_point;
+  
+  current_interpreter->output_port = port;
+  // An error in thunk must not leave output going to the string
+  recover_point = &recover;
+  if (setjmp(recover) != 0) {
+    recover_point = outer;
+    current_interpreter->output_port = saved;
+    error("%s", string_to_c(make_string(error_message)));
+  }
+  apply_procedure(car(arguments), the_empty_list);
+  recover_point = outer;
+  current_interpreter->output_port = saved;
+  return port_to_string(port);
+}
+
+
+//  fasl-write / fasl-read
+
+object *p_fasl_write(object *arguments) {
+  fasl_write(h_output_port(cadr(arguments)), car(arguments));
+  return Void;
+}
+
+object *p_fasl_read(object *arguments) {
+  return fasl_read(h_input_port(car(arguments)));
+}
+
+
+//  List Procedures
+//___________________________________//
+
+//  null?
+
+object *p_nullp(object *arguments) {
+  if (is_the_empty_list(car(arguments))) {
+    return True;}
+  else {return False;}
+}
+
+
+//  cons
+
+object *p_cons(object *arguments) {
+  return cons(car(arguments), cadr(arguments));
+}
+
+
+//  Equality Procedures
+//___________________________________//
+
+//  is?
+
+object *h_isp(object *obj_1, object *obj_2) {
+  if (obj_1->type != obj_2->type) {
+    return False;
+  }
+  
+  switch (obj_1->type) {
+    
+    case VOID:
+    case THE_EMPTY_LIST:
+      return True;
+      break;
+    
+    case FIXNUM:
+      return (obj_1->data.fixnum == 
+              obj_2->data.fixnum) ? 
+              True : False;
+      break;
+    
+    case FLONUM:
+      return (obj_1->data.flonum ==
+              obj_2->data.flonum) ?
+              True : False;
+      break;
+      
+    case CHARACTER:
+      return (obj_1->data.character ==
+              obj_2->data.character) ?
+              True : False;
+      break;
+    
+    case SYMBOL:
+      return (obj_1->data.symbol ==
+              obj_2->data.symbol) ?
+              True : False;
+      break;
+    
+    case PRIMITIVE_PROCEDURE:
+    case COMPOUND_PROCEDURE:
+    case MACRO:
+    case BOOLEAN: 
+    case STRING:
+    case PAIR:
+    case VECTOR:
+    case NUMERIC_VECTOR:
+    case PERSISTENT_VECTOR:
+    case RANGE:
+    case HASH_TABLE:
+    case PERSISTENT_MAP:
+    case PORT:
+    case FUTURE:
+    case TASK:
+    case CHANNEL:
+      return (obj_1 == obj_2) ? True : False;
+      break;
+  }
+}
+
+object *p_isp(object *arguments) {
+  return h_isp(car(arguments), cadr(arguments));
+}
+
+
+//  equal?
+
+object *h_equalp(object *obj_1, object *obj_2) {
+  int count = 0;
+  object *result;
+  object *temp_1;
+  object *temp_2;
+  
+  if (obj_1->type != obj_2->type) {
+    return False;
+  }
+
+  switch (obj_1->type) {
+    case VOID:
+    case THE_EMPTY_LIST:
+      return True;
+      break;
+    
+    case FIXNUM:
+      return (obj_1->data.fixnum == 
+              obj_2->data.fixnum) ? 
+              True : False;
+      break;
+    
+    case FLONUM:
+      return (obj_1->data.flonum ==
+              obj_2->data.flonum) ?
+              True : False;
+      break;
+      
+    case CHARACTER:
+      return (obj_1->data.character ==
+              obj_2->data.character) ?
+              True : False;
+      break;
+    
+    case SYMBOL:
+      return (obj_1->data.symbol ==
+              obj_2->data.symbol) ?
+              True : False;
+      break;
+    
+    case PRIMITIVE_PROCEDURE:
+    case COMPOUND_PROCEDURE:
+    case BOOLEAN:
+    case HASH_TABLE:
+    case PORT:
+    case FUTURE:
+    case TASK:
+    case CHANNEL:
+      return (obj_1 == obj_2) ? True : False;
+    
+    case STRING:
+      return string_compare(obj_1, obj_2) == 0 ? True : False;
+      break;
+    
+    case PAIR:
+      if (h_length(obj_1)->data.fixnum != 
+          h_length(obj_2)->data.fixnum) {
+        return False;}
+      while (obj_1 != the_empty_list) {
+        if (h_equalp(car(obj_1), car(obj_2)) == True) {
+          obj_1 = cdr(obj_1);
+          obj_2 = cdr(obj_2);
+        }
+        else {
+          return False;
+        }
+      }
+      return True;
+
+    case VECTOR:
+      if (obj_1->data.vector.length != obj_2->data.vector.length) {
+        return False;
+      }
+      while (count < obj_1->data.vector.length) {
+        if (h_equalp(obj_1->data.vector.vec[count],
+                     obj_2->data.vector.vec[count]) == False) {
+          return False;
+        }
+        count += 1;
+      }
+      return True;
+    
+    case NUMERIC_VECTOR:
+      return numeric_vector_equal(obj_1, obj_2) ? True : False;
+      
+    case RANGE:
+      return range_equal(obj_1, obj_2) ? True : False;
+      
+    case PERSISTENT_VECTOR:
+      if (obj_1->data.persistent_vector.length !=
+          obj_2->data.persistent_vector.length) {
+        return False;
+      }
+      while (count < obj_1->data.persistent_vector.length) {
+        if (h_equalp(persistent_vector_ref(obj_1, count),
+                     persistent_vector_ref(obj_2, count)) == False) {
+          return False;
+        }
+        count += 1;
+      }
+      return True;
+      
+    case PERSISTENT_MAP:
+      if (obj_1->data.persistent_map.count !=
+          obj_2->data.persistent_map.count) {
+        return False;
+      }
+      for (temp_1 = persistent_map_entries(obj_1); temp_1 != the_empty_list;
+           temp_1 = cdr(temp_1)) {
+        temp_2 = persistent_map_get(obj_2, car(car(temp_1)));
+        if (temp_2 == NULL || h_equalp(cdr(car(temp_1)), temp_2) == False) {
+          return False;
+        }
+      }
+      return True;
+      
+    default:
+      error("Unsupported types for equal?");
+  }
+}
+
+object *p_equalp(object *arguments) {
+  h_equalp(car(arguments), cadr(arguments));
+}
+
+
+//  not
+
+object *p_not(object *exp) {
+  return (car(exp) == False) ? True : False;
+}
+
+
+//  Numeric Procedures
+//___________________________________//
+
+//  +
+
+object *h_numeric_add(object *obj_1, object *obj_2) {
+  switch (obj_1->type) {
+    case FLONUM:
+      switch (obj_2->type) {
+        case FLONUM:
+          return make_flonum(obj_1->data.flonum + obj_2->data.flonum);
+        case FIXNUM:
+          return make_flonum(obj_1->data.flonum + obj_2->data.fixnum);
+      }
+    case FIXNUM:
+      switch (obj_2->type) {
+        case FLONUM:
+          return make_flonum(obj_1->data.fixnum + obj_2->data.flonum);
+        case FIXNUM:
+          return make_fixnum(obj_1->data.fixnum + obj_2->data.fixnum);
+      }
+  }
+}
+  
+object *h_add(object *obj_1, object *obj_2) {
+  char cbuffer[8];
+  int size;
+  
+  if ((obj_1->type == FIXNUM || obj_1->type == FLONUM) &&
+      (obj_2->type == FIXNUM || obj_2->type == FLONUM)) {
+    return h_numeric_add(obj_1, obj_2);
+  }
+  
+  if (obj_1->type != obj_2->type) {
+    error("Types must match");
+  }
+  
+  if (obj_1->type == STRING) {
+    return h_string_append(cons(obj_1, cons(obj_2, the_empty_list)));
+  }
+  
+  if (obj_1->type == VECTOR) {
+    error("Addition on vectors not implemented yet");
+  }
+  
+  switch (obj_1->type) {
+    case CHARACTER:
+      size = utf8_encode(obj_1->data.character, cbuffer);
+      size += utf8_encode(obj_2->data.character, cbuffer + size);
+      return make_string_length(cbuffer, size);
+  }
+}
+
+// Concatenate a list of strings into a single new string
+object *h_string_append(object *strings) {
+  object *lst;
+  object *result;
+  long int length = 0;
+  char *chars;
+  
+  for (lst = strings; lst != the_empty_list; lst = cdr(lst)) {
+    if (!is_string(car(lst))) {
+      error("Types must match");
+    }
+    length += car(lst)->data.string.length;
+  }
+  result = make_empty_string(length);
+  chars = result->data.string.chars;
+  for (lst = strings; lst != the_empty_list; lst = cdr(lst)) {
+    memcpy(chars, car(lst)->data.string.chars, car(lst)->data.string.length);
+    chars += car(lst)->data.string.length;
+  }
+  return result;
+}
+
+object *p_add(object *arguments) {
+  object *result;
+  
+  // Size the result once instead of copying it for every argument
+  if (is_string(car(arguments))) {
+    return h_string_append(arguments);
+  }
+  
+  result = h_add(car(arguments), cadr(arguments));
+  arguments = cddr(arguments);
+  while (arguments != the_empty_list) {
+    result = h_add(result, car(arguments));
+    arguments = cdr(arguments);
+  }
+  return result;
+}
+
+
+//  -
+
+object *h_sub(object *obj_1, object *obj_2) {
+  switch (obj_1->type) {
+    case FLONUM:
+      switch (obj_2->type) {
+        case FLONUM:
+          return make_flonum(obj_1->data.flonum - obj_2->data.flonum);
+        case FIXNUM:
+          return make_flonum(obj_1->data.flonum - obj_2->data.fixnum);
+      }
+    case FIXNUM:
+      switch (obj_2->type) {
+        case FLONUM:
+          return make_flonum(obj_1->data.fixnum - obj_2->data.flonum);
+        case FIXNUM:
+          return make_fixnum(obj_1->data.fixnum - obj_2->data.fixnum);
+      }
+  }
+}
+
+object *p_sub(object *arguments) {
+  object *result = h_sub(car(arguments), cadr(arguments));
+  arguments = cddr(arguments);
+  while (arguments != the_empty_list) {
+    result = h_sub(result, car(arguments));
+    arguments = cdr(arguments);
+  }
+  return result;
+}
+
+
+//  *
+
+object *h_mul(object *obj_1, object *obj_2) {
+  switch (obj_1->type) {
+    case FLONUM:
+      switch (obj_2->type) {
+        case FLONUM:
+          return make_flonum(obj_1->data.flonum * obj_2->data.flonum);
+        case FIXNUM:
+          return make_flonum(obj_1->data.flonum * obj_2->data.fixnum);
+      }
+    case FIXNUM:
+      switch (obj_2->type) {
+        case FLONUM:
+          return make_flonum(obj_1->data.fixnum * obj_2->data.flonum);
+        case FIXNUM:
+          return make_fixnum(obj_1->data.fixnum * obj_2->data.fixnum);
+      }
+  }
+}
+
+object *p_mul(object *arguments) {
+  object *result = h_mul(car(arguments), cadr(arguments));
+  arguments = cddr(arguments);
+  while (arguments != the_empty_list) {
+    result = h_mul(result, car(arguments));
+    arguments = cdr(arguments);
+  }
+  return result;
+}
+
+
+//  /
+
+
+object *h_div(object *obj_1, object *obj_2) {
+  switch (obj_1->type) {
+    case FLONUM:
+      switch (obj_2->type) {
+        case FLONUM:
+          return make_flonum(obj_1->data.flonum / obj_2->data.flonum);
+        case FIXNUM:
+          return make_flonum(obj_1->data.flonum / obj_2->data.fixnum);
+      }
+    case FIXNUM:
+      switch (obj_2->type) {
+        case FLONUM:
+          return make_flonum(obj_1->data.fixnum / obj_2->data.flonum);
+        case FIXNUM:
+          return (obj_1->data.fixnum % obj_2->data.fixnum) ?
+            make_flonum(obj_1->data.fixnum / (double) obj_2->data.fixnum) :
+            make_fixnum(obj_1->data.fixnum / obj_2->data.fixnum);
+      }
+  }
+}
+
+object *p_div(object *arguments) {
+  object *result = h_div(car(arguments), cadr(arguments));
+  arguments = cddr(arguments);
+  while (arguments != the_empty_list) {
+    result = h_div(result, car(arguments));
+    arguments = cdr(arguments);
+  }
+  return result;
+}
+
+
+//  >
+
+object *h_greater_than(object *obj_1, object *obj_2) {
+  if (obj_1->type != obj_2->type) {
+    error("Types must match");
+  }
+
+  if (obj_1->type == BOOLEAN) {
+    if (obj_1 == obj_2) {return False;}
+    else if (obj_1 == True) {return True;}
+    else if (obj_1 == False) {return False;}
+  }
+
+  else if (obj_1->type == FIXNUM) {
+    return (obj_1->data.fixnum > obj_2->data.fixnum) ?
+            True : False;
+  }
+
+  else if (obj_1->type == FLONUM) {
+    return (obj_1->data.flonum > obj_2->data.flonum) ?
+            True : False;
+  }
+
+  else if (obj_1->type == CHARACTER) {
+    return (obj_1->data.character > obj_2->data.character) ?
+            True : False;
+  }
+  
+  else if (obj_1->type == SYMBOL) {
+    return (strcmp(obj_1->data.symbol, 
+                   obj_2->data.symbol) == 1) ?
+            True : False;
+  }
+
+  else if (obj_1->type == STRING) {
+    return (string_compare(obj_1, obj_2) > 0) ? True : False;
+  }
+
+  else if (obj_1->type == PAIR) {
+    if (h_length(obj_1)->data.fixnum == h_length(obj_2)->data.fixnum) {
+      while (obj_1 != the_empty_list) {
+        if (h_equalp(car(obj_1), car(obj_2)) == True) {
+          obj_1 = cdr(obj_1);
+          obj_2 = cdr(obj_2);
+        }
+        else if (h_greater_than(car(obj_1), car(obj_2)) == True) {
+          return True;
+        }
+        else {
+          return False;
+        }
+      }
+      return False;
+    }
+    
+    else if (h_length(obj_1)->data.fixnum > h_length(obj_2)->data.fixnum) {
+      return True;
+    }
+    else {
+      return False;
+    }
+  }
+
+  else if (obj_1->type == VECTOR) {
+    error("> on vectors not implemented yet");
+  }
+
+}
+
+object *p_greater_than(object *arguments) {
+  return h_greater_than(car(arguments), cadr(arguments));
+}
+
+
+//  <
+
+object *h_less_than(object *obj_1, object *obj_2) {
+  if (obj_1->type != obj_2->type) {
+    error("Types must match");
+  }
+
+  if (obj_1->type == BOOLEAN) {
+    if (obj_1 == obj_2) {return True;}
+    else if (obj_1 == True) {return False;}
+    else if (obj_1 == False) {return True;}
+  }
+
+  else if (obj_1->type == FIXNUM) {
+    return (obj_1->data.fixnum < obj_2->data.fixnum) ?
+            True : False;
+  }
+
+  else if (obj_1->type == FLONUM) {
+    return (obj_1->data.flonum < obj_2->data.flonum) ?
+            True : False;
+  }
+
+  else if (obj_1->type == CHARACTER) {
+    return (obj_1->data.character < obj_2->data.character) ?
+            True : False;
+  }
+
+  else if (obj_1->type == SYMBOL) {
+    return (strcmp(obj_1->data.symbol, 
+                   obj_2->data.symbol) == -1) ?
+            True : False;
+  }
+  
+  else if (obj_1->type == STRING) {
+    return (string_compare(obj_1, obj_2) < 0) ? True : False;
+  }
+  
+  else if (obj_1->type == PAIR) {
+    if (h_length(obj_1)->data.fixnum == h_length(obj_2)->data.fixnum) {
+      while (obj_1 != the_empty_list) {
+        if (h_equalp(car(obj_1), car(obj_2)) == True) {
+          obj_1 = cdr(obj_1);
+          obj_2 = cdr(obj_2);
+        }
+        else if (h_less_than(car(obj_1), car(obj_2)) == True) {
+          return True;
+        }
+        else {
+          return False;
+        }
+      }
+      return False;
+    }
+    
+    else if (h_length(obj_1)->data.fixnum < h_length(obj_2)->data.fixnum) {
+      return True;
+    }
+    else {
+      return False;
+    }
+  }
+
+  else if (obj_1->type == VECTOR) {
+    error("< on vectors not implemented yet");
+  }
+
+}
+
+object *p_less_than(object *arguments) {
+  return h_less_than(car(arguments), cadr(arguments));
+}
+
+
+//  >=
+
+object *h_greater_than_or_eq(object *obj_1, object *obj_2) {
+  if (h_equalp(obj_1, obj_2) == True) {
+    return True;
+  }
+  else {
+    return h_greater_than(obj_1, obj_2);
+  }
+}
+
+object *p_greater_than_or_eq(object *arguments) {
+  return h_greater_than_or_eq(car(arguments), cadr(arguments));
+}
+
+
+//  <=
+
+object *h_less_than_or_eq(object *obj_1, object *obj_2) {
+  if (h_equalp(obj_1, obj_2) == True) {
+    return True;
+  }
+  else {
+    return h_less_than(obj_1, obj_2);
+  }
+}
+
+object *p_less_than_or_eq(object *arguments) {
+  return h_less_than_or_eq(car(arguments), cadr(arguments));
+}
+
+
+//  **
+
+object *p_pow(object *args) {
+  object *o = car(args);
+  object *p = cadr(args);
+  switch (o->type) {
+    case FIXNUM:
+      switch (p->type) {
+        case FIXNUM:
+          return make_fixnum(pow(o->data.fixnum, p->data.fixnum));
+        case FLONUM:
+          return make_flonum(pow(o->data.fixnum, p->data.flonum));
+      }
+    case FLONUM:
+      switch (p->type) {
+        case FIXNUM:
+          return make_flonum(pow(o->data.flonum, p->data.fixnum));
+        case FLONUM:
+          return make_flonum(pow(o->data.flonum, p->data.flonum));
+      }
+  }
+}
+
+
+//  abs
+
+object *p_abs(object *args) {
+  object *o = car(args);
+  switch (o->type) {
+    case FIXNUM:
+      return make_fixnum(labs(o->data.fixnum));
+    case FLONUM:
+      return make_flonum(fabs(o->data.flonum));
+  }
+}
+
+
+//  sqrt
+
+object *p_sqrt(object *args) {
+  object *o = car(args);
+  switch (o->type) {
+    case FIXNUM:
+      return make_flonum(sqrt(o->data.fixnum));
+    case FLONUM:
+      return make_flonum(sqrt(o->data.flonum));
+  }
+}
+
+
+//  Type Procedures
+//___________________________________//
+
+//  type
+
+object *h_type(object *obj) {
+  
+  switch (obj->type) {
+    case THE_EMPTY_LIST:
+      return cons(make_string("'()"), the_empty_list);
+    
+    case BOOLEAN:
+      return cons(make_string("boolean"), the_empty_list);
+      
+    case CHARACTER:
+      return cons(make_string("character"), the_empty_list);
+      
+    case SYMBOL:
+      return cons(make_string("symbol"), the_empty_list);
+      
+    case FIXNUM:
+      return cons(make_string("number"), cons(make_string("integer"), the_empty_list));
+    
+    case FLONUM:
+      return cons(make_string("number"), cons(make_string("float"), the_empty_list));
+
+    case PRIMITIVE_PROCEDURE:
+      return cons(make_string("procedure"), cons(make_string("primitive"), the_empty_list));
+    
+    case COMPOUND_PROCEDURE:
+      return cons(make_string("procedure"), cons(make_string("compound"), the_empty_list));
+ 
+    case STRING:
+      return cons(make_string("sequence"), cons(make_string("string"), the_empty_list));
+    
+    case PAIR:
+      return cons(make_string("sequence"), cons(make_string("pair"), the_empty_list));
+
+    case VECTOR:
+      return cons(make_string("sequence"), cons(make_string("vector"), the_empty_list));
+
+    case NUMERIC_VECTOR:
+      return cons(make_string("sequence"),
+                  cons(make_string(numeric_vector_name(
+                                     obj->data.numeric_vector.kind)),
+                       the_empty_list));
+
+    case PERSISTENT_VECTOR:
+      return cons(make_string("sequence"),
+                  cons(make_string("persistent-vector"), the_empty_list));
+
+    case RANGE:
+      return cons(make_string("sequence"),
+                  cons(make_string("range"), the_empty_list));
+
+    case HASH_TABLE:
+      return cons(make_string("hash-table"), the_empty_list);
+
+    case PERSISTENT_MAP:
+      return cons(make_string("persistent-map"), the_empty_list);
+
+    case PORT:
+      return cons(make_string("port"), the_empty_list);
+
+    case FUTURE:
+      return cons(make_string("future"), the_empty_list);
+
+    case TASK:
+      return cons(make_string("task"), the_empty_list);
+
+    case CHANNEL:
+      return cons(make_string("channel"), the_empty_list);
+  }
+}
+
+object *p_type(object *arguments) {
+  h_type(car(arguments));
+}
+
+
+//  type?
+
+object *p_typep(object *arguments) {
+  h_equalp(h_type(car(arguments)), h_type(cadr(arguments)));
+}
+
+
+//  ->string
+
+object *h_to_string(object *obj) {
+  char buf[32];
+  char cbuf[4];
+  
+  switch (obj->type) {
+    case FIXNUM:
+      sprintf(buf, "%ld", obj->data.fixnum);
+      return make_string(buf);
+      break;
+    case FLONUM:
+      buf[format_flonum(obj->data.flonum, buf)] = '\0';
+      return make_string(buf);
+      break;
+    case CHARACTER:
+      return make_string_length(cbuf, utf8_encode(obj->data.character, cbuf));
+      break;
+    case SYMBOL:
+      return make_string(obj->data.symbol);
+      break;
+    case PORT:
+      return port_to_string(h_string_builder(obj));
+      break;
+    case PAIR:  // Should return "(a b c)" for (->string '(#\a #\b #\c))
+      return make_string_from_list(obj);
+      break;
+    case VECTOR:
+      error("->string on vectors not implemented yet");
+      break;
+  }
+}
+
+object *p_to_string(object *arguments) {
+  return h_to_string(car(arguments));
+}
+
+
+//  ->number
+
+object *h_to_number(object *obj) {
+  switch (obj->type) {
+    case STRING:
+      return parse_number(string_to_c(obj));
+      break;
+    case CHARACTER:
+      return make_fixnum(obj->data.character);
+      break;
+    default:
+      error("Unsupported type for ->number");
+      break;
+  }
+}
+
+object *p_to_number(object *arguments) {
+  return h_to_number(car(arguments));
+}
+
+
+//  ->char
+
+object *h_to_char(object *obj) {
+  object *char_list = the_empty_list;
+  int len;
+  
+  switch (obj->type) {
+    case FIXNUM:
+      if (obj->data.fixnum < 0 || obj->data.fixnum > 0x10FFFF ||
+          (obj->data.fixnum >= 0xD800 && obj->data.fixnum <= 0xDFFF)) {
+        error("->char: %ld is not a Unicode codepoint", obj->data.fixnum);
+      }
+      return make_character(obj->data.fixnum);
+      break;
+    case STRING:
+      // Walk backwards, consing a character at every byte that starts one
+      len = obj->data.string.length - 1;
+      while (len > -1) {
+        if ((signed char) obj->data.string.chars[len] > -65) {
+          char_list = cons(make_character(
+                             utf8_decode(obj->data.string.chars + len)),
+                           char_list);
+        }
+        len--;
+      }
+      return char_list;
+      break;
+    default:
+      error("Unsupported type for ->char");
+      break;
+  }
+}
+
+object *p_to_char(object *arguments) {
+  return h_to_char(car(arguments));
+}
+
+
+//  Sequence Procedures
+//___________________________________//
+
+//  first
+
+object *h_first(object *seq) {
+  switch (seq->type) {
+    case PAIR:
+      return car(seq);
+      break;
+    case STRING:
+      return make_character(utf8_decode(seq->data.string.chars));
+      break;
+    case VECTOR:
+      return seq->data.vector.vec[0];
+      break;
+    case NUMERIC_VECTOR:
+      return numeric_vector_ref(seq, 0);
+      break;
+    case PERSISTENT_VECTOR:
+      return persistent_vector_ref(seq, 0);
+      break;
+    case PERSISTENT_MAP:
+      return persistent_map_first(seq);
+      break;
+    case RANGE:
+      if (range_length(seq) == 0) {
+        error("first: empty range");
+      }
+      return make_fixnum(seq->data.range.start);
+      break;
+    default:
+      error("Unsupported type for first");
+      break;
+  }
+}
+
+object *p_first(object *arguments) {
+  return h_first(car(arguments));
+}
+
+
+//  rest
+
+object *h_rest(object *seq) {
+  object *rest;
+  long int count;
+  int size;
+  
+  switch (seq->type) {
+    case PAIR:
+      return cdr(seq);
+      break;
+    case STRING:
+      if (seq->data.string.length == 0) {
+        return seq;
+      }
+      size = utf8_size(seq->data.string.chars[0]);
+      rest = make_string_slice(seq, size, seq->data.string.length - size);
+      count = __atomic_load_n(&seq->data.string.count, __ATOMIC_ACQUIRE);
+      if (count != -1) {
+        rest->data.string.count = count - 1;
+      }
+      return rest;
+      break;
+    case VECTOR:
+      if (seq->data.vector.length == 0) {
+        return seq;
+      }
+      return make_vector_slice(seq, 1, seq->data.vector.length - 1);
+      break;
+    case NUMERIC_VECTOR:
+      if (seq->data.numeric_vector.length == 0) {
+        return seq;
+      }
+      return make_numeric_vector_slice(seq, 1,
+                                       seq->data.numeric_vector.length - 1);
+      break;
+    case PERSISTENT_VECTOR:
+      if (is_transient(seq)) {
+        error("rest: not on a transient");
+      }
+      if (seq->data.persistent_vector.length == 0) {
+        return seq;
+      }
+      return make_persistent_vector(seq->data.persistent_vector.tree,
+                                    seq->data.persistent_vector.start + 1,
+                                    seq->data.persistent_vector.length - 1);
+      break;
+    case PERSISTENT_MAP:
+      if (is_transient(seq)) {
+        error("rest: not on a transient");
+      }
+      if (seq->data.persistent_map.count == 0) {
+        return seq;
+      }
+      return persistent_map_remove(seq, car(persistent_map_first(seq)));
+      break;
+    case RANGE:
+      if (range_length(seq) == 0) {
+        return seq;
+      }
+      return make_range(seq->data.range.start + seq->data.range.step,
+                        seq->data.range.stop, seq->data.range.step);
+      break;
+    default:
+      error("Unsupported type for rest");
+      break;
+  }
+}
+
+object *p_rest(object *arguments) {
+  return h_rest(car(arguments));
+}
+
+
+//  next
+
+object *h_next(object *seq) {
+  object *temp;
+  switch (seq->type) {
+    case PAIR:
+      temp = car(seq);
+      if (cdr(seq) == the_empty_list) {
+        seq->type = THE_EMPTY_LIST;
+        return temp;
+      }
+      seq->data.pair.car = cadr(seq);
+      seq->data.pair.cdr = cddr(seq);
+      return temp;
+    case STRING:
+      error("next not implemented on strings");
+      break;
+    case VECTOR:
+      error("next not implemented on vectors");
+      break;
+    default:
+      if (h_emptyp(seq) == True) {
+        return seq;
+      }
+      error("Unsupported type for rest");
+      break;
+  }
+}
+
+object *p_next(object *args) {
+  return h_next(car(args));
+}
+
+
+//  empty?
+
+object *h_emptyp(object *obj) {
+  switch (obj->type) {
+    case THE_EMPTY_LIST:
+      return True;
+      break;
+
+    case STRING:
+      if (obj->data.string.length == 0) {
+        return True;
+      }
+      break;
+      
+    case VECTOR:
+      if (obj->data.vector.length == 0) {
+        return True;
+      }
+      return False;
+      break;
+      
+    case NUMERIC_VECTOR:
+      if (obj->data.numeric_vector.length == 0) {
+        return True;
+      }
+      return False;
+      break;
+      
+    case PERSISTENT_VECTOR:
+      if (obj->data.persistent_vector.length == 0) {
+        return True;
+      }
+      return False;
+      break;
+      
+    case RANGE:
+      if (range_length(obj) == 0) {
+        return True;
+      }
+      return False;
+      break;
+      
+    case HASH_TABLE:
+      if (obj->data.hash_table.slots->count == 0) {
+        return True;
+      }
+      return False;
+      break;
+      
+    case PERSISTENT_MAP:
+      if (obj->data.persistent_map.count == 0) {
+        return True;
+      }
+      return False;
+      break;
+  }
+  return False;
+}
+
+object *p_emptyp(object *arguments) {
+  return h_emptyp(car(arguments));
+}
+
+
+//  length
+
+object *h_length(object *obj) {
+  int count = 1;
+  
+  if (obj == the_empty_list) {
+    return make_fixnum(0);
+  }
+  else if (obj->type == PAIR) {
+    while (cdr(obj) != the_empty_list) {
+      count += 1;
+      obj = cdr(obj);
+    }
+    return make_fixnum(count);
+  }
+  else if (obj->type == STRING) {
+    return make_fixnum(string_count(obj));
+  }
+  else if (obj->type == VECTOR) {
+    return make_fixnum(obj->data.vector.length);
+  }
+  else if (obj->type == NUMERIC_VECTOR) {
+    return make_fixnum(obj->data.numeric_vector.length);
+  }
+  else if (obj->type == PERSISTENT_VECTOR) {
+    return make_fixnum(obj->data.persistent_vector.length);
+  }
+  else if (obj->type == RANGE) {
+    return make_fixnum(range_length(obj));
+  }
+  else if (obj->type == HASH_TABLE) {
+    return make_fixnum(obj->data.hash_table.slots->count);
+  }
+  else if (obj->type == PERSISTENT_MAP) {
+    return make_fixnum(obj->data.persistent_map.count);
+  }
+  else {
+    error("Unsupported type for length");
+  }
+}
+
+object *p_length(object *arguments) {
+  h_length(car(arguments));
+}
+
+
+//  index
+
+object *h_index_list(object *lst, int start, int end, int rev) {
+  int count = 0;
+  object *sublist = the_empty_list;
+  
+  // Find first index
+  while (count != start) {
+    count += 1;
+    lst = cdr(lst);
+  }
+  
+  // If we're only getting one index
+  if (start == end) {
+    return car(lst);
+  }
+  
+  // If we're getting a sublist
+  else {
+    while (count != end) {
+      sublist = cons(car(lst), sublist);
+      count += 1;
+      lst = cdr(lst);
+    }
+    if (rev) {
+      return sublist;
+    }
+    else {
+      return h_reverse(sublist);
+    }
+  }
 }
 
-// This needs some serious refactoring!!!
-// It also needs to check for too few arguments.
-object *eval_arguments(object *args, object *env, object *parameters) {
-  object *result_list = the_empty_list;
-  object *rest_list = the_empty_list;
-  int rest_argument_present = 0;
+object *h_index_string(object *string, int start, int end, int rev) {
+  object *result;
+  char *chars = string->data.string.chars;
+  long int first;
+  long int last;
+  long int offset;
+  int size;
   
-  while (parameters != the_empty_list) {
-    if (car(parameters) == rest_symbol) {
-      rest_argument_present = 1;
-      while (args != the_empty_list) {
-        rest_list = cons(eval(car(args), env),
-                         rest_list);
-        args = cdr(args);
+  if (start == end) {
+    return string_ref(string, start);
+  }
+  first = string_offset(string, start);
+  last = string_offset(string, end);
+  if (!rev) {
+    result = make_string_slice(string, first, last - first);
+    result->data.string.count = end - start;
+    return result;
+  }
+  // Reverse the characters, not the bytes that make them up
+  result = make_empty_string(last - first);
+  result->data.string.count = end - start;
+  for (offset = first; offset < last; offset += size) {
+    size = utf8_size(chars[offset]);
+    memcpy(result->data.string.chars + (last - offset - size),
+           chars + offset, size);
+  }
+  return result;
+}
+
+object *h_index_vector(object *vec, int start, int end, int rev) {
+  object *result;
+  int count;
+  
+  if (start == end) {
+    return vec->data.vector.vec[start];
+  }
+  if (!rev) {
+    return make_vector_slice(vec, start, end - start);
+  }
+  result = make_vector(end - start, the_empty_list);
+  for (count = 0; count < end - start; count++) {
+    result->data.vector.vec[count] = vec->data.vector.vec[end - 1 - count];
+  }
+  return result;
+}
+
+object *h_index_numeric_vector(object *vec, int start, int end, int rev) {
+  object *result;
+  int count;
+  
+  if (start == end) {
+    return numeric_vector_ref(vec, start);
+  }
+  if (!rev) {
+    return make_numeric_vector_slice(vec, start, end - start);
+  }
+  result = make_numeric_vector(vec->data.numeric_vector.kind, end - start);
+  for (count = 0; count < end - start; count++) {
+    numeric_vector_set(result, count, numeric_vector_ref(vec, end - 1 - count));
+  }
+  return result;
+}
+
+object *h_index_persistent_vector(object *vec, int start, int end, int rev) {
+  object *result;
+  int count;
+  
+  if (start == end) {
+    return persistent_vector_ref(vec, start);
+  }
+  if (is_transient(vec)) {
+    error("index: not on a transient");
+  }
+  if (!rev) {
+    return make_persistent_vector(vec->data.persistent_vector.tree,
+                                  vec->data.persistent_vector.start + start,
+                                  end - start);
+  }
+  result = make_transient(make_persistent_vector(pv_tree_make(NULL), 0, 0));
+  for (count = end - 1; count >= start; count--) {
+    persistent_vector_push(result, persistent_vector_ref(vec, count));
+  }
+  result->data.persistent_vector.tree->edit = NULL;
+  return result;
+}
+
+// A slice of a range is a range, going backwards when reversed
+object *h_index_range(object *range, int start, int end, int rev) {
+  long int step = range->data.range.step;
+  
+  if (start == end) {
+    return range_ref(range, start);
+  }
+  if (!rev) {
+    return make_range(range->data.range.start + start * step,
+                      range->data.range.start + end * step, step);
+  }
+  return make_range(range->data.range.start + (end - 1) * step,
+                    range->data.range.start + (start - 1) * step, -step);
+}
+
+object *p_index(object *obj) {
+  int start = cadr(obj)->data.fixnum;
+  int end;
+  object *sequence = car(obj);
+  int len = h_length(sequence)->data.fixnum;
+  int rev = 0;
+  
+  if (start < 0) {
+    start = len + start;
+  }
+
+  // If end argument is not supplied set end to start
+  if (cddr(obj) != the_empty_list) {
+    end = caddr(obj)->data.fixnum;
+  }
+  else {
+    end = start;
+  }
+  
+  // Normalize negative end and add one so that (index lst 0 -1) returns whole list
+  if (end < 0) {
+    end = len + end + 1;
+  } 
+
+  // Check that list indices are within range
+  if (start > len || end > len || start < 0 || end < 0) {
+    error("List index out of range");
+  }
+
+  // If start > end: swap start & end and set rev to a non-negative value
+  // BUG: (index lst -1 0) should return the full list
+  //      now it returns '(2 1) if lst = '(1 2 3)
+  if (start > end) {
+    rev = start;
+    start = end;
+    end = rev;
+  }
+
+  switch (car(obj)->type) {
+    case PAIR:
+      return h_index_list(sequence, start, end, rev);
+      break;
+    case STRING:
+      return h_index_string(sequence, start, end, rev);
+      break;
+    case VECTOR:
+      return h_index_vector(sequence, start, end, rev);
+      break;
+    case NUMERIC_VECTOR:
+      return h_index_numeric_vector(sequence, start, end, rev);
+      break;
+    case PERSISTENT_VECTOR:
+      return h_index_persistent_vector(sequence, start, end, rev);
+      break;
+    case RANGE:
+      return h_index_range(sequence, start, end, rev);
+      break;
+    default:
+      error("Unsupported type for index");
+      break;
+  }
+}
+
+//  String Procedures
+//___________________________________//
+
+//  string-builder / string-append!
+//  A string builder is a string port, so appending copies into a buffer that
+//  doubles when it is full and ->string copies the result out once
+
+object *h_string_builder(object *obj) {
+  if (!is_port(obj) || obj->data.port.kind != STRING_PORT) {
+    error("Expected a string builder");
+  }
+  return obj;
+}
+
+object *p_string_builder(object *arguments) {
+  object *builder = make_port(NULL, STRING_PORT);
+  
+  while (arguments != the_empty_list) {
+    display(builder, car(arguments));
+    arguments = cdr(arguments);
+  }
+  return builder;
+}
+
+object *p_string_append(object *arguments) {
+  object *builder = h_string_builder(car(arguments));
+  
+  interpreter_changed();
+  arguments = cdr(arguments);
+  while (arguments != the_empty_list) {
+    display(builder, car(arguments));
+    arguments = cdr(arguments);
+  }
+  return Void;
+}
+
+
+//  string-join
+//  (string-join strings [separator])
+
+object *p_string_join(object *arguments) {
+  object *strings = car(arguments);
+  object *separator = the_empty_list;
+  object *lst;
+  object *result;
+  long int length = 0;
+  char *chars;
+  
+  if (cdr(arguments) != the_empty_list) {
+    separator = cadr(arguments);
+    if (!is_string(separator)) {
+      error("string-join: separator must be a string");
+    }
+  }
+  for (lst = strings; lst != the_empty_list; lst = cdr(lst)) {
+    if (!is_string(car(lst))) {
+      error("string-join: expected a list of strings");
+    }
+    length += car(lst)->data.string.length;
+    if (separator != the_empty_list && cdr(lst) != the_empty_list) {
+      length += separator->data.string.length;
+    }
+  }
+  
+  result = make_empty_string(length);
+  chars = result->data.string.chars;
+  for (lst = strings; lst != the_empty_list; lst = cdr(lst)) {
+    memcpy(chars, car(lst)->data.string.chars, car(lst)->data.string.length);
+    chars += car(lst)->data.string.length;
+    if (separator != the_empty_list && cdr(lst) != the_empty_list) {
+      memcpy(chars, separator->data.string.chars,
+             separator->data.string.length);
+      chars += separator->data.string.length;
+    }
+  }
+  return result;
+}
+
+
+//  Searching
+//  string_search looks for the first and last byte of the needle at the same
+//  time across a whole block of starting positions (Muła's SIMD substring
+//  search) and only compares the bytes in between where both match.
+
+long int string_search(char *haystack, long int length,
+                       char *needle, long int needle_length) {
+  long int i = 0;
+  long int j;
+  char *found;
+
+  if (needle_length == 0) {
+    return 0;
+  }
+
+#if defined(LISPY_AVX2)
+  {
+    __m256i first = _mm256_set1_epi8(needle[0]);
+    __m256i last = _mm256_set1_epi8(needle[needle_length - 1]);
+    uint32_t mask;
+
+    for (; i + 32 + needle_length - 1 <= length; i += 32) {
+      __m256i block_first = _mm256_loadu_si256((__m256i *) (haystack + i));
+      __m256i block_last = _mm256_loadu_si256(
+                             (__m256i *) (haystack + i + needle_length - 1));
+      mask = _mm256_movemask_epi8(
+               _mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+                                _mm256_cmpeq_epi8(block_last, last)));
+      while (mask != 0) {
+        j = i + __builtin_ctz(mask);
+        if (needle_length <= 2 ||
+            memcmp(haystack + j + 1, needle + 1, needle_length - 2) == 0) {
+          return j;
+        }
+        mask &= mask - 1;
+      }
+    }
+  }
+#elif defined(LISPY_SSE2)
+  {
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[needle_length - 1]);
+    uint32_t mask;
+
+    for (; i + 16 + needle_length - 1 <= length; i += 16) {
+      __m128i block_first = _mm_loadu_si128((__m128i *) (haystack + i));
+      __m128i block_last = _mm_loadu_si128(
+                             (__m128i *) (haystack + i + needle_length - 1));
+      mask = _mm_movemask_epi8(
+               _mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                             _mm_cmpeq_epi8(block_last, last)));
+      while (mask != 0) {
+        j = i + __builtin_ctz(mask);
+        if (needle_length <= 2 ||
+            memcmp(haystack + j + 1, needle + 1, needle_length - 2) == 0) {
+          return j;
+        }
+        mask &= mask - 1;
       }
+    }
+  }
+#endif
+
+  // What is left after the last whole block, or everything without SIMD
+  while (i + needle_length <= length) {
+    found = memchr(haystack + i, needle[0], length - needle_length + 1 - i);
+    if (found == NULL) {
+      return -1;
+    }
+    i = found - haystack;
+    if (memcmp(haystack + i, needle, needle_length) == 0) {
+      return i;
+    }
+    i += 1;
+  }
+  return -1;
+}
+
+// Check the arguments of a search primitive and return the string argument
+// n, which must not be empty when it is searched for
+object *h_string_argument(object *arguments, int n, char *name,
+                          char nonempty) {
+  object *str;
+
+  while (n-- > 0) {
+    arguments = cdr(arguments);
+  }
+  str = car(arguments);
+  if (!is_string(str)) {
+    error("%s: expected a string", name);
+  }
+  if (nonempty && str->data.string.length == 0) {
+    error("%s: can not search for an empty string", name);
+  }
+  return str;
+}
+
+
+//  string-find
+//  (string-find string substring [start]) is the index of the first
+//  occurrence of substring at or after start, or False
+
+object *p_string_find(object *arguments) {
+  object *str = h_string_argument(arguments, 0, "string-find", 0);
+  object *needle = h_string_argument(arguments, 1, "string-find", 0);
+  long int start = 0;
+  long int offset;
+  long int found;
+
+  if (cddr(arguments) != the_empty_list) {
+    start = caddr(arguments)->data.fixnum;
+    if (start < 0 || start > string_count(str)) {
+      error("string-find: start index out of range");
+    }
+  }
+  // Search bytes, then turn the byte offset found into a character index
+  offset = string_offset(str, start);
+  found = string_search(str->data.string.chars + offset,
+                        str->data.string.length - offset,
+                        needle->data.string.chars,
+                        needle->data.string.length);
+  if (found == -1) {
+    return False;
+  }
+  return make_fixnum(start + utf8_count(str->data.string.chars + offset,
+                                        found));
+}
+
+
+//  string-count
+//  Number of non-overlapping occurrences of a substring
+
+object *p_string_count(object *arguments) {
+  object *str = h_string_argument(arguments, 0, "string-count", 0);
+  object *needle = h_string_argument(arguments, 1, "string-count", 1);
+  char *chars = str->data.string.chars;
+  long int length = str->data.string.length;
+  long int count = 0;
+  long int found;
+
+  while ((found = string_search(chars, length, needle->data.string.chars,
+                                needle->data.string.length)) != -1) {
+    count += 1;
+    chars += found + needle->data.string.length;
+    length -= found + needle->data.string.length;
+  }
+  return make_fixnum(count);
+}
+
+
+//  string-split
+//  (string-split string separator) is the list of the pieces between
+//  separators.  The pieces share the characters of string.
+
+object *p_string_split(object *arguments) {
+  object *str = h_string_argument(arguments, 0, "string-split", 0);
+  object *separator = h_string_argument(arguments, 1, "string-split", 1);
+  long int start = 0;
+  long int found;
+  object *head = cons(Void, the_empty_list);
+  object *tail = head;
+
+  while (1) {
+    found = string_search(str->data.string.chars + start,
+                          str->data.string.length - start,
+                          separator->data.string.chars,
+                          separator->data.string.length);
+    if (found == -1) {
       break;
     }
-    else {
-      result_list = cons(eval(car(args), env), 
-                         result_list);
-      args = cdr(args);
-      parameters = cdr(parameters);
+    set_cdr(tail, cons(make_string_slice(str, start, found), the_empty_list));
+    tail = cdr(tail);
+    start += found + separator->data.string.length;
+  }
+  set_cdr(tail, cons(make_string_slice(str, start,
+                                       str->data.string.length - start),
+                     the_empty_list));
+  return cdr(head);
+}
+
+
+//  string-replace
+//  (string-replace string old new) replaces every non-overlapping
+//  occurrence of old.  The result is sized before anything is copied.
+
+object *p_string_replace(object *arguments) {
+  object *str = h_string_argument(arguments, 0, "string-replace", 0);
+  object *old = h_string_argument(arguments, 1, "string-replace", 1);
+  object *new = h_string_argument(arguments, 2, "string-replace", 0);
+  long int count = p_string_count(arguments)->data.fixnum;
+  long int start = 0;
+  long int found;
+  object *result;
+  char *chars;
+
+  if (count == 0) {
+    return str;
+  }
+  result = make_empty_string(str->data.string.length + count *
+                             (new->data.string.length -
+                              old->data.string.length));
+  chars = result->data.string.chars;
+  while ((found = string_search(str->data.string.chars + start,
+                                str->data.string.length - start,
+                                old->data.string.chars,
+                                old->data.string.length)) != -1) {
+    memcpy(chars, str->data.string.chars + start, found);
+    chars += found;
+    memcpy(chars, new->data.string.chars, new->data.string.length);
+    chars += new->data.string.length;
+    start += found + old->data.string.length;
+  }
+  memcpy(chars, str->data.string.chars + start,
+         str->data.string.length - start);
+  return result;
+}
+
+
+//  Numeric Vector Procedures
+//___________________________________//
+// The kernels work on the unboxed elements of f64vectors, s64vectors and
+// u8vectors, 32 bytes at a time with AVX2 and 16 with SSE2.  f64 sums are
+// kept in one accumulator per lane, so they may round differently from a
+// left to right fold.  u8 arithmetic wraps around modulo 256.
+
+// Check that argument n is a numeric vector and return it
+object *h_numeric_vector_argument(object *arguments, int n, char *name) {
+  object *vec;
+
+  while (n-- > 0) {
+    arguments = cdr(arguments);
+  }
+  vec = car(arguments);
+  if (!is_numeric_vector(vec)) {
+    error("%s: expected a numeric vector", name);
+  }
+  return vec;
+}
+
+// The second operand of an elementwise procedure: a numeric vector like vec,
+// or a number repeated to the length of vec
+object *h_numeric_vector_operand(object *vec, object *operand, char *name) {
+  object *result;
+  long int length = vec->data.numeric_vector.length;
+  int size = numeric_vector_element_size(vec->data.numeric_vector.kind);
+  long int i;
+
+  if (is_numeric_vector(operand)) {
+    if (operand->data.numeric_vector.kind != vec->data.numeric_vector.kind ||
+        operand->data.numeric_vector.length != length) {
+      error("%s: vectors must have the same kind and length", name);
     }
+    return operand;
+  }
+  result = make_numeric_vector(vec->data.numeric_vector.kind, length);
+  if (length > 0) {
+    numeric_vector_set(result, 0, operand);
+  }
+  for (i = 1; i < length; i++) {
+    memcpy(result->data.numeric_vector.elements.u8 + i * size,
+           result->data.numeric_vector.elements.u8, size);
+  }
+  return result;
+}
+
+
+// Sums
+
+double f64_sum(double *x, long int length) {
+  double sum = 0;
+  long int i = 0;
+
+#if defined(LISPY_AVX2)
+  __m256d acc = _mm256_setzero_pd();
+  double lanes[4];
+
+  for (; i + 4 <= length; i += 4) {
+    acc = _mm256_add_pd(acc, _mm256_loadu_pd(x + i));
+  }
+  _mm256_storeu_pd(lanes, acc);
+  sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#elif defined(LISPY_SSE2)
+  __m128d acc = _mm_setzero_pd();
+  double lanes[2];
+
+  for (; i + 2 <= length; i += 2) {
+    acc = _mm_add_pd(acc, _mm_loadu_pd(x + i));
+  }
+  _mm_storeu_pd(lanes, acc);
+  sum = lanes[0] + lanes[1];
+#endif
+  for (; i < length; i++) {
+    sum += x[i];
+  }
+  return sum;
+}
+
+long int s64_sum(long int *x, long int length) {
+  long int sum = 0;
+  long int i = 0;
+
+#if defined(LISPY_AVX2)
+  __m256i acc = _mm256_setzero_si256();
+  long int lanes[4];
+
+  for (; i + 4 <= length; i += 4) {
+    acc = _mm256_add_epi64(acc, _mm256_loadu_si256((__m256i *) (x + i)));
+  }
+  _mm256_storeu_si256((__m256i *) lanes, acc);
+  sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(LISPY_SSE2)
+  __m128i acc = _mm_setzero_si128();
+  long int lanes[2];
+
+  for (; i + 2 <= length; i += 2) {
+    acc = _mm_add_epi64(acc, _mm_loadu_si128((__m128i *) (x + i)));
+  }
+  _mm_storeu_si128((__m128i *) lanes, acc);
+  sum = lanes[0] + lanes[1];
+#endif
+  for (; i < length; i++) {
+    sum += x[i];
+  }
+  return sum;
+}
+
+// psadbw against zero adds up groups of 8 bytes into 64 bit lanes
+long int u8_sum(unsigned char *x, long int length) {
+  long int sum = 0;
+  long int i = 0;
+
+#if defined(LISPY_AVX2)
+  __m256i acc = _mm256_setzero_si256();
+  long int lanes[4];
+
+  for (; i + 32 <= length; i += 32) {
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(
+            _mm256_loadu_si256((__m256i *) (x + i)), _mm256_setzero_si256()));
   }
-  if (!rest_argument_present) {
-    return h_reverse(result_list);
+  _mm256_storeu_si256((__m256i *) lanes, acc);
+  sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(LISPY_SSE2)
+  __m128i acc = _mm_setzero_si128();
+  long int lanes[2];
+
+  for (; i + 16 <= length; i += 16) {
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(
+            _mm_loadu_si128((__m128i *) (x + i)), _mm_setzero_si128()));
   }
-  else {
-    rest_list = h_reverse(rest_list);
-    result_list = cons(rest_list, result_list);
-    return h_reverse(result_list);
+  _mm_storeu_si128((__m128i *) lanes, acc);
+  sum = lanes[0] + lanes[1];
+#endif
+  for (; i < length; i++) {
+    sum += x[i];
   }
+  return sum;
 }
 
 
-// eval
-//___________________________________//
+// Dot products
 
-object *eval(object *exp, object *env) {
-  object *procedure;
-  object *arguments;
+double f64_dot(double *x, double *y, long int length) {
+  double sum = 0;
+  long int i = 0;
 
-tailcall:
+#if defined(LISPY_AVX2)
+  __m256d acc = _mm256_setzero_pd();
+  double lanes[4];
 
-  switch (exp->type) {
-    case BOOLEAN:
-    case FIXNUM:
-    case FLONUM:
-    case CHARACTER:
-    case STRING:
-    case VOID:
-      return exp;
-    case SYMBOL:
-      return lookup_variable_value(exp, env);
-    case PAIR:
-      procedure = car(exp);
-      
-      if (procedure == quote_symbol) {
-        return cadr(exp);
-      }
-      else if (procedure == set_symbol) {
-        set_variable_value(assignment_variable(exp),
-                           eval(assignment_value(exp), env),
-                           env);
-        return Void;
+  for (; i + 4 <= length; i += 4) {
+    acc = _mm256_add_pd(acc, _mm256_mul_pd(_mm256_loadu_pd(x + i),
+                                           _mm256_loadu_pd(y + i)));
+  }
+  _mm256_storeu_pd(lanes, acc);
+  sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#elif defined(LISPY_SSE2)
+  __m128d acc = _mm_setzero_pd();
+  double lanes[2];
 
-      }
-      else if (procedure == define_symbol) {
-        define_variable(definition_variable(exp),
-                        eval(definition_value(exp), env),
-                        env);
-        return Void;
-      }
-      else if (procedure == if_symbol) {
-        exp = is_true(eval(cadr(exp), env)) ?
-                caddr(exp) :
-                // Handle (if test consequent else alternative)
-                (cadddr(exp) == else_symbol) ?
-                  caddddr(exp) :
-                  cadddr(exp);
-        goto tailcall;
-      }
-      else if (procedure == cond_symbol) {
-        exp = make_cond(cdr(exp));
-        goto tailcall;
-      }
-      else if (procedure == lambda_symbol) {
-        // Check for presence of a docstring
-        if (caddr(exp)->type == STRING) {
-          return make_compound_procedure(cadr(exp), cdddr(exp), env, caddr(exp));
-        }
-        else {
-          return make_compound_procedure(cadr(exp), cddr(exp), env, make_string("No docstring"));
-        }
-      }
-      else if (procedure == begin_symbol) {
-        exp = cdr(exp);
-        while (!is_last_exp(exp)) {
-          eval(car(exp), env);
-          exp = cdr(exp);
-        }
-        exp = car(exp);
-        goto tailcall;
-      }
-      else if (procedure == let_symbol) {
-        exp = make_let(cdr(exp));
-        goto tailcall;
-      }
-      else if (procedure == and_symbol) {
-        object *args = cdr(exp);
-        object *e;
-        while (args != the_empty_list) {
-          e = eval(car(args), env);
-          if (e == False) {
-            return False;
-          }
-          args = cdr(args);
-        }
-        return e;
-      }
-      else if (procedure == or_symbol) {
-        object *result;
-        exp = cdr(exp);
-        while (exp != the_empty_list) {
-          result = eval(car(exp), env);
-          if (result == False) {
-            exp = cdr(exp);
-          }
-          else {
-            return result;
-          }
-        }
-        return False;
-      }
-      else if (procedure == apply_symbol) {
-        exp = cons(cadr(exp), eval(caddr(exp), env));
-        goto tailcall;
-      }
-      else if (procedure == eval_symbol) {
-        if (cddr(exp) != the_empty_list) {
-          env = eval(caddr(exp), env);
-          exp = eval(cadr(exp), env);
-          goto tailcall;
-        }
-        else {
-          exp = eval(cadr(exp), env);
-          goto tailcall;
-        }
-      }
-      else if (procedure == define_macro_symbol) {
-        define_variable(cadr(exp), make_macro(caddr(exp)), env);
-        return Void;
-        
-      }
-      else if (procedure == test_symbol) {
-        return test(cdr(exp));
-        
-      }
-      else if (procedure == list_symbol) {
-        return h_list(cdr(exp), env);
-      }
-      else if (procedure == string_symbol) {
-        return h_string(cdr(exp), env);
-      }
-      else if (procedure == vector_symbol) {
-        return h_vector(cdr(exp), env);
-      }
-      else if (procedure == for_symbol) {
-        return h_for(cdr(exp), env);
-      }
-      else {
-        procedure = eval(procedure, env);
-        switch (procedure->type) {
-          case PRIMITIVE_PROCEDURE:
-            return (procedure->data.primitive_procedure.fn)(list_of_values(cdr(exp), env));
-          case COMPOUND_PROCEDURE:
-            env = extend_environment(procedure->data.compound_procedure.parameters,
-                                    eval_arguments(cdr(exp), env, procedure->data.compound_procedure.parameters),
-                                    procedure->data.compound_procedure.env);
-            
-            // Transform lambda body into begin form
-            exp = cons(begin_symbol, procedure->data.compound_procedure.body);
-            goto tailcall;
-            break;
-          case MACRO:
-            // Expand macro by passing the arguments to the transformer unevaluated
-            exp =  eval(cons(procedure->data.macro.transformer, 
-                            cons(quote_macro_arguments(cdr(exp)),
-                                  the_empty_list)),
-                        env);
-            goto tailcall;
-            break;
-        }
-      }
+  for (; i + 2 <= length; i += 2) {
+    acc = _mm_add_pd(acc, _mm_mul_pd(_mm_loadu_pd(x + i),
+                                     _mm_loadu_pd(y + i)));
   }
+  _mm_storeu_pd(lanes, acc);
+  sum = lanes[0] + lanes[1];
+#endif
+  for (; i < length; i++) {
+    sum += x[i] * y[i];
+  }
+  return sum;
 }
 
+// Neither SSE2 nor AVX2 multiplies 64 bit lanes
+long int s64_dot(long int *x, long int *y, long int length) {
+  long int sum = 0;
+  long int i;
 
-/** ***************************************************************************
-**                                 Print
-******************************************************************************/
+  for (i = 0; i < length; i++) {
+    sum += x[i] * y[i];
+  }
+  return sum;
+}
 
+// Bytes are widened to 16 bits and pmaddwd adds pairs of products into 32
+// bit lanes, which are widened again before they can overflow
+long int u8_dot(unsigned char *x, unsigned char *y, long int length) {
+  long int sum = 0;
+  long int i = 0;
 
-void write_pair(object *pair) {
-  object *car_obj = car(pair);
-  object *cdr_obj = cdr(pair);
+#if defined(LISPY_SSE2)
+  __m128i zero = _mm_setzero_si128();
+  __m128i acc = _mm_setzero_si128();
+  long int lanes[2];
 
-  write(car_obj);
-  if (is_pair(cdr_obj)) {
-    printf(" ");
-    write_pair(cdr_obj);
+  for (; i + 16 <= length; i += 16) {
+    __m128i a = _mm_loadu_si128((__m128i *) (x + i));
+    __m128i b = _mm_loadu_si128((__m128i *) (y + i));
+    __m128i products = _mm_add_epi32(
+      _mm_madd_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)),
+      _mm_madd_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)));
+    acc = _mm_add_epi64(acc, _mm_add_epi64(_mm_unpacklo_epi32(products, zero),
+                                           _mm_unpackhi_epi32(products, zero)));
   }
-  else if (is_the_empty_list(cdr_obj)) {
-    return;
+  _mm_storeu_si128((__m128i *) lanes, acc);
+  sum = lanes[0] + lanes[1];
+#endif
+  for (; i < length; i++) {
+    sum += x[i] * y[i];
   }
-  else {
-    printf(" . ");
-    write(cdr_obj);
+  return sum;
+}
+
+
+// Minimum and maximum, of a vector with at least one element
+
+double f64_extreme(double *x, long int length, char max) {
+  double result = x[0];
+  long int i = 0;
+
+#if defined(LISPY_SSE2)
+  __m128d acc = _mm_set1_pd(x[0]);
+  double lanes[2];
+
+  for (; i + 2 <= length; i += 2) {
+    acc = max ? _mm_max_pd(acc, _mm_loadu_pd(x + i))
+              : _mm_min_pd(acc, _mm_loadu_pd(x + i));
   }
+  _mm_storeu_pd(lanes, acc);
+  result = (max ? lanes[0] > lanes[1] : lanes[0] < lanes[1]) ? lanes[0]
+                                                             : lanes[1];
+#endif
+  for (; i < length; i++) {
+    if (max ? x[i] > result : x[i] < result) {
+      result = x[i];
+    }
+  }
+  return result;
 }
 
+long int s64_extreme(long int *x, long int length, char max) {
+  long int result = x[0];
+  long int i = 0;
 
-void write_vector(object *vec) {
-  long int count = 0;
-  long int len = vec->data.vector.length - 1;
-  if (vec->data.vector.length != 0) {
-    while (count < len) {
-      write(vec->data.vector.vec[count]);
-      printf(" ");
-      count += 1;
+#if defined(LISPY_AVX2)
+  __m256i acc = _mm256_set1_epi64x(x[0]);
+  long int lanes[4];
+  int j;
+
+  for (; i + 4 <= length; i += 4) {
+    __m256i v = _mm256_loadu_si256((__m256i *) (x + i));
+    __m256i greater = _mm256_cmpgt_epi64(v, acc);
+    acc = max ? _mm256_blendv_epi8(acc, v, greater)
+              : _mm256_blendv_epi8(v, acc, greater);
+  }
+  _mm256_storeu_si256((__m256i *) lanes, acc);
+  for (j = 0; j < 4; j++) {
+    if (max ? lanes[j] > result : lanes[j] < result) {
+      result = lanes[j];
+    }
+  }
+#endif
+  for (; i < length; i++) {
+    if (max ? x[i] > result : x[i] < result) {
+      result = x[i];
     }
-    // If last element printed in while loop it would display as #(1 2 3 )
-    write(vec->data.vector.vec[count]);
   }
+  return result;
 }
 
+long int u8_extreme(unsigned char *x, long int length, char max) {
+  unsigned char result = x[0];
+  long int i = 0;
 
-void write(object *obj) {
-  char c;
-  char *str;
-  
-  switch (obj->type) {
-    case FIXNUM:                                      // FIXNUM
-      printf("%ld", obj->data.fixnum);
-      break;
-    
-    case FLONUM:                                      // FLONUM
-      printf("%f", obj->data.flonum);
-      break;
-    
-    case BOOLEAN:                                     // BOOLEAN
-      printf("%s", is_false(obj) ? "False" : "True");
-      break;
-      
-    case CHARACTER:                                   // CHARACTER
-      c = obj->data.character;
-      printf("#\\");
-      switch (c) {
-        case '\n':
-          printf("newline");
-          break;
-        case ' ':
-          printf("space");
-          break;
-        default:
-          putchar(c);
-      }
-      break;
-      
-    case STRING:                                      // STRING
-      str = obj->data.string;
-      putchar('"');
-      while (*str != '\0') {
-        switch (*str) {
-          case '\n':
-            printf("\\n");
-            break;
-          case '\\':
-            printf("\\\\");
-            break;
-          case '"':
-            printf("\\\"");
-            break;
-          default:
-            putchar(*str);
-        }
-        str++;
-      }
-      putchar('"');
-      break;
+#if defined(LISPY_SSE2)
+  __m128i acc = _mm_set1_epi8(x[0]);
+  unsigned char lanes[16];
+  int j;
 
-    case THE_EMPTY_LIST:                              // THE_EMPTY_LIST
-      printf("()");
-      break;
-      
-    case SYMBOL:                                      // SYMBOL
-      printf("%s", obj->data.symbol);
-      break;
-      
-    case PAIR:                                        // PAIR
-      printf("(");
-      write_pair(obj);
-      printf(")");
+  for (; i + 16 <= length; i += 16) {
+    acc = max ? _mm_max_epu8(acc, _mm_loadu_si128((__m128i *) (x + i)))
+              : _mm_min_epu8(acc, _mm_loadu_si128((__m128i *) (x + i)));
+  }
+  _mm_storeu_si128((__m128i *) lanes, acc);
+  for (j = 0; j < 16; j++) {
+    if (max ? lanes[j] > result : lanes[j] < result) {
+      result = lanes[j];
+    }
+  }
+#endif
+  for (; i < length; i++) {
+    if (max ? x[i] > result : x[i] < result) {
+      result = x[i];
+    }
+  }
+  return result;
+}
+
+
+// Elementwise arithmetic.  op is '+', '-' or '*'.
+
+void f64_elementwise(char op, double *result, double *x, double *y,
+                     long int length) {
+  long int i = 0;
+
+#if defined(LISPY_AVX2)
+  for (; i + 4 <= length; i += 4) {
+    __m256d a = _mm256_loadu_pd(x + i);
+    __m256d b = _mm256_loadu_pd(y + i);
+    _mm256_storeu_pd(result + i, op == '+' ? _mm256_add_pd(a, b) :
+                                 op == '-' ? _mm256_sub_pd(a, b) :
+                                             _mm256_mul_pd(a, b));
+  }
+#elif defined(LISPY_SSE2)
+  for (; i + 2 <= length; i += 2) {
+    __m128d a = _mm_loadu_pd(x + i);
+    __m128d b = _mm_loadu_pd(y + i);
+    _mm_storeu_pd(result + i, op == '+' ? _mm_add_pd(a, b) :
+                              op == '-' ? _mm_sub_pd(a, b) :
+                                          _mm_mul_pd(a, b));
+  }
+#endif
+  for (; i < length; i++) {
+    result[i] = op == '+' ? x[i] + y[i] :
+                op == '-' ? x[i] - y[i] :
+                            x[i] * y[i];
+  }
+}
+
+void s64_elementwise(char op, long int *result, long int *x, long int *y,
+                     long int length) {
+  long int i = 0;
+
+#if defined(LISPY_AVX2)
+  for (; op != '*' && i + 4 <= length; i += 4) {
+    __m256i a = _mm256_loadu_si256((__m256i *) (x + i));
+    __m256i b = _mm256_loadu_si256((__m256i *) (y + i));
+    _mm256_storeu_si256((__m256i *) (result + i),
+                        op == '+' ? _mm256_add_epi64(a, b)
+                                  : _mm256_sub_epi64(a, b));
+  }
+#elif defined(LISPY_SSE2)
+  for (; op != '*' && i + 2 <= length; i += 2) {
+    __m128i a = _mm_loadu_si128((__m128i *) (x + i));
+    __m128i b = _mm_loadu_si128((__m128i *) (y + i));
+    _mm_storeu_si128((__m128i *) (result + i),
+                     op == '+' ? _mm_add_epi64(a, b) : _mm_sub_epi64(a, b));
+  }
+#endif
+  for (; i < length; i++) {
+    result[i] = op == '+' ? x[i] + y[i] :
+                op == '-' ? x[i] - y[i] :
+                            x[i] * y[i];
+  }
+}
+
+void u8_elementwise(char op, unsigned char *result, unsigned char *x,
+                    unsigned char *y, long int length) {
+  long int i = 0;
+
+#if defined(LISPY_AVX2)
+  for (; op != '*' && i + 32 <= length; i += 32) {
+    __m256i a = _mm256_loadu_si256((__m256i *) (x + i));
+    __m256i b = _mm256_loadu_si256((__m256i *) (y + i));
+    _mm256_storeu_si256((__m256i *) (result + i),
+                        op == '+' ? _mm256_add_epi8(a, b)
+                                  : _mm256_sub_epi8(a, b));
+  }
+#elif defined(LISPY_SSE2)
+  for (; op != '*' && i + 16 <= length; i += 16) {
+    __m128i a = _mm_loadu_si128((__m128i *) (x + i));
+    __m128i b = _mm_loadu_si128((__m128i *) (y + i));
+    _mm_storeu_si128((__m128i *) (result + i),
+                     op == '+' ? _mm_add_epi8(a, b) : _mm_sub_epi8(a, b));
+  }
+#endif
+  for (; i < length; i++) {
+    result[i] = op == '+' ? x[i] + y[i] :
+                op == '-' ? x[i] - y[i] :
+                            x[i] * y[i];
+  }
+}
+
+object *h_numeric_vector_elementwise(char op, object *arguments, char *name) {
+  object *x = h_numeric_vector_argument(arguments, 0, name);
+  object *y = h_numeric_vector_operand(x, cadr(arguments), name);
+  long int length = x->data.numeric_vector.length;
+  object *result = make_numeric_vector(x->data.numeric_vector.kind, length);
+
+  switch (x->data.numeric_vector.kind) {
+    case F64_VECTOR:
+      f64_elementwise(op, result->data.numeric_vector.elements.f64,
+                      x->data.numeric_vector.elements.f64,
+                      y->data.numeric_vector.elements.f64, length);
       break;
-    
-    case VECTOR:
-      printf("#(");
-      write_vector(obj);
-      printf(")");
+    case S64_VECTOR:
+      s64_elementwise(op, result->data.numeric_vector.elements.s64,
+                      x->data.numeric_vector.elements.s64,
+                      y->data.numeric_vector.elements.s64, length);
       break;
+    default:
+      u8_elementwise(op, result->data.numeric_vector.elements.u8,
+                     x->data.numeric_vector.elements.u8,
+                     y->data.numeric_vector.elements.u8, length);
+  }
+  return result;
+}
+
+
+//  f64vector / s64vector / u8vector
+//  Also what #f64(...), #s64(...) and #u8(...) read as
+
+object *p_f64vector(object *arguments) {
+  return make_numeric_vector_from_list(F64_VECTOR, arguments);
+}
+
+object *p_s64vector(object *arguments) {
+  return make_numeric_vector_from_list(S64_VECTOR, arguments);
+}
+
+object *p_u8vector(object *arguments) {
+  return make_numeric_vector_from_list(U8_VECTOR, arguments);
+}
+
+
+//  vsum
+
+object *p_vsum(object *arguments) {
+  object *vec = h_numeric_vector_argument(arguments, 0, "vsum");
+  long int length = vec->data.numeric_vector.length;
+
+  switch (vec->data.numeric_vector.kind) {
+    case F64_VECTOR:
+      return make_flonum(f64_sum(vec->data.numeric_vector.elements.f64,
+                                 length));
+    case S64_VECTOR:
+      return make_fixnum(s64_sum(vec->data.numeric_vector.elements.s64,
+                                 length));
+    default:
+      return make_fixnum(u8_sum(vec->data.numeric_vector.elements.u8,
+                                length));
+  }
+}
 
-    case PRIMITIVE_PROCEDURE:                         // PRIMITIVE_PROCEDURE
-      printf("#<primitive>");
-      break;
-      
-    case COMPOUND_PROCEDURE:                          // COMPOUND_PROCEDURE
-      printf("#<procedure> ");
-      write(obj->data.compound_procedure.parameters); printf("  ");
-      write(obj->data.compound_procedure.body);
-      break;
-    
-    case MACRO:                                       // MACRO
-      printf("#<macro> ");
-      write(obj->data.macro.transformer);
-      break;
-      
-    case VOID:                                        // VOID
-      break;
 
+//  vdot
+
+object *p_vdot(object *arguments) {
+  object *x = h_numeric_vector_argument(arguments, 0, "vdot");
+  object *y = h_numeric_vector_argument(arguments, 1, "vdot");
+  long int length = x->data.numeric_vector.length;
+
+  h_numeric_vector_operand(x, y, "vdot");
+  switch (x->data.numeric_vector.kind) {
+    case F64_VECTOR:
+      return make_flonum(f64_dot(x->data.numeric_vector.elements.f64,
+                                 y->data.numeric_vector.elements.f64,
+                                 length));
+    case S64_VECTOR:
+      return make_fixnum(s64_dot(x->data.numeric_vector.elements.s64,
+                                 y->data.numeric_vector.elements.s64,
+                                 length));
     default:
-      error("cannot write unknown type\n");
-    }
+      return make_fixnum(u8_dot(x->data.numeric_vector.elements.u8,
+                                y->data.numeric_vector.elements.u8,
+                                length));
+  }
 }
 
-/** ***************************************************************************
-**                           Primitive Procedures
-*******************************************************************************
-** Primitive procedures are prefixed with p_
-** Helper procedures are prefixed with h_ and are for internal use.
-** Predicates (like equal? or number?) end with a p (p_equalp, p_numberp)
-**/
 
-//  Language Procedures
-//_____________________________________________//
-object *make_initial_environment(void);
+//  vmin / vmax
 
-object *p_apply(object *arguments) {
-  error("apply procedure should never be called");
+object *h_numeric_vector_extreme(object *arguments, char max, char *name) {
+  object *vec = h_numeric_vector_argument(arguments, 0, name);
+  long int length = vec->data.numeric_vector.length;
+
+  if (length == 0) {
+    error("%s: empty vector", name);
+  }
+  switch (vec->data.numeric_vector.kind) {
+    case F64_VECTOR:
+      return make_flonum(f64_extreme(vec->data.numeric_vector.elements.f64,
+                                     length, max));
+    case S64_VECTOR:
+      return make_fixnum(s64_extreme(vec->data.numeric_vector.elements.s64,
+                                     length, max));
+    default:
+      return make_fixnum(u8_extreme(vec->data.numeric_vector.elements.u8,
+                                    length, max));
+  }
 }
 
-object *p_eval(object *arguments) {
-  error("eval procedure should never be called");
+object *p_vmin(object *arguments) {
+  return h_numeric_vector_extreme(arguments, 0, "vmin");
 }
 
-object *p_global_environment(object *arguments) {
-  return the_global_environment;
+object *p_vmax(object *arguments) {
+  return h_numeric_vector_extreme(arguments, 1, "vmax");
 }
 
-object *p_initial_environment(object *arguments) {
-  return make_initial_environment();
+
+//  v+ / v- / v*
+//  (v+ vec vec-or-number) adds elementwise, a number is added to every element
+
+object *p_vadd(object *arguments) {
+  return h_numeric_vector_elementwise('+', arguments, "v+");
 }
 
-object *p_empty_environment(object *arguments) {
-  return the_empty_list;
+object *p_vsub(object *arguments) {
+  return h_numeric_vector_elementwise('-', arguments, "v-");
 }
 
-//  I/O
-//___________________________________//
+object *p_vmul(object *arguments) {
+  return h_numeric_vector_elementwise('*', arguments, "v*");
+}
 
-//  display
 
-object *p_display(object *arguments) {
-  while (!is_the_empty_list(arguments)) {
-    object *obj;
-    
-    obj = car(arguments);
-    switch (obj->type) {
-      case STRING:
-        printf("%s", obj->data.string);
-        break;
-      case CHARACTER:
-        printf("%c", obj->data.character);
-        break;
-      default:
-        write(obj);
+//  vmap
+//  (vmap procedure vec) applies procedure to every element.  abs, sqrt and
+//  - (negation) run as kernels, anything else is called on every element.
+//  The result is an f64vector when the elements become flonums.
+
+object *p_vmap(object *arguments) {
+  object *procedure = car(arguments);
+  object *vec = h_numeric_vector_argument(arguments, 1, "vmap");
+  long int length = vec->data.numeric_vector.length;
+  char kind = vec->data.numeric_vector.kind;
+  object *(*fn)(object *arguments) = NULL;
+  object *result;
+  object *promoted;
+  object *value;
+  double *x;
+  double *y;
+  long int i = 0;
+  long int j;
+
+  if (is_primitive_procedure(procedure)) {
+    fn = procedure->data.primitive_procedure.fn;
+  }
+
+  if (fn == p_sqrt || ((fn == p_abs || fn == p_sub) && kind == F64_VECTOR)) {
+    result = make_numeric_vector(F64_VECTOR, length);
+    if (kind != F64_VECTOR) {
+      for (i = 0; i < length; i++) {
+        result->data.numeric_vector.elements.f64[i] =
+          (kind == S64_VECTOR) ? vec->data.numeric_vector.elements.s64[i]
+                               : vec->data.numeric_vector.elements.u8[i];
+      }
+      vec = result;
     }
-    arguments = cdr(arguments);
+    x = vec->data.numeric_vector.elements.f64;
+    y = result->data.numeric_vector.elements.f64;
+    i = 0;
+#if defined(LISPY_SSE2)
+    // abs clears the sign bit and negation flips it
+    for (; i + 2 <= length; i += 2) {
+      __m128d v = _mm_loadu_pd(x + i);
+      __m128d sign = _mm_set1_pd(-0.0);
+      _mm_storeu_pd(y + i, fn == p_sqrt ? _mm_sqrt_pd(v) :
+                           fn == p_abs  ? _mm_andnot_pd(sign, v) :
+                                          _mm_xor_pd(sign, v));
+    }
+#endif
+    for (; i < length; i++) {
+      y[i] = fn == p_sqrt ? sqrt(x[i]) :
+             fn == p_abs  ? fabs(x[i]) :
+                            -x[i];
+    }
+    return result;
   }
-  return Void;
+
+  if (fn == p_abs || fn == p_sub) {
+    result = make_numeric_vector(kind, length);
+    for (i = 0; i < length; i++) {
+      if (kind == S64_VECTOR) {
+        result->data.numeric_vector.elements.s64[i] =
+          (fn == p_abs) ? labs(vec->data.numeric_vector.elements.s64[i])
+                        : -vec->data.numeric_vector.elements.s64[i];
+      }
+      else {
+        result->data.numeric_vector.elements.u8[i] =
+          (fn == p_abs) ? vec->data.numeric_vector.elements.u8[i]
+                        : -vec->data.numeric_vector.elements.u8[i];
+      }
+    }
+    return result;
+  }
+
+  result = make_numeric_vector(kind, length);
+  for (i = 0; i < length; i++) {
+    value = apply_procedure(procedure,
+                            cons(numeric_vector_ref(vec, i), the_empty_list));
+    // The first flonum makes the result an f64vector, wherever it comes
+    if (value->type == FLONUM &&
+        result->data.numeric_vector.kind != F64_VECTOR) {
+      promoted = make_numeric_vector(F64_VECTOR, length);
+      for (j = 0; j < i; j++) {
+        numeric_vector_set(promoted, j, numeric_vector_ref(result, j));
+      }
+      result = promoted;
+    }
+    numeric_vector_set(result, i, value);
+  }
+  return result;
 }
 
 
-//  print
-//  Same as display except it prints a newline after displaying all arguments
+//  Hash Table Procedures
+//___________________________________//
 
-object *p_print(object *arguments) {
-  p_display(arguments);
-  printf("\n");
-  return Void;
+object *h_hash_table_argument(object *arguments, char *name) {
+  if (!is_hash_table(car(arguments))) {
+    error("%s: expected a hash table", name);
+  }
+  return car(arguments);
 }
 
 
-//  load
+//  make-hash-table
+//  (make-hash-table [is?]) compares keys with equal?, or is? when given
 
-object *p_load(object *arguments) {
-  char *filename;
-  FILE *in;
-  object *exp;
-  object *result;
-  
-  filename = car(arguments)->data.string;
-  in = fopen(filename, "r");
-  if (in == NULL) {
-    error("could not load file \"%s\"", filename);
+object *p_make_hash_table(object *arguments) {
+  object *test;
+
+  if (arguments == the_empty_list) {
+    return make_hash_table(EQUAL_TABLE);
   }
-  while ((exp = lispy_read(in)) != NULL) {
-    result = eval(exp, the_global_environment);
+  test = car(arguments);
+  if (is_primitive_procedure(test) &&
+      test->data.primitive_procedure.fn == p_isp) {
+    return make_hash_table(IS_TABLE);
   }
-  fclose(in);
-  return result;
+  if (is_primitive_procedure(test) &&
+      test->data.primitive_procedure.fn == p_equalp) {
+    return make_hash_table(EQUAL_TABLE);
+  }
+  error("make-hash-table: keys can only be compared with is? or equal?");
 }
 
 
-//  List Procedures
-//___________________________________//
+//  hash-table
+//  (hash-table key value ...), also what #{key value ...} reads as
 
-//  null?
+object *p_hash_table(object *arguments) {
+  object *table = make_hash_table(EQUAL_TABLE);
 
-object *p_nullp(object *arguments) {
-  if (is_the_empty_list(car(arguments))) {
-    return True;}
-  else {return False;}
+  while (arguments != the_empty_list) {
+    if (cdr(arguments) == the_empty_list) {
+      error("hash-table: key without a value");
+    }
+    hash_table_set(table, car(arguments), cadr(arguments));
+    arguments = cddr(arguments);
+  }
+  return table;
 }
 
 
-//  cons
+//  hash-ref
+//  (hash-ref table key [default]) is default, or False, for a missing key
 
-object *p_cons(object *arguments) {
-  return cons(car(arguments), cadr(arguments));
+object *p_hash_ref(object *arguments) {
+  object *table = h_hash_table_argument(arguments, "hash-ref");
+  object *value = hash_table_get(table, cadr(arguments));
+
+  if (value != NULL) {
+    return value;
+  }
+  if (cddr(arguments) != the_empty_list) {
+    return caddr(arguments);
+  }
+  return False;
 }
 
 
-//  Equality Procedures
-//___________________________________//
+//  hash-set!
 
-//  is?
+object *p_hash_set(object *arguments) {
+  object *table = h_hash_table_argument(arguments, "hash-set!");
 
-object *p_isp(object *arguments) {
-  object *obj_1;
-  object *obj_2;
-  
-  obj_1 = car(arguments);
-  obj_2 = cadr(arguments);
-  
-  if (obj_1->type != obj_2->type) {
-    return False;
+  interpreter_changed();
+  hash_table_set(table, cadr(arguments), caddr(arguments));
+  return Void;
+}
+
+
+//  hash-remove!
+//  True if key was in the table
+
+object *p_hash_remove(object *arguments) {
+  object *table = h_hash_table_argument(arguments, "hash-remove!");
+
+  interpreter_changed();
+  return hash_table_remove(table, cadr(arguments)) ? True : False;
+}
+
+
+//  hash-contains?
+
+object *p_hash_containsp(object *arguments) {
+  object *table = h_hash_table_argument(arguments, "hash-contains?");
+
+  return (hash_table_find(table, cadr(arguments)) != -1) ? True : False;
+}
+
+
+//  hash-keys / hash-values
+
+object *p_hash_keys(object *arguments) {
+  object *entries = hash_table_entries(
+                      h_hash_table_argument(arguments, "hash-keys"));
+  object *lst;
+
+  for (lst = entries; lst != the_empty_list; lst = cdr(lst)) {
+    set_car(lst, car(car(lst)));
   }
-  
-  switch (obj_1->type) {
-    
-    case VOID:
-    case THE_EMPTY_LIST:
-      return True;
-      break;
-    
-    case FIXNUM:
-      return (obj_1->data.fixnum == 
-              obj_2->data.fixnum) ? 
-              True : False;
-      break;
-    
-    case FLONUM:
-      return (obj_1->data.flonum ==
-              obj_2->data.flonum) ?
-              True : False;
-      break;
-      
-    case CHARACTER:
-      return (obj_1->data.character ==
-              obj_2->data.character) ?
-              True : False;
-      break;
-    
-    case SYMBOL:
-      return (obj_1->data.symbol ==
-              obj_2->data.symbol) ?
-              True : False;
-      break;
-    
-    case PRIMITIVE_PROCEDURE:
-    case COMPOUND_PROCEDURE:
-    case BOOLEAN: 
-    case STRING:
-    case PAIR:
-    case VECTOR:
-      return (obj_1 == obj_2) ? True : False;
-      break;
+  return entries;
+}
+
+object *p_hash_values(object *arguments) {
+  object *entries = hash_table_entries(
+                      h_hash_table_argument(arguments, "hash-values"));
+  object *lst;
+
+  for (lst = entries; lst != the_empty_list; lst = cdr(lst)) {
+    set_car(lst, cdr(car(lst)));
   }
+  return entries;
 }
 
 
-//  equal?
+//  Persistent Collection Procedures
+//___________________________________//
 
-object *h_equalp(object *obj_1, object *obj_2) {
-  int count = 0;
-  object *result;
-  object *temp_1;
-  object *temp_2;
-  
-  if (obj_1->type != obj_2->type) {
-    return False;
+// The collection argument of name, which has to be transient or not as
+// transient says
+object *h_persistent_argument(object *arguments, char *name, char transient) {
+  object *coll = car(arguments);
+
+  if (!is_persistent_vector(coll) && !is_persistent_map(coll)) {
+    error("%s: expected a persistent vector or map", name);
+  }
+  if (is_transient(coll) != transient) {
+    error(transient ? "%s: expected a transient" :
+                      "%s: not on a transient", name);
   }
+  return coll;
+}
 
-  switch (obj_1->type) {
-    case VOID:
-    case THE_EMPTY_LIST:
-      return True;
-      break;
-    
-    case FIXNUM:
-      return (obj_1->data.fixnum == 
-              obj_2->data.fixnum) ? 
-              True : False;
-      break;
-    
-    case FLONUM:
-      return (obj_1->data.flonum ==
-              obj_2->data.flonum) ?
-              True : False;
-      break;
-      
-    case CHARACTER:
-      return (obj_1->data.character ==
-              obj_2->data.character) ?
-              True : False;
-      break;
-    
-    case SYMBOL:
-      return (obj_1->data.symbol ==
-              obj_2->data.symbol) ?
-              True : False;
-      break;
-    
-    case PRIMITIVE_PROCEDURE:
-    case COMPOUND_PROCEDURE:
-    case BOOLEAN:
-      return (obj_1 == obj_2) ? True : False;
-    
-    case STRING:
-      return !strcmp(obj_1->data.string, obj_2->data.string) ? 
-             True : False;
-      break;
-    
-    case PAIR:
-      if (h_length(obj_1)->data.fixnum != 
-          h_length(obj_2)->data.fixnum) {
-        return False;}
-      while (obj_1 != the_empty_list) {
-        if (h_equalp(car(obj_1), car(obj_2)) == True) {
-          obj_1 = cdr(obj_1);
-          obj_2 = cdr(obj_2);
-        }
-        else {
-          return False;
-        }
-      }
-      return True;
+long int h_persistent_index(object *vec, object *index, char *name) {
+  if (!is_fixnum(index) || index->data.fixnum < 0 ||
+      index->data.fixnum > vec->data.persistent_vector.length) {
+    error("%s: index out of range", name);
+  }
+  return index->data.fixnum;
+}
 
-    //BUG: Equal vectors do not compare equal.
-    case VECTOR:
-      printf("Count: %i\n", count);
-      if (obj_1->data.vector.length != obj_2->data.vector.length) {
-        return False;
-      }
-      while (count < obj_1->data.vector.length) {
-        if (h_equalp(obj_1->data.vector.vec[count],
-                     obj_2->data.vector.vec[count]) == False) {
-          //printf("Vector index %i not equal\n", count);
-          printf("Vector 1: "); write(obj_1->data.vector.vec[count]); printf("\n");
-          printf("Vector 2: "); write(obj_2->data.vector.vec[count]); printf("\n");
-          return False;
-        }
-        count += 1;
-      }
-      return True;
-      
-    default:
-      error("Unsupported types for equal?");
+
+//  persistent-vector / persistent-map
+
+object *p_persistent_vector(object *arguments) {
+  return persistent_vector_from_list(arguments);
+}
+
+object *p_persistent_map(object *arguments) {
+  object *map = make_transient(make_empty_persistent_map());
+
+  while (arguments != the_empty_list) {
+    if (cdr(arguments) == the_empty_list) {
+      error("persistent-map: key without a value");
+    }
+    persistent_map_set(map, car(arguments), cadr(arguments));
+    arguments = cddr(arguments);
   }
+  map->data.persistent_map.edit = NULL;
+  return map;
 }
 
-object *p_equalp(object *arguments) {
-  h_equalp(car(arguments), cadr(arguments));
+
+//  assoc / assoc!
+//  (assoc coll key value) binds key in a map, or sets the element at index
+//  key of a vector, where the index just past the end adds an element
+
+object *h_assoc(object *coll, object *key, object *value, char *name) {
+  long int index;
+
+  if (is_persistent_map(coll)) {
+    return persistent_map_set(coll, key, value);
+  }
+  index = h_persistent_index(coll, key, name);
+  if (index == coll->data.persistent_vector.length) {
+    return persistent_vector_push(coll, value);
+  }
+  return persistent_vector_set(coll, index, value);
 }
 
+object *p_assoc(object *arguments) {
+  return h_assoc(h_persistent_argument(arguments, "assoc", 0),
+                 cadr(arguments), caddr(arguments), "assoc");
+}
 
-//  not
+object *p_assoc_bang(object *arguments) {
+  interpreter_changed();
+  return h_assoc(h_persistent_argument(arguments, "assoc!", 1),
+                 cadr(arguments), caddr(arguments), "assoc!");
+}
 
-object *p_not(object *exp) {
-  return (car(exp) == False) ? True : False;
+
+//  dissoc / dissoc!
+
+object *h_dissoc(object *map, object *key, char *name) {
+  if (!is_persistent_map(map)) {
+    error("%s: expected a persistent map", name);
+  }
+  return persistent_map_remove(map, key);
 }
 
+object *p_dissoc(object *arguments) {
+  return h_dissoc(h_persistent_argument(arguments, "dissoc", 0),
+                  cadr(arguments), "dissoc");
+}
 
-//  Numeric Procedures
-//___________________________________//
+object *p_dissoc_bang(object *arguments) {
+  interpreter_changed();
+  return h_dissoc(h_persistent_argument(arguments, "dissoc!", 1),
+                  cadr(arguments), "dissoc!");
+}
 
-//  +
 
-object *h_numeric_add(object *obj_1, object *obj_2) {
-  switch (obj_1->type) {
-    case FLONUM:
-      switch (obj_2->type) {
-        case FLONUM:
-          return make_flonum(obj_1->data.flonum + obj_2->data.flonum);
-        case FIXNUM:
-          return make_flonum(obj_1->data.flonum + obj_2->data.fixnum);
-      }
-    case FIXNUM:
-      switch (obj_2->type) {
-        case FLONUM:
-          return make_flonum(obj_1->data.fixnum + obj_2->data.flonum);
-        case FIXNUM:
-          return make_fixnum(obj_1->data.fixnum + obj_2->data.fixnum);
-      }
+//  conj / conj!
+//  (conj coll x) adds x to the end of a vector, or the (key . value) pair x to
+//  a map
+
+object *h_conj(object *coll, object *x, char *name) {
+  if (is_persistent_vector(coll)) {
+    return persistent_vector_push(coll, x);
   }
+  if (!is_pair(x)) {
+    error("%s: expected a (key . value) pair", name);
+  }
+  return persistent_map_set(coll, car(x), cdr(x));
 }
-  
-object *h_add(object *obj_1, object *obj_2) {
-  char cbuffer[3];
-  
-  if ((obj_1->type == FIXNUM || obj_1->type == FLONUM) &&
-      (obj_2->type == FIXNUM || obj_2->type == FLONUM)) {
-    return h_numeric_add(obj_1, obj_2);
+
+object *p_conj(object *arguments) {
+  return h_conj(h_persistent_argument(arguments, "conj", 0),
+                cadr(arguments), "conj");
+}
+
+object *p_conj_bang(object *arguments) {
+  interpreter_changed();
+  return h_conj(h_persistent_argument(arguments, "conj!", 1),
+                cadr(arguments), "conj!");
+}
+
+
+//  get
+//  (get coll key [default]) is default, or False, for a missing key or an
+//  index out of range
+
+object *p_get(object *arguments) {
+  object *coll = car(arguments);
+  object *key = cadr(arguments);
+  object *value = NULL;
+
+  if (is_persistent_map(coll)) {
+    value = persistent_map_get(coll, key);
   }
-  
-  if (obj_1->type != obj_2->type) {
-    error("Types must match");
+  else if (is_hash_table(coll)) {
+    value = hash_table_get(coll, key);
   }
-  
-  if (obj_1->type == STRING) {
-    int l1 = strlen(obj_1->data.string);
-    int l2 = strlen(obj_2->data.string);
-    char sbuffer[l1+l2];
-    strcpy(sbuffer, obj_1->data.string);
-    strcat(sbuffer, obj_2->data.string);
-    return make_string(sbuffer);
+  else if (is_persistent_vector(coll)) {
+    if (is_fixnum(key) && key->data.fixnum >= 0 &&
+        key->data.fixnum < coll->data.persistent_vector.length) {
+      value = persistent_vector_ref(coll, key->data.fixnum);
+    }
   }
-  
-  if (obj_1->type == VECTOR) {
-    error("Addition on vectors not implemented yet");
+  else {
+    error("get: expected a persistent vector, map or hash table");
   }
-  
-  switch (obj_1->type) {
-    case CHARACTER:
-      cbuffer[0] = obj_1->data.character;
-      cbuffer[1] = obj_2->data.character;
-      cbuffer[2] = '\0';
-      return make_string(cbuffer);
+  if (value != NULL) {
+    return value;
   }
-}
-
-object *p_add(object *arguments) {
-  object *result = h_add(car(arguments), cadr(arguments));
-  arguments = cddr(arguments);
-  while (arguments != the_empty_list) {
-    result = h_add(result, car(arguments));
-    arguments = cdr(arguments);
+  if (cddr(arguments) != the_empty_list) {
+    return caddr(arguments);
   }
-  return result;
+  return False;
 }
 
 
-//  -
+//  transient / persistent!
+//  A transient is changed in place by assoc!, dissoc! and conj! until
+//  persistent! makes it persistent again, which takes constant time
 
-object *h_sub(object *obj_1, object *obj_2) {
-  switch (obj_1->type) {
-    case FLONUM:
-      switch (obj_2->type) {
-        case FLONUM:
-          return make_flonum(obj_1->data.flonum - obj_2->data.flonum);
-        case FIXNUM:
-          return make_flonum(obj_1->data.flonum - obj_2->data.fixnum);
-      }
-    case FIXNUM:
-      switch (obj_2->type) {
-        case FLONUM:
-          return make_flonum(obj_1->data.fixnum - obj_2->data.flonum);
-        case FIXNUM:
-          return make_fixnum(obj_1->data.fixnum - obj_2->data.fixnum);
-      }
-  }
+object *p_transient(object *arguments) {
+  return make_transient(h_persistent_argument(arguments, "transient", 0));
 }
 
-object *p_sub(object *arguments) {
-  object *result = h_sub(car(arguments), cadr(arguments));
-  arguments = cddr(arguments);
-  while (arguments != the_empty_list) {
-    result = h_sub(result, car(arguments));
-    arguments = cdr(arguments);
+object *p_persistent_bang(object *arguments) {
+  object *coll = h_persistent_argument(arguments, "persistent!", 1);
+
+  if (is_persistent_map(coll)) {
+    coll->data.persistent_map.edit = NULL;
   }
-  return result;
+  else {
+    coll->data.persistent_vector.tree->edit = NULL;
+  }
+  return coll;
 }
 
 
-//  *
+//  Meta-data Procedures
+//___________________________________//
 
-object *h_mul(object *obj_1, object *obj_2) {
-  switch (obj_1->type) {
-    case FLONUM:
-      switch (obj_2->type) {
-        case FLONUM:
-          return make_flonum(obj_1->data.flonum * obj_2->data.flonum);
-        case FIXNUM:
-          return make_flonum(obj_1->data.flonum * obj_2->data.fixnum);
-      }
-    case FIXNUM:
-      switch (obj_2->type) {
-        case FLONUM:
-          return make_flonum(obj_1->data.fixnum * obj_2->data.flonum);
-        case FIXNUM:
-          return make_fixnum(obj_1->data.fixnum * obj_2->data.fixnum);
-      }
-  }
-}
+//  doc
 
-object *p_mul(object *arguments) {
-  object *result = h_mul(car(arguments), cadr(arguments));
-  arguments = cddr(arguments);
-  while (arguments != the_empty_list) {
-    result = h_mul(result, car(arguments));
-    arguments = cdr(arguments);
-  }
-  return result;
+object *p_doc(object *arguments) {
+  return car(arguments)->data.compound_procedure.docstring;
 }
 
 
-//  /
 
+//  System Procedures
+//___________________________________//
 
-object *h_div(object *obj_1, object *obj_2) {
-  switch (obj_1->type) {
-    case FLONUM:
-      switch (obj_2->type) {
-        case FLONUM:
-          return make_flonum(obj_1->data.flonum / obj_2->data.flonum);
-        case FIXNUM:
-          return make_flonum(obj_1->data.flonum / obj_2->data.fixnum);
-      }
-    case FIXNUM:
-      switch (obj_2->type) {
-        case FLONUM:
-          return make_flonum(obj_1->data.fixnum / obj_2->data.flonum);
-        case FIXNUM:
-          return (obj_1->data.fixnum % obj_2->data.fixnum) ?
-            make_flonum(obj_1->data.fixnum / (double) obj_2->data.fixnum) :
-            make_fixnum(obj_1->data.fixnum / obj_2->data.fixnum);
-      }
-  }
-}
+//  time
 
-object *p_div(object *arguments) {
-  object *result = h_div(car(arguments), cadr(arguments));
-  arguments = cddr(arguments);
-  while (arguments != the_empty_list) {
-    result = h_div(result, car(arguments));
-    arguments = cdr(arguments);
-  }
-  return result;
+object *p_time(object *arguments) {
+  return make_fixnum(time(NULL));
 }
 
+//  sleep
+//  (sleep seconds) only parks the current task once tasks are running
 
-//  >
+void green_sleep(double seconds);
 
-object *h_greater_than(object *obj_1, object *obj_2) {
-  if (obj_1->type != obj_2->type) {
-    error("Types must match");
+object *p_sleep(object *arguments) {
+  object *seconds = car(arguments);
+  double duration;
+  
+  if (is_fixnum(seconds)) {
+    duration = seconds->data.fixnum;
   }
-
-  if (obj_1->type == BOOLEAN) {
-    if (obj_1 == obj_2) {return False;}
-    else if (obj_1 == True) {return True;}
-    else if (obj_1 == False) {return False;}
+  else if (is_flonum(seconds)) {
+    duration = seconds->data.flonum;
   }
-
-  else if (obj_1->type == FIXNUM) {
-    return (obj_1->data.fixnum > obj_2->data.fixnum) ?
-            True : False;
+  else {
+    error("sleep: expected a number of seconds");
   }
+  flush_output();
+  green_sleep(duration);
+  return Void;
+}
 
-  else if (obj_1->type == FLONUM) {
-    return (obj_1->data.flonum > obj_2->data.flonum) ?
-            True : False;
-  }
+//  m-seconds
 
-  else if (obj_1->type == CHARACTER) {
-    return (obj_1->data.character > obj_2->data.character) ?
-            True : False;
-  }
+object *p_m_seconds(object *arguments) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return make_flonum(tv.tv_sec + (tv.tv_usec / 1000000.0));
+}
+
+// system
+
+object *p_system(object *args) {
+  int retval;
   
-  else if (obj_1->type == SYMBOL) {
-    return (strcmp(obj_1->data.symbol, 
-                   obj_2->data.symbol) == 1) ?
-            True : False;
-  }
+  // The child writes straight to the terminal, so our output has to go first
+  flush_output();
+  retval = system(string_to_c(car(args)));
+  return make_fixnum(retval);
+}
 
-  else if (obj_1->type == STRING) {
-    return (strcmp(obj_1->data.string, 
-                   obj_2->data.string) == 1) ?
-            True : False;
-  }
 
-  else if (obj_1->type == PAIR) {
-    if (h_length(obj_1)->data.fixnum == h_length(obj_2)->data.fixnum) {
-      while (obj_1 != the_empty_list) {
-        if (h_equalp(car(obj_1), car(obj_2)) == True) {
-          obj_1 = cdr(obj_1);
-          obj_2 = cdr(obj_2);
-        }
-        else if (h_greater_than(car(obj_1), car(obj_2)) == True) {
-          return True;
-        }
-        else {
-          return False;
-        }
-      }
-      return False;
-    }
-    
-    else if (h_length(obj_1)->data.fixnum > h_length(obj_2)->data.fixnum) {
-      return True;
+//  Cursors
+//___________________________________//
+// for and the comprehensions walk a sequence through a cursor that lives on
+// the C stack and keeps its place in the sequence's own storage, so a step
+// allocates nothing but the element it returns: a character of a string, a
+// number of a numeric vector or range or the (key . value) entry of a hash
+// table or persistent map.
+//
+// Hash tables are walked live, so a table changed inside the loop may have
+// entries skipped or seen twice.
+
+typedef struct {
+  object *seq;
+  object *list;                           // pairs left of a list
+  long int index;                         // next element, byte or slot
+  long int end;
+  object **leaf;                          // of a persistent vector at index
+  hamt_node *nodes[HAMT_MAX_DEPTH];       // of a persistent map, root first
+  int positions[HAMT_MAX_DEPTH];          // next slot in each of nodes
+  int depth;
+} cursor;
+
+void cursor_init(cursor *c, object *seq) {
+  c->seq = seq;
+  c->index = 0;
+  switch (seq->type) {
+    case THE_EMPTY_LIST:
+    case PAIR:
+      c->list = seq;
+      break;
+    case STRING:
+      c->end = seq->data.string.length;
+      break;
+    case VECTOR:
+      c->end = seq->data.vector.length;
+      break;
+    case NUMERIC_VECTOR:
+      c->end = seq->data.numeric_vector.length;
+      break;
+    case PERSISTENT_VECTOR:
+      c->end = seq->data.persistent_vector.length;
+      c->leaf = NULL;
+      break;
+    case RANGE:
+      c->end = range_length(seq);
+      break;
+    case HASH_TABLE:
+      break;
+    case PERSISTENT_MAP:
+      c->end = seq->data.persistent_map.count;
+      c->nodes[0] = seq->data.persistent_map.root;
+      c->positions[0] = 0;
+      c->depth = 1;
+      break;
+    default:
+      error("Unsupported type for iteration");
+  }
+}
+
+char cursor_done(cursor *c);
+object *cursor_next(cursor *c);
+
+// The elements of any sequence as a list, which is a list itself
+object *h_sequence_list(object *seq) {
+  object *result = the_empty_list;
+  object *tail = NULL;
+  object *pair;
+  cursor c;
+  
+  if (is_pair(seq) || seq == the_empty_list) {
+    return seq;
+  }
+  cursor_init(&c, seq);
+  while (!cursor_done(&c)) {
+    pair = cons(cursor_next(&c), the_empty_list);
+    if (tail == NULL) {
+      result = pair;
     }
     else {
-      return False;
+      set_cdr(tail, pair);
     }
+    tail = pair;
   }
+  return result;
+}
 
-  else if (obj_1->type == VECTOR) {
-    error("> on vectors not implemented yet");
-  }
+char cursor_done(cursor *c) {
+  object *seq = c->seq;
 
+  switch (seq->type) {
+    case THE_EMPTY_LIST:
+    case PAIR:
+      return !is_pair(c->list);
+    case VECTOR:
+      // Elements popped inside the loop are gone
+      return c->index >= c->end || c->index >= seq->data.vector.length;
+    case HASH_TABLE:
+      while (c->index < seq->data.hash_table.slots->capacity &&
+             seq->data.hash_table.slots->control[c->index] < 0) {
+        c->index += 1;
+      }
+      return c->index >= seq->data.hash_table.slots->capacity;
+    default:
+      return c->index >= c->end;
+  }
 }
 
-object *p_greater_than(object *arguments) {
-  return h_greater_than(car(arguments), cadr(arguments));
-}
+// The next (key . value) entry of a persistent map, depth first
+object *cursor_next_entry(cursor *c) {
+  hamt_node *node;
+  int position;
 
+  while (1) {
+    node = c->nodes[c->depth - 1];
+    position = c->positions[c->depth - 1];
+    if (position < hamt_entry_slots(node, (c->depth - 1) * HAMT_BITS)) {
+      c->positions[c->depth - 1] += 2;
+      return cons(node->slots[position], node->slots[position + 1]);
+    }
+    if (position < node->size) {
+      c->positions[c->depth - 1] += 1;
+      c->nodes[c->depth] = node->slots[position];
+      c->positions[c->depth] = 0;
+      c->depth += 1;
+    }
+    else {
+      c->depth -= 1;
+    }
+  }
+}
 
-//  <
+// The next element, which cursor_done has said there is
+object *cursor_next(cursor *c) {
+  object *seq = c->seq;
+  object *item;
+  long int index = c->index;
 
-object *h_less_than(object *obj_1, object *obj_2) {
-  if (obj_1->type != obj_2->type) {
-    error("Types must match");
+  c->index += 1;
+  switch (seq->type) {
+    case THE_EMPTY_LIST:
+    case PAIR:
+      item = car(c->list);
+      c->list = cdr(c->list);
+      return item;
+    case STRING:
+      c->index = index + utf8_size(seq->data.string.chars[index]);
+      return make_character(utf8_decode(seq->data.string.chars + index));
+    case VECTOR:
+      return seq->data.vector.vec[index];
+    case NUMERIC_VECTOR:
+      return numeric_vector_ref(seq, index);
+    case PERSISTENT_VECTOR:
+      index += seq->data.persistent_vector.start;
+      if (c->leaf == NULL || (index & PV_MASK) == 0) {
+        c->leaf = pv_tree_leaf(seq->data.persistent_vector.tree, index);
+      }
+      return c->leaf[index & PV_MASK];
+    case RANGE:
+      return range_ref(seq, index);
+    case HASH_TABLE:
+      return cons(seq->data.hash_table.slots->entries[2 * index],
+                  seq->data.hash_table.slots->entries[2 * index + 1]);
+    default:                                          // PERSISTENT_MAP
+      return cursor_next_entry(c);
   }
+}
 
-  if (obj_1->type == BOOLEAN) {
-    if (obj_1 == obj_2) {return True;}
-    else if (obj_1 == True) {return False;}
-    else if (obj_1 == False) {return True;}
-  }
 
-  else if (obj_1->type == FIXNUM) {
-    return (obj_1->data.fixnum < obj_2->data.fixnum) ?
-            True : False;
+//  Sequence Constructors / Comprehensions
+//___________________________________//
+// A comprehension is turned into a loop once, before its first element.  The
+// loop variable is bound in one frame whose value is replaced for every
+// element, and the test and body are evaluated in it directly.  A body that
+// names a procedure, like (list for x in xs square), has the procedure
+// called on each element instead.
+//
+// Once a body or test has captured the frame, by making a procedure or a
+// future or by defining something, which env_captures counts, the next
+// element gets a new frame so each capture keeps its own value.
+
+typedef struct {
+  object *procedure;                      // called on the element, or NULL
+  object *body;                           // evaluated, or NULL for the element
+} loop_clause;
+
+typedef struct {
+  cursor seq;
+  object *env;
+  object *var;                            // NULL for from comprehensions
+  object *frame;                          // env with var bound, reused
+  char frame_captured;                    // so the next element needs a new one
+  char has_test;
+  loop_clause test;
+  loop_clause body;
+} comprehension;
+
+// Call procedure on one argument, without building a call form when the
+// procedure is a primitive or takes a single parameter
+object *apply_procedure_1(object *procedure, object *arg) {
+  object *parameters;
+  object *body;
+  object *env;
+  object *result = Void;
+  
+  if (is_primitive_procedure(procedure)) {
+    return (procedure->data.primitive_procedure.fn)(cons(arg,
+                                                         the_empty_list));
   }
-
-  else if (obj_1->type == FLONUM) {
-    return (obj_1->data.flonum < obj_2->data.flonum) ?
-            True : False;
+  parameters = procedure->data.compound_procedure.parameters;
+  if (!is_pair(parameters) || cdr(parameters) != the_empty_list ||
+      car(parameters) == rest_symbol) {
+    return apply_procedure(procedure, cons(arg, the_empty_list));
   }
-
-  else if (obj_1->type == CHARACTER) {
-    return (obj_1->data.character < obj_2->data.character) ?
-            True : False;
+  env = extend_environment(parameters, cons(arg, the_empty_list),
+                           procedure->data.compound_procedure.env);
+  for (body = procedure->data.compound_procedure.body;
+       body != the_empty_list; body = cdr(body)) {
+    result = eval(car(body), env);
   }
+  return result;
+}
 
-  else if (obj_1->type == SYMBOL) {
-    return (strcmp(obj_1->data.symbol, 
-                   obj_2->data.symbol) == -1) ?
-            True : False;
-  }
+void loop_clause_init(loop_clause *clause, object *exps, object *var,
+                      object *env) {
+  object *exp = car(exps);
+  object *procedure;
   
-  else if (obj_1->type == STRING) {
-    return (strcmp(obj_1->data.string, 
-                   obj_2->data.string) == -1) ?
-            True : False;
+  clause->procedure = NULL;
+  clause->body = exps;
+  if (cdr(exps) != the_empty_list) {
+    return;
   }
-  
-  else if (obj_1->type == PAIR) {
-    if (h_length(obj_1)->data.fixnum == h_length(obj_2)->data.fixnum) {
-      while (obj_1 != the_empty_list) {
-        if (h_equalp(car(obj_1), car(obj_2)) == True) {
-          obj_1 = cdr(obj_1);
-          obj_2 = cdr(obj_2);
-        }
-        else if (h_less_than(car(obj_1), car(obj_2)) == True) {
-          return True;
-        }
-        else {
-          return False;
-        }
-      }
-      return False;
-    }
-    
-    else if (h_length(obj_1)->data.fixnum < h_length(obj_2)->data.fixnum) {
-      return True;
-    }
-    else {
-      return False;
+  if (exp == var) {
+    clause->body = NULL;
+  }
+  else if (is_lambda(exp) || is_symbol(exp) || (var == NULL && is_pair(exp))) {
+    procedure = eval(exp, env);
+    if (is_primitive_procedure(procedure) ||
+        is_compound_procedure(procedure)) {
+      clause->procedure = procedure;
     }
   }
+}
 
-  else if (obj_1->type == VECTOR) {
-    error("< on vectors not implemented yet");
+object *loop_clause_eval(loop_clause *clause, object *item, object *env) {
+  object *body;
+  object *result = Void;
+  
+  if (clause->procedure != NULL) {
+    return apply_procedure_1(clause->procedure, item);
   }
-
+  if (clause->body == NULL) {
+    return item;
+  }
+  for (body = clause->body; body != the_empty_list; body = cdr(body)) {
+    result = eval(car(body), env);
+  }
+  return result;
 }
 
-object *p_less_than(object *arguments) {
-  return h_less_than(car(arguments), cadr(arguments));
+// exp is (var in sequence [if test] body ...)
+void comprehension_for(comprehension *c, object *exp, object *env) {
+  c->env = env;
+  c->var = car(exp);
+  exp = cddr(exp);
+  cursor_init(&c->seq, eval(car(exp), env));
+  exp = cdr(exp);
+  c->has_test = (car(exp) == if_symbol);
+  c->frame_captured = 0;
+  if (c->has_test) {
+    loop_clause_init(&c->test, cons(cadr(exp), the_empty_list), c->var, env);
+    exp = cddr(exp);
+  }
+  loop_clause_init(&c->body, exp, c->var, env);
+  c->frame = extend_environment(cons(c->var, the_empty_list),
+                                cons(Void, the_empty_list), env);
+}
+
+// exp is (sequence [if test]), where test is a procedure
+void comprehension_from(comprehension *c, object *exp, object *env) {
+  c->env = env;
+  c->var = NULL;
+  cursor_init(&c->seq, eval(car(exp), env));
+  c->has_test = (cdr(exp) != the_empty_list);
+  c->frame_captured = 0;
+  if (c->has_test) {
+    loop_clause_init(&c->test, cddr(exp), NULL, env);
+  }
+  c->body.procedure = NULL;
+  c->body.body = NULL;
+}
+
+// Find the next element that passes the test and set value to the body's
+// value for it.  Returns 0 when the sequence is finished.
+char comprehension_next(comprehension *c, object **value) {
+  object *item;
+  object *env = c->env;
+  unsigned long int captures;
+  char passed;
+  
+  while (!cursor_done(&c->seq)) {
+    item = cursor_next(&c->seq);
+    if (c->var != NULL && c->frame_captured) {
+      c->frame = extend_environment(cons(c->var, the_empty_list),
+                                    cons(item, the_empty_list), c->env);
+      c->frame_captured = 0;
+      env = c->frame;
+    }
+    else if (c->var != NULL) {
+      set_car(frame_values(current_environment(c->frame)), item);
+      env = c->frame;
+    }
+    captures = env_captures;
+    passed = !c->has_test || loop_clause_eval(&c->test, item, env) == True;
+    if (passed) {
+      *value = loop_clause_eval(&c->body, item, env);
+    }
+    c->frame_captured = (env_captures != captures);
+    if (passed) {
+      return 1;
+    }
+  }
+  return 0;
 }
 
 
-//  >=
+//  pfor
+//  (list pfor x in sequence [if test] body ...) and (vector pfor ...) are
+//  comprehensions whose elements are split into chunks that a pool of worker
+//  threads, one per core, and the calling thread take in turn.  Each value
+//  goes into its element's place, so the order is kept.  Short sequences and
+//  pfors inside a pfor run on the calling thread alone.
+//
+//  The body runs on several threads at once, so it should not print, define
+//  globals or change anything another element's body uses.
+
+#define PFOR_MIN_ELEMENTS      64
+#define PFOR_CHUNKS_PER_THREAD 4
+
+typedef struct {
+  interpreter *interpreter;
+  comprehension *c;
+  object **items;
+  object **values;                        // NULL where the test failed
+  long int count;
+  long int chunk;
+  long int next;                          // first element of the next chunk
+  int active;                             // threads working on the job
+  int failed;
+  object *message;                        // of the first error
+} pfor_job;
+
+// Set while a thread runs part of a pfor
+__thread char in_pfor;
+
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t pool_idle = PTHREAD_COND_INITIALIZER;
+pfor_job *pool_job;
+long int pool_generation;
+int pool_size = -1;                       // worker threads, -1 until started
+
+
+void pfor_run_chunk(pfor_job *job, long int start) {
+  comprehension *c = job->c;
+  long int end = start + job->chunk;
+  object *env;
+  long int i;
+  
+  if (end > job->count) {
+    end = job->count;
+  }
+  for (i = start; i < end && !job->failed; i++) {
+    env = extend_environment(cons(c->var, the_empty_list),
+                             cons(job->items[i], the_empty_list), c->env);
+    if (c->has_test &&
+        loop_clause_eval(&c->test, job->items[i], env) != True) {
+      continue;
+    }
+    job->values[i] = loop_clause_eval(&c->body, job->items[i], env);
+  }
+}
 
-object *h_greater_than_or_eq(object *obj_1, object *obj_2) {
-  if (h_equalp(obj_1, obj_2) == True) {
-    return True;
+// Take chunks of job until there are none left
+void pfor_run(pfor_job *job) {
+  jmp_buf recover;
+  jmp_buf *outer = recover_point;
+  long int start;
+  
+  current_interpreter = job->interpreter;
+  recover_point = &recover;
+  in_pfor = 1;
+  if (setjmp(recover) == 0) {
+    while ((start = __atomic_fetch_add(&job->next, job->chunk,
+                                       __ATOMIC_RELAXED)) < job->count) {
+      pfor_run_chunk(job, start);
+    }
   }
-  else {
-    return h_greater_than(obj_1, obj_2);
+  else if (__atomic_exchange_n(&job->failed, 1, __ATOMIC_ACQ_REL) == 0) {
+    job->message = make_string(error_message);
   }
+  in_pfor = 0;
+  recover_point = outer;
 }
 
-object *p_greater_than_or_eq(object *arguments) {
-  return h_greater_than_or_eq(car(arguments), cadr(arguments));
+void *pool_worker(void *arg) {
+  long int seen = 0;
+  pfor_job *job;
+  
+  pthread_mutex_lock(&pool_lock);
+  while (1) {
+    while (pool_job == NULL || pool_generation == seen) {
+      pthread_cond_wait(&pool_wake, &pool_lock);
+    }
+    job = pool_job;
+    seen = pool_generation;
+    job->active += 1;
+    pthread_mutex_unlock(&pool_lock);
+    
+    pfor_run(job);
+    
+    pthread_mutex_lock(&pool_lock);
+    job->active -= 1;
+    if (job->active == 0) {
+      pthread_cond_signal(&pool_idle);
+    }
+  }
+  return NULL;
 }
 
+void pool_start(void) {
+  pthread_t thread;
+  long int cores = sysconf(_SC_NPROCESSORS_ONLN);
+  
+  pool_size = 0;
+  while (pool_size < cores - 1 &&
+         pthread_create(&thread, NULL, pool_worker, NULL) == 0) {
+    pthread_detach(thread);
+    pool_size += 1;
+  }
+}
 
-//  <=
+// Run job on the pool, with the calling thread taking chunks too
+void pfor_parallel(pfor_job *job) {
+  pthread_mutex_lock(&pool_lock);
+  if (pool_size == -1) {
+    pool_start();
+  }
+  job->chunk = job->count / ((pool_size + 1) * PFOR_CHUNKS_PER_THREAD) + 1;
+  pool_job = job;
+  pool_generation += 1;
+  pthread_cond_broadcast(&pool_wake);
+  pthread_mutex_unlock(&pool_lock);
+  
+  pfor_run(job);
+  
+  // Workers that have not picked the job up by now never will
+  pthread_mutex_lock(&pool_lock);
+  pool_job = NULL;
+  while (job->active > 0) {
+    pthread_cond_wait(&pool_idle, &pool_lock);
+  }
+  pthread_mutex_unlock(&pool_lock);
+}
 
-object *h_less_than_or_eq(object *obj_1, object *obj_2) {
-  if (h_equalp(obj_1, obj_2) == True) {
-    return True;
+// The values of the comprehension exp, NULL where the test failed, with
+// their number in count
+object **pfor_values(object *exp, object *env, long int *count) {
+  comprehension c;
+  pfor_job *job = GC_MALLOC(sizeof(pfor_job));
+  long int capacity = 64;
+  
+  if (job == NULL) {
+    error("out of memory\n");
+  }
+  comprehension_for(&c, exp, env);
+  job->interpreter = current_interpreter;
+  job->c = &c;
+  job->items = GC_MALLOC(capacity * sizeof(object *));
+  while (!cursor_done(&c.seq)) {
+    if (job->count == capacity) {
+      capacity *= 2;
+      job->items = GC_REALLOC(job->items, capacity * sizeof(object *));
+    }
+    if (job->items == NULL) {
+      error("out of memory\n");
+    }
+    job->items[job->count++] = cursor_next(&c.seq);
+  }
+  job->values = GC_MALLOC((job->count + 1) * sizeof(object *));
+  if (job->values == NULL) {
+    error("out of memory\n");
+  }
+  
+  if (job->count < PFOR_MIN_ELEMENTS || in_pfor) {
+    job->chunk = job->count;
+    pfor_run_chunk(job, 0);
   }
   else {
-    return h_less_than(obj_1, obj_2);
+    pfor_parallel(job);
+    if (job->failed) {
+      error("pfor: %s", string_to_c(job->message));
+    }
   }
+  *count = job->count;
+  return job->values;
 }
 
-object *p_less_than_or_eq(object *arguments) {
-  return h_less_than_or_eq(car(arguments), cadr(arguments));
+object *h_list_pfor(object *exp, object *env) {
+  object *result = the_empty_list;
+  long int count;
+  object **values = pfor_values(exp, env, &count);
+  
+  while (count-- > 0) {
+    if (values[count] != NULL) {
+      result = cons(values[count], result);
+    }
+  }
+  return result;
 }
 
-
-//  **
-
-object *p_pow(object *args) {
-  object *o = car(args);
-  object *p = cadr(args);
-  switch (o->type) {
-    case FIXNUM:
-      switch (p->type) {
-        case FIXNUM:
-          return make_fixnum(pow(o->data.fixnum, p->data.fixnum));
-        case FLONUM:
-          return make_flonum(pow(o->data.fixnum, p->data.flonum));
-      }
-    case FLONUM:
-      switch (p->type) {
-        case FIXNUM:
-          return make_flonum(pow(o->data.flonum, p->data.fixnum));
-        case FLONUM:
-          return make_flonum(pow(o->data.flonum, p->data.flonum));
-      }
+object *h_vector_pfor(object *exp, object *env) {
+  object *result = make_vector(0, the_empty_list);
+  long int count;
+  object **values = pfor_values(exp, env, &count);
+  long int i;
+  
+  for (i = 0; i < count; i++) {
+    if (values[i] != NULL) {
+      vector_push(result, values[i]);
+    }
   }
+  return result;
 }
 
 
-//  abs
+//  for
 
-object *p_abs(object *args) {
-  object *o = car(args);
-  switch (o->type) {
-    case FIXNUM:
-      return make_fixnum(labs(o->data.fixnum));
-    case FLONUM:
-      return make_flonum(fabs(o->data.flonum));
+object *h_for(object *exp, object *env) {
+  comprehension c;
+  object *value;
+  object *result = Void;
+  
+  comprehension_for(&c, exp, env);
+  while (comprehension_next(&c, &value)) {
+    result = value;
   }
+  return result;
 }
 
 
-//  sqrt
+//  list
+//  Comprehensions add each value at the end of the list as they go
 
-object *p_sqrt(object *args) {
-  object *o = car(args);
-  switch (o->type) {
-    case FIXNUM:
-      return make_flonum(sqrt(o->data.fixnum));
-    case FLONUM:
-      return make_flonum(sqrt(o->data.flonum));
+object *h_list_comprehension(comprehension *c) {
+  object *head = the_empty_list;
+  object *tail = NULL;
+  object *pair;
+  object *value;
+  
+  while (comprehension_next(c, &value)) {
+    pair = cons(value, the_empty_list);
+    if (tail == NULL) {
+      head = pair;
+    }
+    else {
+      set_cdr(tail, pair);
+    }
+    tail = pair;
   }
+  return head;
 }
 
-
-//  Type Procedures
-//___________________________________//
-
-//  type
-
-object *h_type(object *obj) {
+object *h_list_for(object *exp, object *env) {
+  comprehension c;
   
-  switch (obj->type) {
-    case THE_EMPTY_LIST:
-      return cons(make_string("'()"), the_empty_list);
-    
-    case BOOLEAN:
-      return cons(make_string("boolean"), the_empty_list);
-      
-    case CHARACTER:
-      return cons(make_string("character"), the_empty_list);
-      
-    case SYMBOL:
-      return cons(make_string("symbol"), the_empty_list);
-      
-    case FIXNUM:
-      return cons(make_string("number"), cons(make_string("integer"), the_empty_list));
-    
-    case FLONUM:
-      return cons(make_string("number"), cons(make_string("float"), the_empty_list));
-
-    case PRIMITIVE_PROCEDURE:
-      return cons(make_string("procedure"), cons(make_string("primitive"), the_empty_list));
-    
-    case COMPOUND_PROCEDURE:
-      return cons(make_string("procedure"), cons(make_string("compound"), the_empty_list));
- 
-    case STRING:
-      return cons(make_string("sequence"), cons(make_string("string"), the_empty_list));
-    
-    case PAIR:
-      return cons(make_string("sequence"), cons(make_string("pair"), the_empty_list));
+  comprehension_for(&c, exp, env);
+  return h_list_comprehension(&c);
+}
 
-    case VECTOR:
-      return cons(make_string("sequence"), cons(make_string("vector"), the_empty_list));
+object *h_list_from(object *exp, object *env) {
+  comprehension c;
+  
+  comprehension_from(&c, exp, env);
+  return h_list_comprehension(&c);
+}
+
+object *h_list(object *exp, object *env) {
+  // (list for ii in sequence if test expression) || (list for ii in sequence expression)
+  if (car(exp) == for_symbol) {
+    return h_list_for(cdr(exp), env);
+  }
+  // (list from sequence if test) || (list from sequence)
+  else if (car(exp) == from_symbol) {
+    return h_list_from(cdr(exp), env);
+  }
+  // (list pfor ii in sequence if test expression) || (list pfor ii in sequence expression)
+  else if (car(exp) == pfor_symbol) {
+    return h_list_pfor(cdr(exp), env);
+  }
+  else {
+    return list_of_values(exp, env);
   }
 }
 
-object *p_type(object *arguments) {
-  h_type(car(arguments));
+object *p_list(object *exp) {
+  error("list dummy procedure should not execute!");
 }
 
 
-//  type?
+//  string
 
-object *p_typep(object *arguments) {
-  h_equalp(h_type(car(arguments)), h_type(cadr(arguments)));
+object *h_string(object *exp, object *env) {
+  if (car(exp) == from_symbol) {
+    return make_string_from_list(h_list_from(cdr(exp), env));
+  }
+  else if (car(exp) == for_symbol) {
+    return make_string_from_list(h_list_for(cdr(exp), env));
+  }
+  else {
+    return make_string_from_list(list_of_values(exp, env));
+  }
 }
 
+object *p_string(object *exp) {
+  error("string dummy procedure should not execute!");
+}
 
-//  ->string
 
-object *h_to_string(object *obj) {
-  char buf[100];                  // is this a large enough buffer?  auto-calc size?
-  char cbuf[2];
-  int count = 0;
+//  vector
+//  Comprehensions push onto the vector as they go instead of building a list
+
+object *h_vector_comprehension(comprehension *c) {
+  object *result = make_vector(0, the_empty_list);
+  object *value;
   
-  switch (obj->type) {
-    case FIXNUM:
-      sprintf(buf, "%ld", obj->data.fixnum);
-      return make_string(buf);
-      break;
-    case FLONUM:
-      sprintf(buf, "%f", obj->data.flonum);
-      return make_string(buf);
-      break;
-    case CHARACTER:
-      cbuf[0] = obj->data.character;
-      cbuf[1] = '\0';
-      return make_string(cbuf);
-      break;
-    case SYMBOL:
-      return make_string(obj->data.symbol);
-      break;
-    case PAIR:  // Should return "(a b c)" for (->string '(#\a #\b #\c))
-      while (obj != the_empty_list) {
-        buf[count] = car(obj)->data.character;
-        obj = cdr(obj);
-        count++;
-      }
-      buf[count] = '\0';
-      return make_string(buf);
-      break;
-    case VECTOR:
-      error("->string on vectors not implemented yet");
-      break;
+  while (comprehension_next(c, &value)) {
+    vector_push(result, value);
   }
+  return result;
 }
 
-object *p_to_string(object *arguments) {
-  return h_to_string(car(arguments));
+object *h_vector_for(object *exp, object *env) {
+  comprehension c;
+  
+  comprehension_for(&c, exp, env);
+  return h_vector_comprehension(&c);
 }
 
+object *h_vector_from(object *exp, object *env) {
+  comprehension c;
+  
+  comprehension_from(&c, exp, env);
+  return h_vector_comprehension(&c);
+}
 
-//  ->number
-
-object *h_to_number(object *obj) {
-  switch (obj->type) {
-    case STRING:
-      if (strchr(obj->data.string, '.')) {
-        return make_flonum(atof(obj->data.string));
-      }
-      else if (strchr(obj->data.string, '/')) {
-        error("Rational numbers not implemented yet");
-      }
-      else {
-        return make_fixnum(atol(obj->data.string));
-      }
-      break;
-    case CHARACTER:
-      return make_fixnum(obj->data.character);
-      break;
-    default:
-      error("Unsupported type for ->number");
-      break;
+object *h_vector(object *exp, object *env) {
+  object *result;
+  long int count = 0;
+  
+  if (car(exp) == from_symbol) {
+    return h_vector_from(cdr(exp), env);
+  }
+  else if (car(exp) == for_symbol) {
+    return h_vector_for(cdr(exp), env);
+  }
+  else if (car(exp) == pfor_symbol) {
+    return h_vector_pfor(cdr(exp), env);
+  }
+  result = make_vector(h_length(exp)->data.fixnum, the_empty_list);
+  while (exp != the_empty_list) {
+    result->data.vector.vec[count] = eval(car(exp), env);
+    exp = cdr(exp);
+    count += 1;
   }
+  return result;
 }
 
-object *p_to_number(object *arguments) {
-  return h_to_number(car(arguments));
+object *p_vector(object *exp) {
+  error("vector dummy procedure should not execute!");
 }
 
 
-//  ->char
+//  make-vector
+//  (make-vector length [fill])
 
-object *h_to_char(object *obj) {
-  object *char_list = the_empty_list;
-  int len;
+object *p_make_vector(object *arguments) {
+  object *fill = the_empty_list;
   
-  switch (obj->type) {
-    case FIXNUM:
-      return make_character(obj->data.fixnum);
-      break;
-    case STRING:
-      len = strlen(obj->data.string) - 1;
-      while (len > -1) {
-        char_list = cons(make_character(obj->data.string[len]), char_list);
-        len--;
-      }
-      return char_list;
-      break;
-    default:
-      error("Unsupported type for ->char");
-      break;
+  if (car(arguments)->type != FIXNUM || car(arguments)->data.fixnum < 0) {
+    error("make-vector: length must be a non-negative fixnum");
   }
+  if (cdr(arguments) != the_empty_list) {
+    fill = cadr(arguments);
+  }
+  return make_vector(car(arguments)->data.fixnum, fill);
 }
 
-object *p_to_char(object *arguments) {
-  return h_to_char(car(arguments));
-}
 
+//  vector-push!
+//  (vector-push! vector obj) adds obj to the end of vector, growing it
 
-//  Sequence Procedures
-//___________________________________//
+object *p_vector_push(object *arguments) {
+  if (car(arguments)->type != VECTOR) {
+    error("vector-push!: expected a vector");
+  }
+  interpreter_changed();
+  vector_push(car(arguments), cadr(arguments));
+  return Void;
+}
 
-//  first
 
-object *h_first(object *seq) {
-  switch (seq->type) {
-    case PAIR:
-      return car(seq);
-      break;
-    case STRING:
-      return make_character(seq->data.string[0]);
-      break;
-    case VECTOR:
-      return seq->data.vector.vec[0];
-      break;
-    default:
-      error("Unsupported type for first");
-      break;
+//  vector-pop!
+//  (vector-pop! vector) removes and returns the last element of vector
+
+object *p_vector_pop(object *arguments) {
+  object *vec = car(arguments);
+  object *value;
+  
+  if (vec->type != VECTOR) {
+    error("vector-pop!: expected a vector");
+  }
+  if (vec->data.vector.length == 0) {
+    error("vector-pop!: empty vector");
+  }
+  interpreter_changed();
+  vec->data.vector.length -= 1;
+  value = vec->data.vector.vec[vec->data.vector.length];
+  // Let the collector have the element, unless the storage is shared
+  if (vec->data.vector.capacity != 0 &&
+      vec->data.vector.length >= vec->data.vector.viewed) {
+    vec->data.vector.vec[vec->data.vector.length] = NULL;
   }
+  return value;
 }
 
-object *p_first(object *arguments) {
-  return h_first(car(arguments));
+
+//  range
+//  (range stop), (range start stop) or (range start stop step) makes a range,
+//  which takes the same space however long it is; (list from range) makes
+//  its elements into a list
+
+object *p_range(object *args) {
+  long int start = 0;
+  long int stop;
+  long int step = 1;
+  object *arg;
+  
+  for (arg = args; arg != the_empty_list; arg = cdr(arg)) {
+    if (!is_fixnum(car(arg))) {
+      error("range: bounds must be fixnums");
+    }
+  }
+  if (cdr(args) == the_empty_list) {
+    stop = car(args)->data.fixnum;
+  }
+  else {
+    start = car(args)->data.fixnum;
+    stop = cadr(args)->data.fixnum;
+    if (cddr(args) != the_empty_list) {
+      step = caddr(args)->data.fixnum;
+    }
+  }
+  if (step == 0) {
+    error("range: step can not be 0");
+  }
+  if (range_count(start, stop, step) > LONG_MAX) {
+    error("range: too many elements");
+  }
+  return make_range(start, stop, step);
 }
 
 
-//  rest
 
-object *h_rest(object *seq) {
-  switch (seq->type) {
-    case PAIR:
-      return cdr(seq);
-      break;
-    case STRING:
-      return make_string(&seq->data.string[1]);
-      break;
-    case VECTOR:
-      return make_vector_from_vector(seq, 1, seq->data.vector.length);
-      //error("rest on vectors not implemented yet");
-      break;
-    default:
-      error("Unsupported type for rest");
-      break;
+//  Futures
+//___________________________________//
+// (future exp) returns at once with a future that a worker thread may
+// evaluate exp for in the meantime, and (touch future) waits for and
+// returns its value.  Each worker, and the REPL thread, pushes the futures
+// it makes onto the bottom of its own deque and takes work back from the
+// bottom, so recursive code runs depth first on every core.  An idle
+// worker steals from the top of a random deque, where the oldest and
+// usually largest pieces of work are.
+//
+// The deques are Chase-Lev deques: the owner pushes and pops without locks
+// and only competes with thieves, through a compare and swap on top, for the
+// last element.
+//
+// A future nobody has started is evaluated by the thread touching it.  One
+// that another thread is running is waited for by running other futures.
+
+typedef struct {
+  long int size;                          // a power of two
+  object *tasks[];
+} task_array;
+
+typedef struct {
+  long int top;
+  long int bottom;
+  task_array *array;
+} task_deque;
+
+#define TASK_DEQUE_SIZE 256
+#define TASK_EMPTY      NULL
+#define TASK_ABORT      ((object *) 1)
+
+task_deque **task_deques;                 // the REPL thread's, then workers'
+int task_deque_count;                     // 0 until the workers start
+task_deque *main_deque;
+__thread task_deque *own_deque;           // NULL on threads that are not
+                                          // the REPL thread or a worker
+__thread unsigned int steal_seed;
+
+// Futures in deques, and workers waiting for one
+long int queued_futures;
+int sleeping_workers;
+pthread_mutex_t future_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t future_wake = PTHREAD_COND_INITIALIZER;
+
+task_array *make_task_array(long int size) {
+  task_array *array = GC_MALLOC(sizeof(task_array) + size * sizeof(object *));
+  
+  if (array == NULL) {
+    error("out of memory\n");
   }
+  array->size = size;
+  return array;
 }
 
-object *p_rest(object *arguments) {
-  return h_rest(car(arguments));
+task_deque *make_task_deque(void) {
+  task_deque *deque = GC_MALLOC(sizeof(task_deque));
+  
+  if (deque == NULL) {
+    error("out of memory\n");
+  }
+  deque->array = make_task_array(TASK_DEQUE_SIZE);
+  return deque;
 }
 
+// Only the owner pushes
+void task_push(task_deque *deque, object *task) {
+  long int bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  long int top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  task_array *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+  task_array *bigger;
+  long int i;
+  
+  if (bottom - top >= array->size) {
+    // Thieves still reading the old array keep it alive
+    bigger = make_task_array(2 * array->size);
+    for (i = top; i < bottom; i++) {
+      bigger->tasks[i & (bigger->size - 1)] = array->tasks[i & (array->size - 1)];
+    }
+    __atomic_store_n(&deque->array, bigger, __ATOMIC_RELEASE);
+    array = bigger;
+  }
+  __atomic_store_n(&array->tasks[bottom & (array->size - 1)], task,
+                   __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
 
-//  next
-
-object *h_next(object *seq) {
-  object *temp;
-  switch (seq->type) {
-    case PAIR:
-      temp = car(seq);
-      if (cdr(seq) == the_empty_list) {
-        seq->type = THE_EMPTY_LIST;
-        return temp;
-      }
-      seq->data.pair.car = cadr(seq);
-      seq->data.pair.cdr = cddr(seq);
-      return temp;
-    case STRING:
-      error("next not implemented on strings");
-      break;
-    case VECTOR:
-      error("next not implemented on vectors");
-      break;
-    default:
-      if (h_emptyp(seq) == True) {
-        return seq;
+// Only the owner pops, from the same end it pushes to
+object *task_pop(task_deque *deque) {
+  long int bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  task_array *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+  long int top;
+  object *task = TASK_EMPTY;
+  
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+  if (top <= bottom) {
+    task = __atomic_load_n(&array->tasks[bottom & (array->size - 1)],
+                           __ATOMIC_RELAXED);
+    if (top == bottom) {
+      // The last task, which a thief may be taking too
+      if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        task = TASK_EMPTY;
       }
-      error("Unsupported type for rest");
-      break;
+      __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+  }
+  else {
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
   }
+  return task;
 }
 
-object *p_next(object *args) {
-  return h_next(car(args));
+// Any thread steals, from the other end.  TASK_ABORT when another thread
+// took the task first.
+object *task_steal(task_deque *deque) {
+  long int top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  long int bottom;
+  task_array *array;
+  object *task = TASK_EMPTY;
+  
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+  if (top < bottom) {
+    array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+    task = __atomic_load_n(&array->tasks[top & (array->size - 1)],
+                           __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      return TASK_ABORT;
+    }
+  }
+  return task;
+}
+
+// A future taken out of a deque, from the thread's own or stolen, or NULL
+object *task_find(void) {
+  object *task;
+  int count = __atomic_load_n(&task_deque_count, __ATOMIC_ACQUIRE);
+  int start;
+  int i;
+  
+  if (own_deque != NULL && (task = task_pop(own_deque)) != TASK_EMPTY) {
+    __atomic_sub_fetch(&queued_futures, 1, __ATOMIC_SEQ_CST);
+    return task;
+  }
+  if (count == 0) {
+    return NULL;
+  }
+  start = rand_r(&steal_seed) % count;
+  for (i = 0; i < count; i++) {
+    do {
+      task = task_steal(task_deques[(start + i) % count]);
+    } while (task == TASK_ABORT);
+    if (task != TASK_EMPTY) {
+      __atomic_sub_fetch(&queued_futures, 1, __ATOMIC_SEQ_CST);
+      return task;
+    }
+  }
+  return NULL;
+}
+
+// Evaluate future unless another thread already started it
+void future_run(object *future) {
+  int state = FUTURE_PENDING;
+  jmp_buf recover;
+  jmp_buf *outer = recover_point;
+  interpreter *outer_interpreter = current_interpreter;
+  
+  if (!__atomic_compare_exchange_n(&future->data.future.state, &state,
+                                   FUTURE_RUNNING, 0, __ATOMIC_ACQ_REL,
+                                   __ATOMIC_RELAXED)) {
+    return;
+  }
+  current_interpreter = future->data.future.interpreter;
+  recover_point = &recover;
+  if (setjmp(recover) == 0) {
+    future->data.future.value = eval(future->data.future.exp,
+                                     future->data.future.env);
+    __atomic_store_n(&future->data.future.state, FUTURE_DONE,
+                     __ATOMIC_RELEASE);
+  }
+  else {
+    // The value of a failed future is its error message
+    future->data.future.value = make_string(error_message);
+    __atomic_store_n(&future->data.future.state, FUTURE_FAILED,
+                     __ATOMIC_RELEASE);
+  }
+  recover_point = outer;
+  current_interpreter = outer_interpreter;
+}
+
+void *future_worker(void *deque) {
+  object *task;
+  
+  own_deque = deque;
+  steal_seed = (uintptr_t) deque;
+  while (1) {
+    if ((task = task_find()) != NULL) {
+      future_run(task);
+      continue;
+    }
+    // A pusher that misses this increment has its future seen below
+    __atomic_add_fetch(&sleeping_workers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&future_lock);
+    while (__atomic_load_n(&queued_futures, __ATOMIC_SEQ_CST) == 0) {
+      pthread_cond_wait(&future_wake, &future_lock);
+    }
+    pthread_mutex_unlock(&future_lock);
+    __atomic_sub_fetch(&sleeping_workers, 1, __ATOMIC_SEQ_CST);
+  }
+  return NULL;
 }
 
+// Start a worker for every core but the REPL thread's.  Called with
+// future_lock held.
+void futures_start(void) {
+  long int cores = sysconf(_SC_NPROCESSORS_ONLN);
+  task_deque **deques = GC_MALLOC((cores + 1) * sizeof(task_deque *));
+  pthread_t thread;
+  int count = 1;
+  
+  if (deques == NULL) {
+    error("out of memory\n");
+  }
+  deques[0] = main_deque;
+  while (count < cores) {
+    deques[count] = make_task_deque();
+    if (pthread_create(&thread, NULL, future_worker, deques[count]) != 0) {
+      break;
+    }
+    pthread_detach(thread);
+    count += 1;
+  }
+  task_deques = deques;
+  __atomic_store_n(&task_deque_count, count, __ATOMIC_RELEASE);
+}
 
-//  empty?
 
-object *h_emptyp(object *obj) {
-  switch (obj->type) {
-    case THE_EMPTY_LIST:
-      return True;
-      break;
+//  future
+//  (future exp)
 
-    case STRING:
-      if (!strcmp(obj->data.string, "")) {  // strcmp returns 0 if equal
-        return True;
-      }
-      break;
-      
-    case VECTOR:
-      if (obj->data.vector.length == 0) {
-        return True;
-      }
-      return False;
-      break;
+object *h_future(object *exp, object *env) {
+  object *future = make_future(car(exp), env);
+  
+  if (__atomic_load_n(&task_deque_count, __ATOMIC_ACQUIRE) == 0) {
+    pthread_mutex_lock(&future_lock);
+    if (task_deque_count == 0) {
+      futures_start();
+    }
+    pthread_mutex_unlock(&future_lock);
   }
-  return False;
+  // Threads without a deque leave the future to whoever touches it
+  if (own_deque == NULL) {
+    return future;
+  }
+  task_push(own_deque, future);
+  __atomic_add_fetch(&queued_futures, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&sleeping_workers, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&future_lock);
+    pthread_cond_signal(&future_wake);
+    pthread_mutex_unlock(&future_lock);
+  }
+  return future;
 }
 
-object *p_emptyp(object *arguments) {
-  return h_emptyp(car(arguments));
-}
 
+//  touch
+//  (touch future) is the value of future's expression, (touch task) the
+//  value its thunk returned, and anything else is itself
 
-//  length
+object *h_touch_task(object *task);
 
-object *h_length(object *obj) {
-  int count = 1;
+object *p_touch(object *arguments) {
+  object *future = car(arguments);
+  object *task;
+  int state;
   
-  if (obj == the_empty_list) {
-    return make_fixnum(0);
+  if (is_task(future)) {
+    return h_touch_task(future);
   }
-  else if (obj->type == PAIR) {
-    while (cdr(obj) != the_empty_list) {
-      count += 1;
-      obj = cdr(obj);
+  if (!is_future(future)) {
+    return future;
+  }
+  future_run(future);
+  while ((state = __atomic_load_n(&future->data.future.state,
+                                  __ATOMIC_ACQUIRE)) == FUTURE_RUNNING) {
+    if ((task = task_find()) != NULL) {
+      future_run(task);
+    }
+    else {
+      sched_yield();
     }
-    return make_fixnum(count);
   }
-  else if (obj->type == STRING) {
-    return make_fixnum(strlen(obj->data.string));
+  if (state == FUTURE_FAILED) {
+    error("touch: %s", string_to_c(future->data.future.value));
+  }
+  return future->data.future.value;
+}
+
+
+//  pmap
+//  (pmap f sequence [:workers n]) is the list of f applied to each element,
+//  computed by n worker processes, one per core by default.  Workers are
+//  forked on the first call and kept for later ones, sharing the parent's
+//  memory copy-on-write.  Each is sent f and a chunk of the elements as a
+//  FASL record over a pipe and sends back their values the same way, and the
+//  chunks are put back together in order.
+//
+//  So that f sees the program as it was at the call, the global definitions
+//  and set!s made since a worker last heard from the parent go with its next
+//  request.  Workers are forked again after something is changed in place,
+//  by a procedure like hash-set! or vector-push!, or when the definitions
+//  can not be sent.  Whatever f changes stays in the worker.
+
+#define PMAP_MAX_WORKERS 256
+
+typedef struct {
+  pid_t pid;
+  FILE *requests;                         // to the worker
+  FILE *results;                          // from the worker
+  object *seen;                           // the changes it has been sent
+} pmap_worker;
+
+pmap_worker pmap_workers[PMAP_MAX_WORKERS];
+int pmap_worker_count;
+interpreter *pmap_interpreter;            // the workers were forked from
+long int pmap_generation;                 // of the interpreter at the time
+pthread_mutex_t pmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Write obj to stream as one FASL record, built whole first so an error
+// part way leaves nothing half written
+void pmap_send(FILE *stream, object *obj) {
+  object *record = make_port(NULL, STRING_PORT);
+  
+  fasl_write(record, obj);
+  if (fwrite(record->data.port.buffer, 1, record->data.port.length,
+             stream) != record->data.port.length || fflush(stream) != 0) {
+    error("pmap: a worker has exited");
+  }
+}
+
+// Only the forking thread lives on in a worker, so forget the others and
+// any locks they held
+void pmap_child_reset(void) {
+  pthread_mutex_init(&symbol_lock, NULL);
+  pthread_mutex_init(&pool_lock, NULL);
+  pthread_mutex_init(&future_lock, NULL);
+  pthread_mutex_init(&pmap_lock, NULL);
+  pthread_mutex_init(&ports_lock, NULL);
+  pool_size = -1;
+  pool_job = NULL;
+  task_deque_count = 0;
+  queued_futures = 0;
+  sleeping_workers = 0;
+  main_deque = make_task_deque();
+  own_deque = main_deque;
+  pmap_worker_count = 0;
+  current_interpreter->changes = NULL;
+}
+
+// A worker answers each (changes f . elements) with (True . values), or
+// (False . message) when f raised an error, until the parent closes the
+// pipe.  The changes are (var . val) global definitions, oldest first.
+void pmap_worker_loop(FILE *requests, FILE *results) {
+  jmp_buf recover;
+  object *request;
+  object *reply;
+  object *values;
+  object *item;
+  int c;
+  
+  recover_point = &recover;
+  while (1) {
+    if (setjmp(recover) != 0) {
+      reply = cons(False, make_string(error_message));
+    }
+    else {
+      if ((c = getc(requests)) == EOF) {
+        _exit(0);
+      }
+      ungetc(c, requests);
+      request = fasl_read(requests);
+      for (item = car(request); item != the_empty_list; item = cdr(item)) {
+        define_variable(caar(item), cdar(item),
+                        current_interpreter->global_environment);
+      }
+      request = cdr(request);
+      values = the_empty_list;
+      for (item = cdr(request); item != the_empty_list; item = cdr(item)) {
+        values = cons(apply_procedure_1(car(request), car(item)), values);
+      }
+      reply = cons(True, h_reverse(values));
+    }
+    flush_output();
+    pmap_send(results, reply);
   }
-  else if (obj->type == VECTOR) {
-    return make_fixnum(obj->data.vector.length);
+}
+
+void pmap_stop(void) {
+  int i;
+  
+  for (i = 0; i < pmap_worker_count; i++) {
+    fclose(pmap_workers[i].requests);
+    fclose(pmap_workers[i].results);
+    waitpid(pmap_workers[i].pid, NULL, 0);
   }
-  else {
-    error("Unsupported type for length");
+  if (pmap_worker_count > 0) {
+    __atomic_store_n(&pmap_interpreter->changes, NULL, __ATOMIC_RELEASE);
   }
+  pmap_worker_count = 0;
 }
 
-object *p_length(object *arguments) {
-  h_length(car(arguments));
+void pmap_start(int count) {
+  int requests[2];
+  int results[2];
+  object *seen;
+  pid_t pid;
+  int i;
+  
+  // A worker that has exited shows up as a failed write instead
+  signal(SIGPIPE, SIG_IGN);
+  // Or the workers would print what is still buffered too
+  flush_output();
+  // Definitions from here on are kept, since a worker may be forked before
+  // or after them
+  if (pmap_worker_count == 0) {
+    __atomic_store_n(&current_interpreter->changes, the_empty_list,
+                     __ATOMIC_RELEASE);
+  }
+  while (pmap_worker_count < count) {
+    if (pipe(requests) != 0) {
+      error("pmap: could not make a pipe");
+    }
+    if (pipe(results) != 0) {
+      close(requests[0]);
+      close(requests[1]);
+      error("pmap: could not make a pipe");
+    }
+    seen = __atomic_load_n(&current_interpreter->changes, __ATOMIC_ACQUIRE);
+    GC_atfork_prepare();
+    pid = fork();
+    if (pid == 0) {
+      GC_atfork_child();
+      for (i = 0; i < pmap_worker_count; i++) {
+        fclose(pmap_workers[i].requests);
+        fclose(pmap_workers[i].results);
+      }
+      close(requests[1]);
+      close(results[0]);
+      pmap_child_reset();
+      pmap_worker_loop(fdopen(requests[0], "r"), fdopen(results[1], "w"));
+    }
+    GC_atfork_parent();
+    close(requests[0]);
+    close(results[1]);
+    if (pid < 0) {
+      close(requests[1]);
+      close(results[0]);
+      error("pmap: could not fork a worker");
+    }
+    pmap_workers[pmap_worker_count].pid = pid;
+    pmap_workers[pmap_worker_count].seen = seen;
+    pmap_workers[pmap_worker_count].requests = fdopen(requests[1], "w");
+    pmap_workers[pmap_worker_count].results = fdopen(results[0], "r");
+    pmap_worker_count += 1;
+  }
+  pmap_interpreter = current_interpreter;
+  pmap_generation = current_interpreter->generation;
 }
 
+// Whether every change logged since the workers were forked can be sent,
+// which values like ports can not
+char pmap_changes_writable(object *changes) {
+  object *scratch = make_port(NULL, STRING_PORT);
+  jmp_buf recover;
+  jmp_buf *outer = recover_point;
 
-//  index
+  if (changes == the_empty_list) {
+    return 1;
+  }
+  recover_point = &recover;
+  if (setjmp(recover) != 0) {
+    recover_point = outer;
+    return 0;
+  }
+  fasl_write(scratch, changes);
+  recover_point = outer;
+  return 1;
+}
 
-object *h_index_list(object *lst, int start, int end, int rev) {
-  int count = 0;
-  object *sublist = the_empty_list;
-  
-  // Find first index
-  while (count != start) {
-    count += 1;
-    lst = cdr(lst);
+// The changes from the newest down to seen, oldest first
+object *pmap_unseen(object *changes, object *seen) {
+  object *unseen = the_empty_list;
+
+  for (; changes != seen; changes = cdr(changes)) {
+    unseen = cons(car(changes), unseen);
   }
+  return unseen;
+}
+
+// The values of f over the count elements of items, from workers workers
+object *pmap_run(object *f, object **items, long int count, int workers) {
+  object *result = the_empty_list;
+  object *tail = NULL;
+  object *changes;
+  object *chunk;
+  object *reply;
+  long int start;
+  long int end;
+  int i;
   
-  // If we're only getting one index
-  if (start == end) {
-    return car(lst);
+  changes = __atomic_load_n(&current_interpreter->changes, __ATOMIC_ACQUIRE);
+  if (pmap_worker_count > 0 &&
+      (pmap_interpreter != current_interpreter ||
+       pmap_generation != current_interpreter->generation ||
+       !pmap_changes_writable(changes))) {
+    pmap_stop();
   }
+  if (pmap_worker_count < workers) {
+    pmap_start(workers);
+  }
+  changes = __atomic_load_n(&current_interpreter->changes, __ATOMIC_ACQUIRE);
   
-  // If we're getting a sublist
-  else {
-    while (count != end) {
-      sublist = cons(car(lst), sublist);
-      count += 1;
-      lst = cdr(lst);
+  // Every request goes out before any result is read, so the workers run
+  // at the same time
+  for (i = workers - 1; i >= 0; i--) {
+    chunk = the_empty_list;
+    start = count * i / workers;
+    for (end = count * (i + 1) / workers; end > start; end--) {
+      chunk = cons(items[end - 1], chunk);
     }
-    if (rev) {
-      return sublist;
+    pmap_send(pmap_workers[i].requests,
+              cons(pmap_unseen(changes, pmap_workers[i].seen),
+                   cons(f, chunk)));
+    pmap_workers[i].seen = changes;
+  }
+  // Once every worker has been sent the whole log it can start again
+  for (i = 0; i < pmap_worker_count && pmap_workers[i].seen == changes; i++) {
+  }
+  if (i == pmap_worker_count && changes != the_empty_list &&
+      __atomic_compare_exchange_n(&current_interpreter->changes, &changes,
+                                  the_empty_list, 0, __ATOMIC_RELEASE,
+                                  __ATOMIC_RELAXED)) {
+    for (i = 0; i < pmap_worker_count; i++) {
+      pmap_workers[i].seen = the_empty_list;
+    }
+  }
+  // The lists read are new, so the chunks are joined in place
+  for (i = 0; i < workers; i++) {
+    reply = fasl_read(pmap_workers[i].results);
+    if (car(reply) == False) {
+      error("%s", string_to_c(cdr(reply)));
+    }
+    if (cdr(reply) == the_empty_list) {
+      continue;
+    }
+    if (tail == NULL) {
+      result = cdr(reply);
     }
     else {
-      return h_reverse(sublist);
+      set_cdr(tail, cdr(reply));
+    }
+    for (tail = cdr(reply); cdr(tail) != the_empty_list; tail = cdr(tail)) {
     }
   }
+  return result;
 }
 
-object *h_index_string(object *string, int start, int end, int rev) {
-  char buffer[start - end + 1];
-  char revbuffer[start - end + 1];
-  int count = 0;
-  int revcount = 0;
+object *h_pmap(object *exp, object *env) {
+  object *f = eval(car(exp), env);
+  object **items;
+  object *n;
+  object *result;
+  cursor seq;
+  long int count = 0;
+  long int capacity = 64;
+  long int workers = sysconf(_SC_NPROCESSORS_ONLN);
+  jmp_buf recover;
+  jmp_buf *outer = recover_point;
   
-  if (start == end) {
-    return make_character(string->data.string[start]);
+  cursor_init(&seq, eval(cadr(exp), env));
+  exp = cddr(exp);
+  if (exp != the_empty_list) {
+    if (car(exp) != workers_keyword || cdr(exp) == the_empty_list) {
+      error("pmap: expected :workers n");
+    }
+    n = eval(cadr(exp), env);
+    if (!is_fixnum(n) || n->data.fixnum < 1) {
+      error("pmap: :workers must be a positive fixnum");
+    }
+    workers = n->data.fixnum;
   }
   
-  else {
-    while (start != end) {
-      buffer[count] = string->data.string[start];
-      start += 1;
-      count += 1;
+  items = GC_MALLOC(capacity * sizeof(object *));
+  while (!cursor_done(&seq)) {
+    if (count == capacity) {
+      capacity *= 2;
+      items = GC_REALLOC(items, capacity * sizeof(object *));
+    }
+    if (items == NULL) {
+      error("out of memory\n");
     }
-    buffer[count] = '\0';
+    items[count++] = cursor_next(&seq);
   }
-  if (rev) {
-   count -= 1;
-   while (count != -1) {
-     revbuffer[revcount] = buffer[count];
-     revcount += 1;
-     count -= 1;
-   }
-   revbuffer[revcount] = '\0';
-   return make_string(revbuffer);
+  if (workers > count) {
+    workers = count;
+  }
+  if (workers > PMAP_MAX_WORKERS) {
+    workers = PMAP_MAX_WORKERS;
+  }
+  if (workers == 0) {
+    return the_empty_list;
+  }
+  
+  // The pool is shared by every thread and interpreter.  An error must let
+  // go of it, and leaves the workers out of step, so they are stopped.
+  pthread_mutex_lock(&pmap_lock);
+  recover_point = &recover;
+  if (setjmp(recover) == 0) {
+    result = pmap_run(f, items, count, workers);
   }
   else {
-    return make_string(buffer);
+    pmap_stop();
+    pthread_mutex_unlock(&pmap_lock);
+    recover_point = outer;
+    error("pmap: %s", string_to_c(make_string(error_message)));
   }
+  pthread_mutex_unlock(&pmap_lock);
+  recover_point = outer;
+  return result;
 }
 
-object *p_index(object *obj) {
-  int start = cadr(obj)->data.fixnum;
-  int end;
-  object *sequence = car(obj);
-  int len = h_length(sequence)->data.fixnum;
-  int rev = 0;
+
+//  Tasks
+//___________________________________//
+// (spawn thunk) starts a task, a green thread that calls thunk on a stack
+// of its own.  Tasks take turns on the thread of the interpreter that
+// spawned them: one runs until it yields, sleeps, or waits for a channel or
+// another task, and then the first task in the ready queue runs.  So
+// thousands of tasks polling or waiting on timers cost no OS threads, and
+// nothing a task does is interrupted by another.
+//
+// The code that spawned the first task, the REPL or a host's call into
+// lispy.h, is the root task, running on the thread's own stack.  Tasks only
+// run while it yields or waits too.
+//
+// A task is switched out with swapcontext.  The collector only knows about
+// the stack the thread is running on, so it is moved to each task's stack
+// as the task is switched in, and the stacks of the tasks switched out are
+// pushed as extra roots.  Stopping the world is held off while switching,
+// when neither is true.
+
+#define TASK_STACK_SIZE (1024 * 1024)     // mostly never touched
+#define TASK_GUARD_SIZE 4096              // overflowing runs into this
+
+typedef struct green_task {
+  ucontext_t context;
+  struct green_scheduler *scheduler;
+  char *stack;                            // NULL for the root task
+  void *sp;                               // while switched out
+  void *stack_top;
+  jmp_buf *recover_point;                 // while switched out
+  object *task;                           // the TASK it runs
+  object *thunk;
+  double wake;                            // while sleeping
+  struct green_task *next;                // in the queue it is waiting in
+  struct green_task *live_prev;
+  struct green_task *live_next;
+} green_task;
+
+typedef struct green_queue {
+  green_task *head;
+  green_task *tail;
+} green_queue;
+
+typedef struct green_scheduler {
+  green_task root;
+  green_task *current;
+  green_queue ready;
+  green_task **sleeping;                  // a heap ordered by wake
+  long int sleeping_count;
+  long int sleeping_capacity;
+  green_task *dead;                       // stacks to free
+  char deadlock;                          // set when switching to root
+                                          // because nothing can run
+  void *gc_thread;                        // to move the stack bottom
+  pthread_t thread;
+} green_scheduler;
+
+// Every task's stack in the process.  Only changed with the collector's
+// lock held, since it reads it while collecting.
+green_task *live_tasks;
+GC_push_other_roots_proc green_push_previous;
+pthread_once_t green_roots_once = PTHREAD_ONCE_INIT;
+
+green_queue *make_green_queue(void) {
+  green_queue *queue = GC_MALLOC(sizeof(green_queue));
   
-  if (start < 0) {
-    start = len + start;
+  if (queue == NULL) {
+    error("out of memory\n");
   }
+  return queue;
+}
 
-  // If end argument is not supplied set end to start
-  if (cddr(obj) != the_empty_list) {
-    end = caddr(obj)->data.fixnum;
+void green_queue_push(green_queue *queue, green_task *task) {
+  task->next = NULL;
+  if (queue->tail == NULL) {
+    queue->head = task;
   }
   else {
-    end = start;
+    queue->tail->next = task;
   }
-  
-  // Normalize negative end and add one so that (index lst 0 -1) returns whole list
-  if (end < 0) {
-    end = len + end + 1;
-  } 
+  queue->tail = task;
+}
 
-  // Check that list indices are within range
-  if (start > len || end > len || start < 0 || end < 0) {
-    error("List index out of range");
+green_task *green_queue_pop(green_queue *queue) {
+  green_task *task = queue->head;
+  
+  if (task != NULL) {
+    queue->head = task->next;
+    if (queue->head == NULL) {
+      queue->tail = NULL;
+    }
+    task->next = NULL;
   }
+  return task;
+}
 
-  // If start > end: swap start & end and set rev to a non-negative value
-  // BUG: (index lst -1 0) should return the full list
-  //      now it returns '(2 1) if lst = '(1 2 3)
-  if (start > end) {
-    rev = start;
-    start = end;
-    end = rev;
+void green_queue_remove(green_queue *queue, green_task *task) {
+  green_task *previous = NULL;
+  green_task *t;
+  
+  for (t = queue->head; t != NULL; previous = t, t = t->next) {
+    if (t == task) {
+      if (previous == NULL) {
+        queue->head = t->next;
+      }
+      else {
+        previous->next = t->next;
+      }
+      if (queue->tail == t) {
+        queue->tail = previous;
+      }
+      t->next = NULL;
+      return;
+    }
   }
+}
 
-  switch (car(obj)->type) {
-    case PAIR:
-      return h_index_list(sequence, start, end, rev);
-      break;
-    case STRING:
-      return h_index_string(sequence, start, end, rev);
-      break;
-    case VECTOR:
-      error("index on vectors not implemented yet");
-      break;
-    default:
-      error("Unsupported type for index");
-      break;
+// Make every task waiting in queue ready
+void green_wake_all(green_scheduler *sched, green_queue *queue) {
+  green_task *task;
+  
+  while ((task = green_queue_pop(queue)) != NULL) {
+    green_queue_push(&sched->ready, task);
   }
 }
 
-//  Meta-data Procedures
-//___________________________________//
-
-//  doc
-
-object *p_doc(object *arguments) {
-  return car(arguments)->data.compound_procedure.docstring;
+void green_wake_one(green_scheduler *sched, green_queue *queue) {
+  green_task *task = green_queue_pop(queue);
+  
+  if (task != NULL) {
+    green_queue_push(&sched->ready, task);
+  }
 }
 
+double green_now(void) {
+  struct timespec now;
+  
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1000000000.0;
+}
 
-
-//  System Procedures
-//___________________________________//
-
-//  time
-
-object *p_time(object *arguments) {
-  return make_fixnum(time(NULL));
+void green_nanosleep(double seconds) {
+  struct timespec duration;
+  
+  if (seconds <= 0) {
+    return;
+  }
+  duration.tv_sec = (time_t) seconds;
+  duration.tv_nsec = (long) ((seconds - duration.tv_sec) * 1000000000.0);
+  while (nanosleep(&duration, &duration) != 0) {
+  }
 }
 
-//  sleep
+void green_sleeping_push(green_scheduler *sched, green_task *task) {
+  green_task **heap;
+  long int i = sched->sleeping_count;
+  
+  if (i == sched->sleeping_capacity) {
+    sched->sleeping_capacity = (i == 0) ? 64 : 2 * i;
+    sched->sleeping = GC_REALLOC(sched->sleeping,
+                                 sched->sleeping_capacity * sizeof(green_task *));
+    if (sched->sleeping == NULL) {
+      error("out of memory\n");
+    }
+  }
+  heap = sched->sleeping;
+  for (; i > 0 && heap[(i - 1) / 2]->wake > task->wake; i = (i - 1) / 2) {
+    heap[i] = heap[(i - 1) / 2];
+  }
+  heap[i] = task;
+  sched->sleeping_count += 1;
+}
 
-object *p_sleep(object *arguments) {
-  sleep(car(arguments)->data.fixnum);
-  return Void;
+green_task *green_sleeping_pop(green_scheduler *sched) {
+  green_task **heap = sched->sleeping;
+  green_task *first = heap[0];
+  green_task *last = heap[--sched->sleeping_count];
+  long int count = sched->sleeping_count;
+  long int i = 0;
+  long int child;
+  
+  while ((child = 2 * i + 1) < count) {
+    if (child + 1 < count && heap[child + 1]->wake < heap[child]->wake) {
+      child += 1;
+    }
+    if (heap[child]->wake >= last->wake) {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
+  return first;
 }
 
-//  m-seconds
+// The collector calls this with the thread it scans stopped, and every
+// stack of it but the one it runs on is pushed here
+void green_push_roots(void) {
+  green_task *task;
+  
+  for (task = live_tasks; task != NULL; task = task->live_next) {
+    if (task->sp != NULL) {
+      GC_push_all(task->sp, task->stack_top);
+    }
+  }
+  if (green_push_previous != NULL) {
+    green_push_previous();
+  }
+}
 
-object *p_m_seconds(object *arguments) {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return make_flonum(tv.tv_sec + (tv.tv_usec / 1000000.0));
+void green_roots_install(void) {
+  green_push_previous = GC_get_push_other_roots();
+  GC_set_push_other_roots(green_push_roots);
 }
 
-// system
+void *green_live_add(void *task) {
+  green_task *t = task;
+  
+  t->live_prev = NULL;
+  t->live_next = live_tasks;
+  if (live_tasks != NULL) {
+    live_tasks->live_prev = t;
+  }
+  live_tasks = t;
+  return NULL;
+}
 
-object *p_system(object *args) {
-  int retval = system(car(args)->data.string);
-  return make_fixnum(retval);
+void *green_live_remove(void *task) {
+  green_task *t = task;
+  
+  if (t->live_prev == NULL) {
+    live_tasks = t->live_next;
+  }
+  else {
+    t->live_prev->live_next = t->live_next;
+  }
+  if (t->live_next != NULL) {
+    t->live_next->live_prev = t->live_prev;
+  }
+  return NULL;
 }
 
+void *green_stack_bottom(void *task) {
+  green_task *t = task;
+  struct GC_stack_base base;
+  
+  base.mem_base = t->stack_top;
+  GC_set_stackbottom(t->scheduler->gc_thread, &base);
+  return NULL;
+}
 
-//  Sequence Constructors / Comprehensions
-//___________________________________//
+void green_signals(int how) {
+  sigset_t signals;
+  
+  sigemptyset(&signals);
+  sigaddset(&signals, GC_get_suspend_signal());
+  pthread_sigmask(how, &signals, NULL);
+}
 
+void green_free_stack(green_task *task) {
+  munmap(task->stack - TASK_GUARD_SIZE, TASK_GUARD_SIZE + TASK_STACK_SIZE);
+  GC_FREE(task);
+}
 
-object *apply_loop_body(object *test, object *arg) {
-  return cons(test, cons(arg, the_empty_list));
+// Free the stacks of tasks that have finished, which can not be done on
+// the stack itself
+void green_reap(green_scheduler *sched) {
+  green_task *task;
+  
+  while ((task = sched->dead) != NULL) {
+    sched->dead = task->next;
+    green_free_stack(task);
+  }
 }
 
-object *make_loop_body(object *exp, object *var) {
-  if (cdr(exp) == the_empty_list) {
-    exp = car(exp);
-    if ((is_pair(exp) && !is_lambda(exp)) || (var == exp)) {
-      return make_lambda(cons(var, the_empty_list), 
-                         cons(exp, the_empty_list));
+void green_switch(green_scheduler *sched, green_task *to) {
+  green_task *from = sched->current;
+  void *marker;
+  
+  green_signals(SIG_BLOCK);
+  from->sp = &marker;
+  from->recover_point = recover_point;
+  sched->current = to;
+  GC_call_with_alloc_lock(green_stack_bottom, to);
+  swapcontext(&from->context, &to->context);
+  // Back on this task's stack, where the task switching here left the
+  // collector
+  from->sp = NULL;
+  recover_point = from->recover_point;
+  green_signals(SIG_UNBLOCK);
+  green_reap(sched);
+}
+
+// Run the next ready task, waiting for a sleeping one if there is none.
+// 0 when nothing but the root task could ever run, and it is the one
+// asking.  A task that gets there first hands over to the root task with
+// deadlock set instead.
+int green_schedule(green_scheduler *sched) {
+  green_task *next;
+  double now;
+  
+  while (1) {
+    if (sched->sleeping_count > 0) {
+      now = green_now();
+      while (sched->sleeping_count > 0 && sched->sleeping[0]->wake <= now) {
+        green_queue_push(&sched->ready, green_sleeping_pop(sched));
+      }
     }
-    else {
-      return exp;
+    if ((next = green_queue_pop(&sched->ready)) != NULL) {
+      if (next != sched->current) {
+        green_switch(sched, next);
+      }
+      return 1;
+    }
+    if (sched->sleeping_count > 0) {
+      flush_output();
+      green_nanosleep(sched->sleeping[0]->wake - now);
+      continue;
+    }
+    if (sched->current == &sched->root) {
+      return 0;
+    }
+    sched->deadlock = 1;
+    green_switch(sched, &sched->root);
+    return 1;
+  }
+}
+
+// Wait in queue until another task wakes this one
+void green_wait(green_scheduler *sched, green_queue *queue, char *name) {
+  green_task *self = sched->current;
+  
+  green_queue_push(queue, self);
+  if (!green_schedule(sched) || sched->deadlock) {
+    sched->deadlock = 0;
+    green_queue_remove(queue, self);
+    error("%s: deadlock, every task is waiting", name);
+  }
+}
+
+// The scheduler of the current interpreter, started when first needed
+green_scheduler *green_scheduler_get(char *name) {
+  green_scheduler *sched = current_interpreter->scheduler;
+  struct GC_stack_base base;
+  
+  if (sched != NULL) {
+    if (!pthread_equal(sched->thread, pthread_self())) {
+      error("%s: tasks only run on the thread that started them", name);
     }
+    return sched;
   }
-  else {
-    return make_lambda(cons(var, the_empty_list),
-                       exp);
+  pthread_once(&green_roots_once, green_roots_install);
+  sched = GC_MALLOC_UNCOLLECTABLE(sizeof(green_scheduler));
+  if (sched == NULL) {
+    error("out of memory\n");
   }
+  sched->gc_thread = GC_get_my_stackbottom(&base);
+  sched->root.scheduler = sched;
+  sched->root.stack_top = base.mem_base;
+  sched->current = &sched->root;
+  sched->thread = pthread_self();
+  GC_call_with_alloc_lock(green_live_add, &sched->root);
+  current_interpreter->scheduler = sched;
+  return sched;
 }
 
-
-//  for
-
-object *h_for(object *exp, object *env) {
-  object *var = car(exp);
-  object *seq = eval(caddr(exp), env);
-  object *expression = make_loop_body(cdddr(exp), var);
-  object *result;
+// Sleep the thread, or only the current task when there are tasks
+void green_sleep(double seconds) {
+  green_scheduler *sched = current_interpreter->scheduler;
   
-  while (h_emptyp(seq) != True) {
-    result = eval(apply_loop_body(expression, h_first(seq)), env);
-    seq = h_rest(seq);
+  if (sched == NULL) {
+    green_nanosleep(seconds);
+    return;
   }
-  return result;
+  sched = green_scheduler_get("sleep");
+  sched->current->wake = green_now() + seconds;
+  green_sleeping_push(sched, sched->current);
+  green_schedule(sched);
 }
 
-
-//  list
-
-object *h_list_for(object *exp, object *env) {
-  object *result_list = the_empty_list;
-  object *var = car(exp);
-  exp = cddr(exp);
-  object *seq = eval(car(exp), env);
-  exp = cdr(exp);
-  object *expression;
-  object *test;
-    
-  // (list for ii in sequence if test expression)
-  if (car(exp) == if_symbol) {
-    test = make_loop_body(cons(cadr(exp), the_empty_list), var);
-    expression = make_loop_body(cddr(exp), var);
-    while (h_emptyp(seq) != True) {
-      if (eval(apply_loop_body(test, h_first(seq)), env) == True) {
-        result_list = cons(eval(apply_loop_body(expression, h_first(seq)), env), 
-                           result_list);
-        seq = h_rest(seq);
-      }
-      else {
-        seq = h_rest(seq);
+// The tasks of an interpreter that is freed never run again
+void green_scheduler_free(green_scheduler *sched) {
+  green_task *task;
+  green_task *next;
+  
+  green_reap(sched);
+  for (task = live_tasks; task != NULL; task = next) {
+    next = task->live_next;
+    if (task->scheduler == sched) {
+      GC_call_with_alloc_lock(green_live_remove, task);
+      if (task != &sched->root) {
+        green_free_stack(task);
       }
     }
-    return h_reverse(result_list);
   }
+  GC_FREE(sched->sleeping);
+  GC_FREE(sched);
+}
 
-  // (list for ii in sequence expression)
+// Where every task starts, on its own stack
+void green_start(void) {
+  green_scheduler *sched = current_interpreter->scheduler;
+  green_task *self = sched->current;
+  object *task = self->task;
+  jmp_buf recover;
+  
+  green_signals(SIG_UNBLOCK);
+  green_reap(sched);
+  recover_point = &recover;
+  if (setjmp(recover) == 0) {
+    task->data.task.value = apply_procedure(self->thunk, the_empty_list);
+    task->data.task.state = FUTURE_DONE;
+  }
   else {
-    expression = make_loop_body(exp, var);
-    while (h_emptyp(seq) != True) {
-      result_list = cons(eval(apply_loop_body(expression, h_first(seq)), env), 
-                          result_list);
-      seq = h_rest(seq);
-    }
-    return h_reverse(result_list);
+    // The value of a failed task is its error message, like a future's
+    task->data.task.value = make_string(error_message);
+    task->data.task.state = FUTURE_FAILED;
   }
+  recover_point = NULL;
+  green_wake_all(sched, task->data.task.waiters);
+  GC_call_with_alloc_lock(green_live_remove, self);
+  self->thunk = NULL;
+  self->next = sched->dead;
+  sched->dead = self;
+  green_schedule(sched);
 }
 
 
-object *h_list_from(object *exp, object *env) {
-  object *result_list = the_empty_list;
-  object *seq = eval(car(exp), env);
-  object *test;
+//  spawn
+//  (spawn thunk) is a new task calling thunk, ready to run after the tasks
+//  already ready
+
+object *p_spawn(object *arguments) {
+  green_scheduler *sched = green_scheduler_get("spawn");
+  object *thunk = car(arguments);
+  green_task *task;
+  char *stack;
   
-  // (list from sequence)
-  if (cdr(exp) == the_empty_list) {
-    while (h_emptyp(seq) != True) {
-      result_list = cons(h_first(seq), result_list);
-      seq = h_rest(seq);
-    }
-    return h_reverse(result_list);
+  if (!is_procedure(thunk)) {
+    error("spawn: expected a procedure");
+  }
+  stack = mmap(NULL, TASK_GUARD_SIZE + TASK_STACK_SIZE,
+               PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS |
+               MAP_NORESERVE | MAP_STACK, -1, 0);
+  if (stack == MAP_FAILED) {
+    error("spawn: out of memory for stacks");
+  }
+  mprotect(stack, TASK_GUARD_SIZE, PROT_NONE);
+  task = GC_MALLOC_UNCOLLECTABLE(sizeof(green_task));
+  if (task == NULL) {
+    munmap(stack, TASK_GUARD_SIZE + TASK_STACK_SIZE);
+    error("out of memory\n");
   }
-  // (list from sequence if test)
-  else {
-    test = caddr(exp);
-    while (h_emptyp(seq) != True) {
-      if (eval(apply_loop_body(test, h_first(seq)), env) == True) {
-        result_list = cons(h_first(seq), result_list);
-        seq = h_rest(seq);
-      }
-      else {
-        seq = h_rest(seq);
-      }
-    }
-    return h_reverse(result_list);
+  task->scheduler = sched;
+  task->stack = stack + TASK_GUARD_SIZE;
+  task->stack_top = task->stack + TASK_STACK_SIZE;
+  task->task = make_task();
+  task->thunk = thunk;
+  getcontext(&task->context);
+  task->context.uc_stack.ss_sp = task->stack;
+  task->context.uc_stack.ss_size = TASK_STACK_SIZE;
+  task->context.uc_link = NULL;
+  // Unblocked by green_start once the collector knows the new stack
+  sigaddset(&task->context.uc_sigmask, GC_get_suspend_signal());
+  makecontext(&task->context, green_start, 0);
+  GC_call_with_alloc_lock(green_live_add, task);
+  green_queue_push(&sched->ready, task);
+  return task->task;
+}
+
+
+//  yield
+//  Lets every ready task run before the current one goes on
+
+object *p_yield(object *arguments) {
+  green_scheduler *sched;
+  
+  // Nothing to let run before the first spawn
+  if (current_interpreter->scheduler == NULL) {
+    return Void;
   }
+  sched = green_scheduler_get("yield");
+  if (sched->ready.head != NULL) {
+    green_queue_push(&sched->ready, sched->current);
+    green_schedule(sched);
+  }
+  return Void;
 }
 
-object *h_list(object *exp, object *env) {
-  // (list for ii in sequence if test expression) || (list for ii in sequence expression)
-  if (car(exp) == for_symbol) {
-    h_list_for(cdr(exp), env);
-  }
-  // (list from sequence if test) || (list from sequence)
-  else if (car(exp) == from_symbol) {
-    h_list_from(cdr(exp), env);
+
+//  task?
+
+object *p_taskp(object *arguments) {
+  return is_task(car(arguments)) ? True : False;
+}
+
+
+// The value of a finished task, waiting for it as touch does
+object *h_touch_task(object *task) {
+  green_scheduler *sched;
+  
+  if (task->data.task.state == FUTURE_PENDING) {
+    sched = green_scheduler_get("touch");
+    while (task->data.task.state == FUTURE_PENDING) {
+      green_wait(sched, task->data.task.waiters, "touch");
+    }
   }
-  else {
-    return list_of_values(exp, env);
+  if (task->data.task.state == FUTURE_FAILED) {
+    error("touch: %s", string_to_c(task->data.task.value));
   }
+  return task->data.task.value;
 }
 
-object *p_list(object *exp) {
-  error("list dummy procedure should not execute!");
+
+//  Channel Procedures
+//___________________________________//
+// A channel is a queue of values between tasks.  Receiving from an empty
+// channel waits for a value, and sending to a full one waits for room.
+
+object *h_channel_argument(object *arguments, char *name) {
+  if (!is_channel(car(arguments))) {
+    error("%s: expected a channel", name);
+  }
+  return car(arguments);
 }
 
 
-//  string
+//  make-channel
+//  (make-channel [capacity]) holds any number of values, or at most capacity
 
-object *h_string(object *exp, object *env) {
-  if (car(exp) == from_symbol) {
-    return make_string_from_list(h_list_from(cdr(exp), env));
-  }
-  else if (car(exp) == for_symbol) {
-    return make_string_from_list(h_list_for(cdr(exp), env));
+object *p_make_channel(object *arguments) {
+  object *capacity;
+  
+  if (arguments == the_empty_list) {
+    return make_channel(0);
   }
-  else {
-    make_string_from_list(list_of_values(exp, env));
+  capacity = car(arguments);
+  if (!is_fixnum(capacity) || capacity->data.fixnum < 1) {
+    error("make-channel: capacity must be a positive fixnum");
   }
+  return make_channel(capacity->data.fixnum);
 }
 
-object *p_string(object *exp) {
-  error("string dummy procedure should not execute!");
+
+//  channel?
+
+object *p_channelp(object *arguments) {
+  return is_channel(car(arguments)) ? True : False;
 }
 
 
-//  vector
+//  channel-send!
+//  (channel-send! channel value)
 
-object *h_vector(object *exp, object *env) {
-  if (car(exp) == from_symbol) {
-    return make_vector_from_list(h_list_from(cdr(exp), env));
+object *p_channel_send(object *arguments) {
+  object *channel = h_channel_argument(arguments, "channel-send!");
+  channel_queue *queue = channel->data.channel.queue;
+  object *item = cons(cadr(arguments), the_empty_list);
+  green_scheduler *sched;
+  
+  if (queue->capacity > 0 && queue->count >= queue->capacity) {
+    sched = green_scheduler_get("channel-send!");
+    while (queue->count >= queue->capacity) {
+      green_wait(sched, queue->senders, "channel-send!");
+    }
   }
-  else if (car(exp) == for_symbol) {
-    return make_vector_from_list(h_list_for(cdr(exp), env));
+  if (queue->head == the_empty_list) {
+    queue->head = item;
   }
   else {
-    make_vector_from_list(list_of_values(exp, env));
+    set_cdr(queue->tail, item);
   }
+  queue->tail = item;
+  queue->count += 1;
+  if (current_interpreter->scheduler != NULL) {
+    green_wake_one(current_interpreter->scheduler, queue->receivers);
+  }
+  return Void;
 }
 
-object *p_vector(object *exp) {
-  error("vector dummy procedure should not execute!");
-}
 
+//  channel-receive
+//  (channel-receive channel) is the oldest value sent to channel
 
-object *p_range(object *args) {
-  int stop;
-  int start;
-  object *result = the_empty_list;
-  if (cdr(args) != the_empty_list) {
-    start = car(args)->data.fixnum;
-    stop = cadr(args)->data.fixnum;
+object *p_channel_receive(object *arguments) {
+  object *channel = h_channel_argument(arguments, "channel-receive");
+  channel_queue *queue = channel->data.channel.queue;
+  green_scheduler *sched;
+  object *value;
+  
+  if (queue->count == 0) {
+    sched = green_scheduler_get("channel-receive");
+    while (queue->count == 0) {
+      green_wait(sched, queue->receivers, "channel-receive");
+    }
   }
-  else {
-    start = 0;
-    stop = car(args)->data.fixnum;
+  value = car(queue->head);
+  queue->head = cdr(queue->head);
+  if (queue->head == the_empty_list) {
+    queue->tail = the_empty_list;
   }
-  while (stop--, stop >= start) {
-    result = cons(make_fixnum(stop), result);
+  queue->count -= 1;
+  if (current_interpreter->scheduler != NULL) {
+    green_wake_one(current_interpreter->scheduler, queue->senders);
   }
-  return result;
+  return value;
 }
 
 
-
 /** ***************************************************************************
 **                                   REPL
 ******************************************************************************/
@@ -2822,6 +10541,21 @@ void populate_initial_environment(object *env) {
   add_procedure("print",   p_print);
   add_procedure("display", p_display);
   add_procedure("load",    p_load);
+  add_procedure("read-all", p_read_all);
+  add_procedure("write",   p_write);
+  add_procedure("write-shared", p_write_shared);
+  add_procedure("flush",   p_flush);
+  
+  add_procedure("write-to-string",       p_write_to_string);
+  add_procedure("with-output-to-string", p_with_output_to_string);
+  add_procedure("open-output-string",    p_open_output_string);
+  add_procedure("get-output-string",     p_get_output_string);
+  
+  add_procedure("open-input-file",  p_open_input_file);
+  add_procedure("open-output-file", p_open_output_file);
+  add_procedure("close-port",       p_close_port);
+  add_procedure("fasl-write",       p_fasl_write);
+  add_procedure("fasl-read",        p_fasl_read);
   
   
   // List Procedures
@@ -2869,6 +10603,9 @@ void populate_initial_environment(object *env) {
   add_procedure("list",      p_list);
   add_procedure("string",    p_string);
   add_procedure("vector",    p_vector);
+  add_procedure("make-vector",  p_make_vector);
+  add_procedure("vector-push!", p_vector_push);
+  add_procedure("vector-pop!",  p_vector_pop);
   
   
   // Sequence Procedures
@@ -2879,6 +10616,55 @@ void populate_initial_environment(object *env) {
   add_procedure("length",    p_length);
   add_procedure("index",     p_index);
   add_procedure("range",     p_range);
+  
+  
+  // String Procedures
+  add_procedure("string-builder", p_string_builder);
+  add_procedure("string-append!", p_string_append);
+  add_procedure("string-join",    p_string_join);
+  add_procedure("string-find",    p_string_find);
+  add_procedure("string-count",   p_string_count);
+  add_procedure("string-split",   p_string_split);
+  add_procedure("string-replace", p_string_replace);
+  
+  
+  // Numeric Vector Procedures
+  add_procedure("f64vector", p_f64vector);
+  add_procedure("s64vector", p_s64vector);
+  add_procedure("u8vector",  p_u8vector);
+  add_procedure("vsum",      p_vsum);
+  add_procedure("vdot",      p_vdot);
+  add_procedure("vmin",      p_vmin);
+  add_procedure("vmax",      p_vmax);
+  add_procedure("v+",        p_vadd);
+  add_procedure("v-",        p_vsub);
+  add_procedure("v*",        p_vmul);
+  add_procedure("vmap",      p_vmap);
+  
+  
+  // Hash Table Procedures
+  add_procedure("make-hash-table", p_make_hash_table);
+  add_procedure("hash-table",      p_hash_table);
+  add_procedure("hash-ref",        p_hash_ref);
+  add_procedure("hash-set!",       p_hash_set);
+  add_procedure("hash-remove!",    p_hash_remove);
+  add_procedure("hash-contains?",  p_hash_containsp);
+  add_procedure("hash-keys",       p_hash_keys);
+  add_procedure("hash-values",     p_hash_values);
+  
+  
+  // Persistent Collection Procedures
+  add_procedure("persistent-vector", p_persistent_vector);
+  add_procedure("persistent-map",    p_persistent_map);
+  add_procedure("assoc",             p_assoc);
+  add_procedure("dissoc",            p_dissoc);
+  add_procedure("conj",              p_conj);
+  add_procedure("get",               p_get);
+  add_procedure("transient",         p_transient);
+  add_procedure("persistent!",       p_persistent_bang);
+  add_procedure("assoc!",            p_assoc_bang);
+  add_procedure("dissoc!",           p_dissoc_bang);
+  add_procedure("conj!",             p_conj_bang);
 
   
   // Meta-data Procedures
@@ -2894,6 +10680,20 @@ void populate_initial_environment(object *env) {
   // System Procedures
   add_procedure("system",    p_system);
   
+  
+  // Futures
+  add_procedure("touch",     p_touch);
+  
+  
+  // Tasks
+  add_procedure("spawn",           p_spawn);
+  add_procedure("yield",           p_yield);
+  add_procedure("task?",           p_taskp);
+  add_procedure("make-channel",    p_make_channel);
+  add_procedure("channel?",        p_channelp);
+  add_procedure("channel-send!",   p_channel_send);
+  add_procedure("channel-receive", p_channel_receive);
+  
 }
 
 
@@ -2907,7 +10707,7 @@ object *make_initial_environment(void) {
 }
 
 
-void init(void) {
+void init_constants(void) {
   the_empty_list = alloc_object();
   the_empty_list->type = THE_EMPTY_LIST;
   
@@ -2942,36 +10742,379 @@ void init(void) {
   else_symbol         = make_symbol("else");
   rest_symbol         = make_symbol("&rest");
   for_symbol          = make_symbol("for");
+  pfor_symbol         = make_symbol("pfor");
+  future_symbol       = make_symbol("future");
+  pmap_symbol         = make_symbol("pmap");
+  workers_keyword     = make_symbol(":workers");
   from_symbol         = make_symbol("from");
   list_symbol         = make_symbol("list");
   vector_symbol       = make_symbol("vector");
+  f64vector_symbol    = make_symbol("f64vector");
+  s64vector_symbol    = make_symbol("s64vector");
+  u8vector_symbol     = make_symbol("u8vector");
+  hash_table_symbol   = make_symbol("hash-table");
   string_symbol       = make_symbol("string");
   
   define_macro_symbol = make_symbol("define-macro");
   test_symbol         = make_symbol("test");
+}
+
+pthread_once_t constants_once = PTHREAD_ONCE_INIT;
+pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+
+void exit_start(void) {
+  atexit(flush_all_output);
+}
+
+// A new interpreter with its own global environment.  It is uncollectable,
+// since threads only reach it through current_interpreter.
+interpreter *make_interpreter(void) {
+  interpreter *interp;
+  
+  pthread_once(&constants_once, init_constants);
+  pthread_once(&exit_once, exit_start);
+  interp = GC_MALLOC_UNCOLLECTABLE(sizeof(interpreter));
+  if (interp == NULL) {
+    error("out of memory\n");
+  }
+  interp->global_environment = make_initial_environment();
+  interp->stdout_port = make_port(stdout, OUTPUT_PORT);
+  interp->output_port = interp->stdout_port;
+  interp->output_files = the_empty_list;
+  pthread_mutex_lock(&ports_lock);
+  interp->next = interpreters;
+  interpreters = interp;
+  pthread_mutex_unlock(&ports_lock);
+  return interp;
+}
+
+void init(void) {
+  current_interpreter = make_interpreter();
   
-  the_global_environment = make_initial_environment();
+  // The REPL thread pushes its futures onto a deque like a worker
+  main_deque = make_task_deque();
+  own_deque = main_deque;
 }
 
 
 // REPL
 //___________________________________//
 
+// Results are printed cut off at these limits so a huge or circular value
+// does not flood or hang the terminal
+#define REPL_MAX_DEPTH  100
+#define REPL_MAX_LENGTH 1000
+
 void REPL(void) {
   object *input;
   object *output;
   
   while (1) {
-    printf("> ");
+    // An error may have left output redirected to a string port
+    current_interpreter->output_port = current_interpreter->stdout_port;
+    port_write(current_interpreter->stdout_port, "> ", 2);
+    flush_output();
     input = lispy_read(stdin);
-    output = eval(input, the_global_environment);
+    output = eval(input, current_interpreter->global_environment);
     if (output != Void) {
-      write(output);
-      printf("\n");
+      write_limited(current_interpreter->stdout_port, output,
+                    REPL_MAX_DEPTH, REPL_MAX_LENGTH);
+      port_putc(current_interpreter->stdout_port, '\n');
+    }
+  }
+}
+
+void raise_error(const char *format, ...) {
+  va_list args;
+  
+  va_start(args, format);
+  vsnprintf(error_message, ERROR_MESSAGE_SIZE, format, args);
+  va_end(args);
+  if (recover_point != NULL) {
+    longjmp(*recover_point, 1);
+  }
+  // What was written before the error goes out ahead of its message
+  flush_output();
+  fprintf(stderr, "%s\n", error_message);
+  REPL();
+}
+
+/** ***************************************************************************
+**                               Host API
+******************************************************************************/
+// What lispy.h declares for programs embedding Lispy.  Each call runs on the
+// given interpreter with errors jumping back to it, so they return NULL and
+// reach the error handler instead of starting a REPL.
+
+pthread_once_t gc_once = PTHREAD_ONCE_INIT;
+
+void gc_start(void) {
+  GC_INIT();
+  GC_allow_register_threads();
+}
+
+// Host threads were not made through the collector's pthread_create, so it
+// has to be told about their stacks
+void api_register_thread(void) {
+  struct GC_stack_base stack;
+  
+  pthread_once(&gc_once, gc_start);
+  if (!GC_thread_is_registered() && GC_get_stack_base(&stack) == GC_SUCCESS) {
+    GC_register_my_thread(&stack);
+  }
+}
+
+// fn(arg) on interp, or NULL after an error
+object *api_call(interpreter *interp, object *(*fn)(void *arg), void *arg) {
+  jmp_buf recover;
+  jmp_buf *outer = recover_point;
+  interpreter *outer_interpreter = current_interpreter;
+  object *volatile result = NULL;
+  
+  api_register_thread();
+  current_interpreter = interp;
+  recover_point = &recover;
+  if (setjmp(recover) == 0) {
+    result = fn(arg);
+    flush_output();
+  }
+  else {
+    // As the REPL does, in case the error left output redirected
+    interp->output_port = interp->stdout_port;
+    strcpy(interp->error_message, error_message);
+    if (interp->error_handler != NULL) {
+      interp->error_handler(interp, interp->error_message, interp->error_data);
     }
   }
+  recover_point = outer;
+  current_interpreter = outer_interpreter;
+  return result;
+}
+
+
+// Interpreters
+//___________________________________//
+
+lispy_interpreter *lispy_new(void) {
+  api_register_thread();
+  return make_interpreter();
+}
+
+void lispy_free(lispy_interpreter *interp) {
+  interpreter **link;
+
+  pthread_mutex_lock(&ports_lock);
+  interpreter_flush_all(interp);
+  for (link = &interpreters; *link != interp; link = &(*link)->next) {
+  }
+  *link = interp->next;
+  pthread_mutex_unlock(&ports_lock);
+  // pmap's workers are copies of it, and it logs changes for them
+  pthread_mutex_lock(&pmap_lock);
+  if (pmap_interpreter == interp) {
+    pmap_stop();
+    pmap_interpreter = NULL;
+  }
+  pthread_mutex_unlock(&pmap_lock);
+  if (interp->scheduler != NULL) {
+    green_scheduler_free(interp->scheduler);
+  }
+  GC_FREE(interp);
+}
+
+object *api_eval_string(void *source) {
+  long length = strlen(source);
+  char *buffer = GC_MALLOC_ATOMIC(length + 64);   // padded for read_buffer
+  object *exps;
+  object *result = Void;
+  
+  if (buffer == NULL) {
+    error("out of memory\n");
+  }
+  memcpy(buffer, source, length);
+  for (exps = read_buffer(buffer, length); exps != the_empty_list;
+       exps = cdr(exps)) {
+    result = eval(car(exps), current_interpreter->global_environment);
+  }
+  return result;
+}
+
+lispy_value *lispy_eval_string(lispy_interpreter *interp, const char *source) {
+  return api_call(interp, api_eval_string, (void *) source);
+}
+
+object *api_eval_file(void *filename) {
+  return p_load(cons(make_string(filename), the_empty_list));
+}
+
+lispy_value *lispy_eval_file(lispy_interpreter *interp, const char *filename) {
+  return api_call(interp, api_eval_file, (void *) filename);
+}
+
+// What lispy_define and lispy_define_primitive pass through api_call
+typedef struct api_definition {
+  const char *name;
+  object *value;                          // or NULL to make one from fn
+  lispy_primitive fn;
+} api_definition;
+
+object *api_define(void *arg) {
+  api_definition *definition = arg;
+
+  if (definition->value == NULL) {
+    definition->value = make_primitive_procedure(definition->fn);
+  }
+  define_variable(make_symbol((char *) definition->name), definition->value,
+                  current_interpreter->global_environment);
+  return Void;
+}
+
+void lispy_define(lispy_interpreter *interp, const char *name,
+                  lispy_value *value) {
+  api_definition definition = {name, value, NULL};
+
+  api_call(interp, api_define, &definition);
+}
+
+void lispy_define_primitive(lispy_interpreter *interp, const char *name,
+                            lispy_primitive fn) {
+  api_definition definition = {name, NULL, fn};
+
+  api_call(interp, api_define, &definition);
+}
+
+
+// Errors
+//___________________________________//
+
+void lispy_set_error_handler(lispy_interpreter *interp,
+                             lispy_error_handler handler, void *data) {
+  interp->error_handler = handler;
+  interp->error_data = data;
+}
+
+// The message of the last error, empty if there was none
+const char *lispy_error_message(lispy_interpreter *interp) {
+  return interp->error_message;
+}
+
+void lispy_raise(const char *message) {
+  error("%s", message);
+}
+
+
+// Values
+//___________________________________//
+
+lispy_value *lispy_fixnum(long int value) {
+  return make_fixnum(value);
+}
+
+lispy_value *lispy_flonum(double value) {
+  return make_flonum(value);
+}
+
+lispy_value *lispy_boolean(int value) {
+  return value ? True : False;
+}
+
+lispy_value *lispy_string(const char *value) {
+  return make_string((char *) value);
+}
+
+lispy_value *lispy_symbol(const char *name) {
+  return make_symbol((char *) name);
+}
+
+lispy_value *lispy_cons(lispy_value *car, lispy_value *cdr) {
+  return cons(car, cdr);
+}
+
+lispy_value *lispy_empty_list(void) {
+  return the_empty_list;
+}
+
+lispy_value *lispy_void(void) {
+  return Void;
+}
+
+int lispy_is_fixnum(lispy_value *value) {
+  return is_fixnum(value);
+}
+
+int lispy_is_flonum(lispy_value *value) {
+  return is_flonum(value);
+}
+
+int lispy_is_string(lispy_value *value) {
+  return is_string(value);
+}
+
+int lispy_is_symbol(lispy_value *value) {
+  return is_symbol(value);
+}
+
+int lispy_is_pair(lispy_value *value) {
+  return is_pair(value);
+}
+
+int lispy_is_empty_list(lispy_value *value) {
+  return value == the_empty_list;
+}
+
+int lispy_is_true(lispy_value *value) {
+  return is_true(value);
+}
+
+lispy_value *lispy_car(lispy_value *pair) {
+  return car(pair);
+}
+
+lispy_value *lispy_cdr(lispy_value *pair) {
+  return cdr(pair);
+}
+
+long int lispy_to_long(lispy_value *value) {
+  if (is_fixnum(value)) {
+    return value->data.fixnum;
+  }
+  if (is_flonum(value)) {
+    return (long int) value->data.flonum;
+  }
+  return 0;
+}
+
+double lispy_to_double(lispy_value *value) {
+  if (is_flonum(value)) {
+    return value->data.flonum;
+  }
+  if (is_fixnum(value)) {
+    return value->data.fixnum;
+  }
+  return 0;
+}
+
+const char *lispy_to_string(lispy_value *value) {
+  if (is_string(value)) {
+    return string_to_c(value);
+  }
+  if (is_symbol(value)) {
+    return value->data.symbol;
+  }
+  return NULL;
+}
+
+const char *lispy_write_string(lispy_value *value) {
+  object *port = make_port(NULL, STRING_PORT);
+  
+  write_object(port, value);
+  return string_to_c(port_to_string(port));
 }
 
+
+
+// liblispy is built with -DLISPY_LIBRARY and leaves main to the host
+#ifndef LISPY_LIBRARY
 int main(void) {
 
   GC_INIT();
@@ -2996,3 +11139,4 @@ int main(void) {
   
   return 0;
 }
+#endif
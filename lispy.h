@@ -0,0 +1,119 @@
+/******************************************************************************
+** Lispy is a simple interpreter for a Scheme/Python-like language
+** Copyright (C) 2010, 2011 Jack Trades (jacktradespublic@gmail.com)
+**
+** This file is part of Lispy
+**
+** Lispy is free software: you can redistribute it and/or
+** modify it under the terms of the GNU Affero General Public
+** License version 3 as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU Affero General Public License version 3 for more details.
+**
+** You should have received a copy of the GNU Affero General Public
+** License version 3 along with this program. If not, see
+** <http://www.gnu.org/licenses/>.
+**
+*******************************************************************************
+**
+** The interface for embedding Lispy in another program, built with
+** `make liblispy.a` or `make liblispy.so`.
+**
+** Every interpreter has its own global environment.  Interpreters can be
+** used from any thread, but one interpreter only from one thread at a time.
+**
+** Values belong to Lispy's garbage collector.  Keep the ones you hold on to
+** in variables on the stack, or define them in an interpreter; the collector
+** does not look inside memory from malloc or new.
+**
+** An error while evaluating makes lispy_eval_string or lispy_eval_file
+** return NULL.  The interpreter's error handler, when one is set, is called
+** with the message first.  A primitive written in C reports an error with
+** lispy_raise, which does not return: it longjmps back to the eval call, so
+** it must not skip C++ destructors on the way.
+**
+******************************************************************************/
+
+#ifndef LISPY_H
+#define LISPY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LISPY_API __attribute__((visibility("default")))
+
+typedef struct lispy_object lispy_value;
+typedef struct lispy_interpreter lispy_interpreter;
+
+// Called with the evaluated arguments as a list
+typedef lispy_value *(*lispy_primitive)(lispy_value *arguments);
+
+typedef void (*lispy_error_handler)(lispy_interpreter *interp,
+                                    const char *message, void *data);
+
+
+// Interpreters
+LISPY_API lispy_interpreter *lispy_new(void);
+LISPY_API void lispy_free(lispy_interpreter *interp);
+
+// The value of the last expression, or NULL after an error
+LISPY_API lispy_value *lispy_eval_string(lispy_interpreter *interp,
+                                         const char *source);
+LISPY_API lispy_value *lispy_eval_file(lispy_interpreter *interp,
+                                       const char *filename);
+
+// Define name in interp's global environment
+LISPY_API void lispy_define(lispy_interpreter *interp, const char *name,
+                            lispy_value *value);
+LISPY_API void lispy_define_primitive(lispy_interpreter *interp,
+                                      const char *name, lispy_primitive fn);
+
+// Errors
+LISPY_API void lispy_set_error_handler(lispy_interpreter *interp,
+                                       lispy_error_handler handler,
+                                       void *data);
+LISPY_API const char *lispy_error_message(lispy_interpreter *interp);
+LISPY_API void lispy_raise(const char *message);
+
+
+// Making values
+LISPY_API lispy_value *lispy_fixnum(long int value);
+LISPY_API lispy_value *lispy_flonum(double value);
+LISPY_API lispy_value *lispy_boolean(int value);
+LISPY_API lispy_value *lispy_string(const char *value);
+LISPY_API lispy_value *lispy_symbol(const char *name);
+LISPY_API lispy_value *lispy_cons(lispy_value *car, lispy_value *cdr);
+LISPY_API lispy_value *lispy_empty_list(void);
+LISPY_API lispy_value *lispy_void(void);
+
+// Examining values
+LISPY_API int lispy_is_fixnum(lispy_value *value);
+LISPY_API int lispy_is_flonum(lispy_value *value);
+LISPY_API int lispy_is_string(lispy_value *value);
+LISPY_API int lispy_is_symbol(lispy_value *value);
+LISPY_API int lispy_is_pair(lispy_value *value);
+LISPY_API int lispy_is_empty_list(lispy_value *value);
+LISPY_API int lispy_is_true(lispy_value *value);
+
+LISPY_API lispy_value *lispy_car(lispy_value *pair);
+LISPY_API lispy_value *lispy_cdr(lispy_value *pair);
+
+// The number of a fixnum or flonum, 0 for anything else
+LISPY_API long int lispy_to_long(lispy_value *value);
+LISPY_API double lispy_to_double(lispy_value *value);
+
+// The characters of a string or the name of a symbol, NULL for anything else
+LISPY_API const char *lispy_to_string(lispy_value *value);
+
+// value as write prints it
+LISPY_API const char *lispy_write_string(lispy_value *value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif